@@ -0,0 +1,158 @@
+/*
+	Benchmark of the socket_server send path : direct write by the worker , and the writev flush of the queued buffers.
+	usage : writev_bench [packet size] [packets per flush] [rounds] [sndbuf]
+	A socketpair is bound to socket_server, the writer sends a burst of small packets like a gate broadcast does,
+	and a reader thread drains the other end. sndbuf (0 for the default) makes the kernel buffer small,
+	so more packets are queued and flushed by the socket thread.
+ */
+
+#include "socket_server.h"
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+struct bench {
+	struct socket_server * ss;
+	int fd;	// the reader end
+	volatile int opened;
+	volatile int64_t received;
+};
+
+static void *
+_poll(void *p) {
+	struct bench * b = p;
+	struct socket_message result;
+	for (;;) {
+		int type = socket_server_poll(b->ss, &result, NULL);
+		switch (type) {
+		case SOCKET_EXIT:
+			return NULL;
+		case SOCKET_OPEN:
+			b->opened = 1;
+			break;
+		case SOCKET_DATA:
+			socket_server_free_buffer(result.data);
+			break;
+		case SOCKET_ERROR:
+			fprintf(stderr, "socket %d closed\n", result.id);
+			break;
+		}
+	}
+}
+
+static void *
+_reader(void *p) {
+	struct bench * b = p;
+	char buffer[65536];
+	for (;;) {
+		int n = read(b->fd, buffer, sizeof(buffer));
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		__sync_add_and_fetch(&b->received, n);
+	}
+	return NULL;
+}
+
+static double
+_now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int
+_info(struct socket_server *ss, int id, struct socket_info *si) {
+	struct socket_info info[16];
+	int n = socket_server_info(ss, info, 16);
+	int i;
+	for (i=0;i<n && i<16;i++) {
+		if (info[i].id == id) {
+			*si = info[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int
+main(int argc, char * argv[]) {
+	int size = argc > 1 ? atoi(argv[1]) : 64;
+	int count = argc > 2 ? atoi(argv[2]) : 500;
+	int rounds = argc > 3 ? atoi(argv[3]) : 2000;
+	int sndbuf = argc > 4 ? atoi(argv[4]) : 0;
+	if (size <= 0 || count <= 0 || rounds <= 0 || sndbuf < 0) {
+		fprintf(stderr, "usage : %s [packet size] [packets per flush] [rounds] [sndbuf]\n", argv[0]);
+		return 1;
+	}
+	printf("packet size %d , %d packets per flush , %d rounds , sndbuf %d\n", size, count, rounds, sndbuf);
+
+	int fd[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd)) {
+		perror("socketpair");
+		return 1;
+	}
+	if (sndbuf > 0) {
+		setsockopt(fd[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	}
+
+	struct bench b;
+	memset(&b, 0, sizeof(b));
+	b.ss = socket_server_create(NULL, 0);
+	b.fd = fd[1];
+	pthread_t poll_pid, reader_pid;
+	pthread_create(&poll_pid, NULL, _poll, &b);
+	pthread_create(&reader_pid, NULL, _reader, &b);
+
+	int id = socket_server_bind(b.ss, 0, fd[0]);
+	socket_server_start(b.ss, 0, id);
+	while (!b.opened) {
+		usleep(1000);
+	}
+
+	int64_t expect = 0;
+	double t = _now();
+	int i, j;
+	for (i=0;i<rounds;i++) {
+		for (j=0;j<count;j++) {
+			char * buffer = malloc(size);
+			memset(buffer, j, size);
+			socket_server_send(b.ss, id, buffer, size);
+		}
+		// wait for the burst , so every round starts with an empty queue
+		expect += (int64_t)size * count;
+		while (b.received < expect) {
+		}
+	}
+	double cost = _now() - t;
+
+	struct socket_info si;
+	if (_info(b.ss, id, &si)) {
+		memset(&si, 0, sizeof(si));
+	}
+	double packets = (double)count * rounds;
+	printf("%10.1f MB/s %12.0f packets/s %10llu write calls %6.3f calls/packet\n",
+		expect / cost / (1024*1024), packets / cost,
+		(unsigned long long)si.wcall, si.wcall / packets);
+
+	socket_server_close(b.ss, 0, id);
+	socket_server_exit(b.ss);
+	pthread_join(poll_pid, NULL);
+	socket_server_release(b.ss);
+	// socket_server doesn't close a bound fd
+	close(fd[0]);
+	pthread_join(reader_pid, NULL);
+	close(fd[1]);
+	return 0;
+}
@@ -3,6 +3,12 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <assert.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "lua.h"
 #include "lualib.h"
@@ -10,6 +16,7 @@
 
 #include "luacompat52.h"
 #include "skynet_socket.h"
+#include "socket_server.h"
 #include "service_lua.h"
 
 #define BACKLOG 32
@@ -37,7 +44,7 @@ lfreepool(lua_State *L) {
 	for (i=0;i<sz;i++) {
 		struct buffer_node *node = &pool[i];
 		if (node->msg) {
-			free(node->msg);
+			skynet_socket_free_buffer(node->msg);
 			node->msg = NULL;
 		}
 	}
@@ -141,7 +148,7 @@ return_free_node(lua_State *L, int pool, struct socket_buffer *sb) {
 	lua_rawgeti(L,pool,1);
 	free_node->next = lua_touserdata(L,-1);
 	lua_pop(L,1);
-	free(free_node->msg);
+	skynet_socket_free_buffer(free_node->msg);
 	free_node->msg = NULL;
 
 	free_node->sz = 0;
@@ -254,7 +261,7 @@ static int
 ldrop(lua_State *L) {
 	void * msg = lua_touserdata(L,1);
 	luaL_checkinteger(L,2);
-	free(msg);
+	skynet_socket_free_buffer(msg);
 	return 0;
 }
 
@@ -332,28 +339,93 @@ lstr2p(lua_State *L) {
 	return 2;
 }
 
+// packet(msg, sz [, offset]) : the string of a framed SKYNET_SOCKET_TYPE_DATA , msg is freed
+static int
+lpacket(lua_State *L) {
+	char * msg = lua_touserdata(L,1);
+	int sz = luaL_checkinteger(L,2);
+	int offset = luaL_optinteger(L,3,0);
+	lua_pushlstring(L, msg + offset, sz);
+	skynet_socket_free_buffer(msg);
+	return 1;
+}
+
 // for skynet socket
 
+// push 5 values : type n1 n2 ptr_or_string address_string_or_nil. padding is the string after the message
+static void
+unpack_message(lua_State *L, struct skynet_socket_message *message, const char * padding, int padsz) {
+	lua_pushinteger(L, message->type);
+	lua_pushinteger(L, message->id);
+	lua_pushinteger(L, message->ud);
+	if (message->type == SKYNET_SOCKET_TYPE_UDP) {
+		int addrsz = 0;
+		const struct socket_udp_address * addr = skynet_socket_udp_address(message, &addrsz);
+		lua_pushlstring(L, message->buffer, message->ud);
+		if (addr) {
+			lua_pushlstring(L, (const char *)addr, addrsz);
+		} else {
+			lua_pushnil(L);
+		}
+		skynet_socket_free_buffer(message->buffer);
+		return;
+	}
+	if (padding) {
+		if (padsz > 0 && padding[padsz-1] == '\0') {
+			// the tail 0 of the string after the message
+			--padsz;
+		}
+		lua_pushlstring(L, padding, padsz);
+	} else {
+		lua_pushlightuserdata(L, message->buffer);
+		if (message->type == SKYNET_SOCKET_TYPE_DATA && message->offset > 0) {
+			// framing packet
+			lua_pushinteger(L, message->offset);
+			return;
+		}
+	}
+	lua_pushnil(L);
+}
+
 /*
 	lightuserdata msg
 	integer size
 
 	return type n1 n2 ptr_or_string
+	udp returns type id size data_string address_string
+	batch returns type 0 n table , the table has 5 fields (type n1 n2 data address) of each message
 */
 static int
 lunpack(lua_State *L) {
 	struct skynet_socket_message *message = lua_touserdata(L,1);
 	int size = luaL_checkinteger(L,2);
 
-	lua_pushinteger(L, message->type);
-	lua_pushinteger(L, message->id);
-	lua_pushinteger(L, message->ud);
+	if (message->type == SKYNET_SOCKET_TYPE_BATCH) {
+		int n = message->ud;
+		lua_pushinteger(L, message->type);
+		lua_pushinteger(L, 0);
+		lua_pushinteger(L, n);
+		lua_createtable(L, n * 5, 0);
+		int i,j;
+		for (i=0;i<n;i++) {
+			struct skynet_socket_message * m = message + 1 + i;
+			if (m->type == SKYNET_SOCKET_TYPE_CONNECT || m->type == SKYNET_SOCKET_TYPE_ACCEPT || m->type == SKYNET_SOCKET_TYPE_ERROR) {
+				unpack_message(L, m, m->buffer, strlen(m->buffer));
+			} else {
+				unpack_message(L, m, NULL, 0);
+			}
+			for (j=5;j>0;j--) {
+				lua_rawseti(L, -1-j, i*5+j);
+			}
+		}
+		return 4;
+	}
 	if (message->buffer == NULL) {
-		lua_pushlstring(L, (char *)(message+1),size - sizeof(*message));
+		unpack_message(L, message, (const char *)(message+1), size - sizeof(*message));
 	} else {
-		lua_pushlightuserdata(L, message->buffer);
+		unpack_message(L, message, NULL, 0);
 	}
-	return 4;
+	return 5;
 }
 
 static int
@@ -363,7 +435,11 @@ lconnect(lua_State *L) {
 	char tmp[sz];
 	int port;
 	const char * host;
-	if (lua_isnoneornil(L,2)) {
+	if (lua_isnoneornil(L,2) && (addr[0] == '/' || strncmp(addr, "unix:", 5) == 0)) {
+		// unix domain socket
+		host = addr;
+		port = 0;
+	} else if (lua_isnoneornil(L,2)) {
 		const char * sep = strchr(addr,':');
 		if (sep == NULL) {
 			return luaL_error(L, "Connect to invalid address %s.",addr);
@@ -376,8 +452,10 @@ lconnect(lua_State *L) {
 		host = addr;
 		port = luaL_checkinteger(L,2);
 	}
+	// timeout is in 1/100 second , like skynet.sleep
+	int timeout = luaL_optinteger(L, 3, 0);
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
-	int id = skynet_socket_connect(ctx, host, port);
+	int id = skynet_socket_connect_timeout(ctx, host, port, timeout > 0 ? timeout * 10 : 0);
 	lua_pushinteger(L, id);
 
 	return 1;
@@ -394,10 +472,32 @@ lclose(lua_State *L) {
 static int
 llisten(lua_State *L) {
 	const char * host = luaL_checkstring(L,1);
-	int port = luaL_checkinteger(L,2);
+	// port is ignored by unix domain socket
+	int port = luaL_optinteger(L,2,0);
 	int backlog = luaL_optinteger(L,3,BACKLOG);
+	// socket.listen(host, port, backlog, reuseport)
+	// or socket.listen(host, port, backlog, { reuseport, nodelay, ipv6only, rcvbuf, sndbuf, defer_accept })
+	struct socket_listen_opt opt;
+	memset(&opt, 0, sizeof(opt));
+	if (lua_istable(L,4)) {
+		lua_getfield(L, 4, "reuseport");
+		opt.flags |= lua_toboolean(L, -1) ? SOCKET_LISTEN_REUSEPORT : 0;
+		lua_getfield(L, 4, "nodelay");
+		opt.flags |= lua_toboolean(L, -1) ? SOCKET_LISTEN_NODELAY : 0;
+		lua_getfield(L, 4, "ipv6only");
+		opt.flags |= lua_toboolean(L, -1) ? SOCKET_LISTEN_IPV6ONLY : 0;
+		lua_getfield(L, 4, "rcvbuf");
+		opt.rcvbuf = (int)lua_tointeger(L, -1);
+		lua_getfield(L, 4, "sndbuf");
+		opt.sndbuf = (int)lua_tointeger(L, -1);
+		lua_getfield(L, 4, "defer_accept");
+		opt.defer_accept = (int)lua_tointeger(L, -1);
+		lua_pop(L, 6);
+	} else if (lua_toboolean(L,4)) {
+		opt.flags = SOCKET_LISTEN_REUSEPORT;
+	}
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
-	int id = skynet_socket_listen(ctx, host,port,backlog);
+	int id = skynet_socket_listen_opt(ctx, host,port,backlog,&opt);
 	if (id < 0) {
 		return luaL_error(L, "Listen error");
 	}
@@ -427,6 +527,48 @@ lsend(lua_State *L) {
 	return 1;
 }
 
+// a segment is at most 1G , larger files are sent in many segments
+#define MAX_FILE_SEGMENT (1 << 30)
+
+// sendfile(id, filename [, offset, size]) , return false when the file can't be opened or the socket is closed
+static int
+lsendfile(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	const char * filename = luaL_checkstring(L, 2);
+	int64_t offset = (int64_t)luaL_optnumber(L, 3, 0);
+	int64_t size = (int64_t)luaL_optnumber(L, 4, -1);
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	if (size < 0) {
+		struct stat st;
+		if (fstat(fd, &st) < 0 || st.st_size < offset) {
+			close(fd);
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, "invalid offset");
+			return 2;
+		}
+		size = st.st_size - offset;
+	}
+	while (size > MAX_FILE_SEGMENT) {
+		int part = dup(fd);
+		if (part < 0 || skynet_socket_sendfile(ctx, id, part, offset, MAX_FILE_SEGMENT)) {
+			close(fd);
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+		offset += MAX_FILE_SEGMENT;
+		size -= MAX_FILE_SEGMENT;
+	}
+	int err = skynet_socket_sendfile(ctx, id, fd, offset, (int)size);
+	lua_pushboolean(L, !err);
+	return 1;
+}
+
 static int
 lbind(lua_State *L) {
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
@@ -444,6 +586,195 @@ lstart(lua_State *L) {
 	return 0;
 }
 
+// framing(id, header [, max]) , header is 2 or 4 (0 for off) , max 0 for 16M
+static int
+lframing(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	int header = luaL_checkinteger(L, 2);
+	int max = luaL_optinteger(L, 3, 0);
+	if (header != 0 && header != 2 && header != 4) {
+		return luaL_error(L, "Invalid header size %d", header);
+	}
+	skynet_socket_framing(ctx, id, header, max);
+	return 0;
+}
+
+static int
+lwatermark(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	int high = luaL_checkinteger(L, 2);
+	int low = luaL_optinteger(L, 3, -1);
+	skynet_socket_watermark(ctx, id, high, low);
+	return 0;
+}
+
+// setopt(id, name [, value]) , name is nodelay, keepalive, keepidle, sndbuf, rcvbuf or quickack. value is true by default
+static int
+lsetopt(lua_State *L) {
+	static const char * names[] = { "nodelay", "keepalive", "keepidle", "sndbuf", "rcvbuf", "quickack", NULL };
+	static const int opts[] = { SOCKET_OPT_NODELAY, SOCKET_OPT_KEEPALIVE, SOCKET_OPT_KEEPIDLE, SOCKET_OPT_SNDBUF, SOCKET_OPT_RCVBUF, SOCKET_OPT_QUICKACK };
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	int what = opts[luaL_checkoption(L, 2, NULL, names)];
+	int value;
+	if (lua_isnoneornil(L, 3)) {
+		value = 1;
+	} else if (lua_isboolean(L, 3)) {
+		value = lua_toboolean(L, 3);
+	} else {
+		value = luaL_checkinteger(L, 3);
+	}
+	skynet_socket_setopt(ctx, id, what, value);
+	return 0;
+}
+
+// the socket messages of one poll round come in one batch , see socket.lua
+static int
+lbatch(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int enable = lua_isnoneornil(L, 1) || lua_toboolean(L, 1);
+	skynet_socket_batch(ctx, enable);
+	return 0;
+}
+
+static const char *
+info_type(int type) {
+	switch (type) {
+	case SOCKET_INFO_LISTEN:
+		return "listen";
+	case SOCKET_INFO_TCP:
+		return "tcp";
+	case SOCKET_INFO_UDP:
+		return "udp";
+	case SOCKET_INFO_BIND:
+		return "bind";
+	case SOCKET_INFO_CONNECTING:
+		return "connecting";
+	default:
+		return "unknown";
+	}
+}
+
+// return an array of { id, type, address, read, write, rcall, wcall, wbuffer, rtime, wtime } , one for each live socket
+static int
+linfo(lua_State *L) {
+	int max = 256;
+	struct socket_info * info = NULL;
+	int n;
+	for (;;) {
+		info = realloc(info, max * sizeof(*info));
+		n = skynet_socket_info(info, max);
+		if (n <= max)
+			break;
+		max = n;
+	}
+	lua_createtable(L, n, 0);
+	int i;
+	for (i=0;i<n;i++) {
+		struct socket_info * si = &info[i];
+		lua_createtable(L, 0, 10);
+		lua_pushinteger(L, si->id);
+		lua_setfield(L, -2, "id");
+		lua_pushstring(L, info_type(si->type));
+		lua_setfield(L, -2, "type");
+		lua_pushinteger(L, (lua_Integer)si->opaque);
+		lua_setfield(L, -2, "address");
+		lua_pushnumber(L, (lua_Number)si->read);
+		lua_setfield(L, -2, "read");
+		lua_pushnumber(L, (lua_Number)si->write);
+		lua_setfield(L, -2, "write");
+		lua_pushnumber(L, (lua_Number)si->rcall);
+		lua_setfield(L, -2, "rcall");
+		lua_pushnumber(L, (lua_Number)si->wcall);
+		lua_setfield(L, -2, "wcall");
+		lua_pushnumber(L, (lua_Number)si->wbuffer);
+		lua_setfield(L, -2, "wbuffer");
+		lua_pushnumber(L, (lua_Number)si->rtime);
+		lua_setfield(L, -2, "rtime");
+		lua_pushnumber(L, (lua_Number)si->wtime);
+		lua_setfield(L, -2, "wtime");
+		lua_rawseti(L, -2, i+1);
+	}
+	free(info);
+	return 1;
+}
+
+// udp
+
+static int
+ludp(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	const char * host = luaL_optstring(L, 1, NULL);
+	int port = luaL_optinteger(L, 2, 0);
+	int id = skynet_socket_udp(ctx, host, port);
+	if (id < 0) {
+		return luaL_error(L, "udp init failed");
+	}
+	lua_pushinteger(L, id);
+	return 1;
+}
+
+static int
+ludp_connect(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	const char * host = luaL_checkstring(L, 2);
+	int port = luaL_checkinteger(L, 3);
+	if (skynet_socket_udp_connect(ctx, id, host, port)) {
+		return luaL_error(L, "udp connect failed");
+	}
+	return 0;
+}
+
+static int
+ludp_send(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	const struct socket_udp_address * address = (const struct socket_udp_address *)luaL_checkstring(L, 2);
+	void *buffer;
+	int sz;
+	if (lua_isuserdata(L,3)) {
+		buffer = lua_touserdata(L,3);
+		sz = luaL_checkinteger(L,4);
+	} else {
+		size_t len = 0;
+		const char * str = luaL_checklstring(L, 3, &len);
+		buffer = malloc(len);
+		memcpy(buffer, str, len);
+		sz = (int)len;
+	}
+	int err = skynet_socket_udp_send(ctx, id, address, buffer, sz);
+	lua_pushboolean(L, !err);
+	return 1;
+}
+
+// address string of udp message -> ip , port
+static int
+ludp_address(lua_State *L) {
+	size_t sz = 0;
+	const uint8_t * addr = (const uint8_t *)luaL_checklstring(L, 1, &sz);
+	uint16_t port = 0;
+	int family;
+	if (sz == 1 + 2 + 4 && addr[0] == 1) {
+		family = AF_INET;
+	} else if (sz == 1 + 2 + 16 && addr[0] == 2) {
+		family = AF_INET6;
+	} else {
+		return luaL_error(L, "Invalid udp address");
+	}
+	memcpy(&port, addr+1, sizeof(uint16_t));
+	port = ntohs(port);
+	char tmp[64];
+	if (inet_ntop(family, addr+3, tmp, sizeof(tmp)) == NULL) {
+		return luaL_error(L, "Invalid udp address");
+	}
+	lua_pushstring(L, tmp);
+	lua_pushinteger(L, port);
+	return 2;
+}
+
 int
 luaopen_socketdriver(lua_State *L) {
 	luaL_checkversion(L);
@@ -456,6 +787,9 @@ luaopen_socketdriver(lua_State *L) {
 		{ "clear", lclearbuffer },
 		{ "readline", lreadline },
 		{ "str2p", lstr2p },
+		{ "packet", lpacket },
+		{ "udp_address", ludp_address },
+		{ "info", linfo },
 
 		{ "unpack", lunpack },
 		{ NULL, NULL },
@@ -466,8 +800,16 @@ luaopen_socketdriver(lua_State *L) {
 		{ "close", lclose },
 		{ "listen", llisten },
 		{ "send", lsend },
+		{ "sendfile", lsendfile },
 		{ "bind", lbind },
 		{ "start", lstart },
+		{ "watermark", lwatermark },
+		{ "setopt", lsetopt },
+		{ "framing", lframing },
+		{ "batch", lbatch },
+		{ "udp", ludp },
+		{ "udp_connect", ludp_connect },
+		{ "udp_send", ludp_send },
 		{ NULL, NULL },
 	};
 	lua_getfield(L, LUA_REGISTRYINDEX, "skynet_lua");
@@ -62,15 +62,19 @@ local collection_meta = {
 	end
 }
 
+local CONNECT_TIMEOUT = 300	-- 3s
+
 local function try_connect(host, port)
 	-- try 10 times
 	for i = 1, 10 do
-		local sock = socket.open(host, port)
+		local sock, err = socket.open(host, port, CONNECT_TIMEOUT)
 		if not sock then
 			-- todo: write log
-			print("Try to connect " .. host .. " failed")
+			print("Try to connect " .. host .. " failed : " .. tostring(err))
+			-- the failure is known at once (or after the timeout), back off before retry
 			skynet.sleep(100*i)
 		else
+			socket.setopt(sock, "nodelay")
 			return sock
 		end
 	end
@@ -21,6 +21,8 @@ local meta = {
 function redis.connect(dbname)
 	local db_conf   =   name[dbname]
 	local fd = assert(socket.open(db_conf.host, db_conf.port or 6379))
+	-- small request and reply , don't wait for nagle
+	socket.setopt(fd, "nodelay")
 	local r = setmetatable( { __handle = fd, __mode = false }, meta )
 	if db_conf.db ~= nil then
 		r:select(db_conf.db)
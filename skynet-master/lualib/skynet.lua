@@ -521,6 +521,8 @@ function dbgcmd.STAT()
 	local stat = {}
 	query_state(stat, "count")
 	query_state(stat, "time")
+	-- "count p50 p99 max" (usec) , nil when skynet is built without QUEUE_WAIT_STAT
+	stat.wait = c.command("WAITSTAT")
 	skynet.ret(skynet.pack(stat))
 end
 
@@ -663,6 +665,22 @@ function skynet.endless()
 	return c.command("ENDLESS")~=nil
 end
 
+-- dump the last dispatched messages of every worker, to stderr when filename is nil
+function skynet.dump_recorder(filename)
+	if filename then
+		c.command("RECORDER", filename)
+	else
+		c.command("RECORDER")
+	end
+end
+
+-- write trace events (skynet built with TRACEPOINT) to filename, chrome json or binary
+-- return number of events, nil when tracepoint is not built in
+function skynet.flush_trace(filename, binary)
+	local n = c.command("TRACEFLUSH", (binary and "binary " or "json ") .. filename)
+	return n and tonumber(n)
+end
+
 function skynet.abort()
 	c.command("ABORT")
 end
@@ -16,6 +16,9 @@ local socket_pool = setmetatable( -- store all socket object
 	}
 )
 
+local framing_pool = {}	-- sockets framed before socket.start
+local READ_PACKET = {}	-- read_required of socket.readpacket
+
 local socket_message = {}
 
 local function wakeup(s)
@@ -34,7 +37,8 @@ end
 
 -- read skynet_socket.h for these macro
 -- SKYNET_SOCKET_TYPE_DATA = 1
-socket_message[1] = function(id, size, data)
+-- offset is not nil for the packet of framing socket , it is at data + offset
+socket_message[1] = function(id, size, data, offset)
 	local s = socket_pool[id]
 	if s == nil then
 		print("socket: drop package from " .. id)
@@ -42,6 +46,16 @@ socket_message[1] = function(id, size, data)
 		return
 	end
 
+	if s.packets then
+		-- framed , data is one packet
+		table.insert(s.packets, driver.packet(data, size, offset))
+		if s.read_required == READ_PACKET then
+			s.read_required = nil
+			wakeup(s)
+		end
+		return
+	end
+
 	local sz = driver.push(s.buffer, buffer_pool, data, size)
 	local rr = s.read_required
 	local rrt = type(rr)
@@ -92,22 +106,58 @@ socket_message[4] = function(id, newid, addr)
 end
 
 -- SKYNET_SOCKET_TYPE_ERROR = 5
-socket_message[5] = function(id)
-	print("error on ", id)
+socket_message[5] = function(id, _, err)
+	print("error on ", id, err)
 	local s = socket_pool[id]
 	if s == nil then
 		return
 	end
 	s.connected = false
+	s.error = err
 	wakeup(s)
 end
 
+-- SKYNET_SOCKET_TYPE_UDP = 6
+socket_message[6] = function(id, size, data, address)
+	local s = socket_pool[id]
+	if s == nil or s.callback == nil then
+		print("socket: drop udp package from " .. id)
+		return
+	end
+	s.callback(data, address)
+end
+
+-- SKYNET_SOCKET_TYPE_WARNING = 7
+socket_message[7] = function(id, size)
+	local s = socket_pool[id]
+	if s and s.on_warning then
+		s.on_warning(id, size, false)
+	else
+		print(string.format("socket %d : %dK bytes are waiting to be sent", id, size))
+	end
+end
+
+-- SKYNET_SOCKET_TYPE_WRITABLE = 8
+socket_message[8] = function(id, size)
+	local s = socket_pool[id]
+	if s and s.on_warning then
+		s.on_warning(id, size, true)
+	end
+end
+
 skynet.register_protocol {
 	name = "socket",
 	id = 6,	-- PTYPE_SOCKET
 	unpack = driver.unpack,
-	dispatch = function (_, _, t, n1, n2, data)
-		socket_message[t](n1,n2,data)
+	dispatch = function (_, _, t, n1, n2, data, address)
+		if t == 9 then
+			-- SKYNET_SOCKET_TYPE_BATCH , n2 messages in data , 5 fields each
+			for i = 1, n2 * 5, 5 do
+				socket_message[data[i]](data[i+1], data[i+2], data[i+3], data[i+4])
+			end
+		else
+			socket_message[t](n1,n2,data,address)
+		end
 	end
 }
 
@@ -123,16 +173,25 @@ local function connect(id, func)
 		read_require = false,
 		co = false,
 		callback = func,
+		packets = framing_pool[id] and {} or nil,
 	}
+	framing_pool[id] = nil
 	socket_pool[id] = s
 	suspend(s)
 	if s.connected then
 		return id
 	end
+	socket_pool[id] = nil
+	return nil, s.error
 end
 
-function socket.open(addr, port)
-	local id = driver.connect(addr,port)
+-- addr is "host:port" (port is nil), host with port, or a unix domain socket ("unix:path" or an absolute path)
+-- timeout is in 1/100 second , returns nil and the reason ("connect timeout", etc.) when failed
+function socket.open(addr, port, timeout)
+	local id = driver.connect(addr,port,timeout)
+	if id < 0 then
+		return nil, "no free socket"
+	end
 	return connect(id)
 end
 
@@ -218,14 +277,89 @@ function socket.readline(id, sep)
 	end
 end
 
+-- socket.framing(id, header [, max]) : the stream is split into packets of 2 or 4 bytes big-endian size header
+-- by the socket thread , read them by socket.readpacket. Call it before socket.start. header 0 turns it off
+function socket.framing(id, header, max)
+	driver.framing(id, header, max)
+	local on = header ~= 0
+	local s = socket_pool[id]
+	if s then
+		s.packets = on and (s.packets or {}) or nil
+	else
+		framing_pool[id] = on or nil
+	end
+end
+
+-- return one packet of a framed socket , or false when the socket is closed
+function socket.readpacket(id)
+	local s = socket_pool[id]
+	assert(s and s.packets)
+	local ret = table.remove(s.packets, 1)
+	if ret then
+		return ret
+	end
+	if not s.connected then
+		return false
+	end
+	assert(not s.read_required)
+	s.read_required = READ_PACKET
+	suspend(s)
+	return table.remove(s.packets, 1) or false
+end
+
 socket.write = assert(driver.send)
+-- socket.sendfile(id, filename [, offset, size]) : the file goes to the socket by sendfile, in order with socket.write
+socket.sendfile = assert(driver.sendfile)
 
 function socket.invalid(id)
 	return socket_pool[id] == nil
 end
 
+-- socket.listen(host, port [, backlog, reuseport]) , host "" for all ipv4 and ipv6 addresses
+-- the 4th argument may be a table { reuseport, nodelay, ipv6only, rcvbuf, sndbuf, defer_accept }
 socket.listen = assert(driver.listen)
 
+-- udp : callback(data, address) for each datagram , address is for socket.sendto and socket.udp_address
+-- host names of socket.udp and socket.udp_connect are resolved in background , a failure is reported as a socket error
+function socket.udp(callback, host, port)
+	local id = driver.udp(host, port)
+	socket_pool[id] = {
+		id = id,
+		connected = true,
+		protocol = "UDP",
+		callback = callback,
+		co = false,
+	}
+	return id
+end
+
+function socket.udp_connect(id, host, port)
+	local s = socket_pool[id]
+	if s then
+		assert(s.protocol == "UDP")
+	end
+	driver.udp_connect(id, host, port)
+end
+
+socket.sendto = assert(driver.udp_send)
+
+-- callback(id, kbytes, writable) is called when the write queue reaches high bytes ,
+-- and again with writable true when it is under low (default high/2). high 0 turns it off
+function socket.watermark(id, high, low, callback)
+	local s = socket_pool[id]
+	assert(s)
+	s.on_warning = callback
+	driver.watermark(id, high, low)
+end
+socket.udp_address = assert(driver.udp_address)
+-- socket.setopt(id, name [, value]) : name is "nodelay", "keepalive", "keepidle", "sndbuf", "rcvbuf" or "quickack"
+socket.setopt = assert(driver.setopt)
+-- traffic of all the live sockets : { { id, type, address, read, write, rcall, wcall, wbuffer, rtime, wtime } ... }
+socket.info = assert(driver.info)
+-- socket.batch([enable]) : the socket messages to this service of one poll round come in one message , for the services of many sockets
+-- call it before opening or starting the sockets , the sockets take the setting at that time
+socket.batch = assert(driver.batch)
+
 function socket.lock(id)
 	local s = socket_pool[id]
 	assert(s)
@@ -264,6 +398,7 @@ function socket.abandon(id)
 	if s and s.buffer then
 		driver.clear(s.buffer,buffer_pool)
 	end
+	framing_pool[id] = nil
 	socket_pool[id] = nil
 end
 
@@ -1,6 +1,6 @@
 #include "skynet.h"
 #include "skynet_socket.h"
-#include "databuffer.h"
+#include "socket_server.h"
 #include "hashid.h"
 
 #include <stdlib.h>
@@ -11,13 +11,14 @@
 #include <stdarg.h>
 
 #define BACKLOG 32
+// packets are split by socket thread , see skynet_socket_framing
+#define MAX_PACKET 0xffffff
 
 struct connection {
 	int id;	// skynet_socket fd
 	uint32_t agent; //每个connection对应一个agent 的handle
 	uint32_t client; //每个connection对应一个client 的handle
-	char remote_name[32];
-	struct databuffer buffer;
+	char remote_name[128];
 };
 
 struct gate {
@@ -28,10 +29,10 @@ struct gate {
 	int client_tag;
 	int header_size;
 	int max_connection;  //最大连接数？
+	int high_watermark;	// bytes queued for a connection , 0 for off
+	int low_watermark;
 	struct hashid hash;
 	struct connection *conn;
-	// todo: save message pool ptr for release
-	struct messagepool mp;
 };
 
 struct gate *
@@ -55,7 +56,6 @@ gate_release(struct gate *g) {
 	if (g->listen_id >= 0) {
 		skynet_socket_close(ctx, g->listen_id);
 	}
-	messagepool_free(&g->mp);
 	hashid_clear(&g->hash);
 	free(g->conn);
 	free(g);
@@ -146,6 +146,17 @@ _ctrl(struct gate * g, const void * msg, int sz) {
 		skynet_socket_start(ctx, g->listen_id);
 		return;
 	}
+	if (memcmp(command,"watermark",i) == 0) {
+		// watermark high [low] : the watchdog is told "warning" when a connection queues high bytes
+		_parm(tmp, sz, i);
+		char * endptr = NULL;
+		g->high_watermark = (int)strtol(command, &endptr, 10);
+		g->low_watermark = (int)strtol(endptr, &endptr, 10);
+		if (g->low_watermark <= 0) {
+			g->low_watermark = -1;
+		}
+		return;
+	}
     if (memcmp(command, "close", i) == 0) {
         //关闭socket
 		if (g->listen_id >= 0) {
@@ -172,62 +183,51 @@ _report(struct gate * g, const char * data, ...) {
 	skynet_send(ctx, 0, g->watchdog, PTYPE_TEXT,  0, tmp, n);
 }
 
+// data is one packet without header , the buffer of socket thread is copied to the message
 static void
-_forward(struct gate *g, struct connection * c, int size) {
+_forward(struct gate *g, struct connection * c, const void * data, int size) {
 	struct skynet_context * ctx = g->ctx;
 	if (g->broker) {
 		void * temp = malloc(size);
-		databuffer_read(&c->buffer,&g->mp,temp, size);
+		memcpy(temp, data, size);
 		skynet_send(ctx, 0, g->broker, g->client_tag | PTYPE_TAG_DONTCOPY, 0, temp, size);
 		return;
 	}
 	if (c->agent) {
 		void * temp = malloc(size);
-		databuffer_read(&c->buffer,&g->mp,temp, size);
+		memcpy(temp, data, size);
 		skynet_send(ctx, c->client, c->agent, g->client_tag | PTYPE_TAG_DONTCOPY, 0 , temp, size);
 	} else if (g->watchdog) {
 		char * tmp = malloc(size + 32);
 		int n = snprintf(tmp,32,"%d data ",c->id);
-		databuffer_read(&c->buffer,&g->mp,tmp+n,size);
+		memcpy(tmp+n, data, size);
 		skynet_send(ctx, 0, g->watchdog, PTYPE_TEXT | PTYPE_TAG_DONTCOPY, 0, tmp, size + n);
 	}
 }
 
 static void
-dispatch_message(struct gate *g, struct connection *c, int id, void * data, int sz) {
-	databuffer_push(&c->buffer,&g->mp, data, sz);
-	for (;;) {
-		int size = databuffer_readheader(&c->buffer, &g->mp, g->header_size);
-		if (size < 0) {
-			return;
-		} else if (size > 0) {
-			if (size >= 0x1000000) {
-				struct skynet_context * ctx = g->ctx;
-				databuffer_clear(&c->buffer,&g->mp);
-				skynet_socket_close(ctx, id);
-				skynet_error(ctx, "Recv socket message > 16M");
-				return;
-			} else {
-				_forward(g, c, size);
-				databuffer_reset(&c->buffer);
-			}
-		}
+dispatch_message(struct gate *g, struct connection *c, int id, char * data, int offset, int sz) {
+	// empty packets are ignored
+	if (sz > 0) {
+		_forward(g, c, data + offset, sz);
 	}
+	skynet_socket_free_buffer(data);
 }
 
+// addr is the address of ACCEPT (sz bytes)
 static void
-dispatch_socket_message(struct gate *g, const struct skynet_socket_message * message, int sz) {
+dispatch_socket_message(struct gate *g, const struct skynet_socket_message * message, const char * addr, int sz) {
 	struct skynet_context * ctx = g->ctx;
 	switch(message->type) {
 	case SKYNET_SOCKET_TYPE_DATA: {
 		int id = hashid_lookup(&g->hash, message->id);
 		if (id>=0) {
 			struct connection *c = &g->conn[id];
-			dispatch_message(g, c, message->id, message->buffer, message->ud);
+			dispatch_message(g, c, message->id, message->buffer, message->offset, message->ud);
 		} else {
 			skynet_error(ctx, "Drop unknown connection %d message", message->id);
 			skynet_socket_close(ctx, message->id);
-			free(message->buffer);
+			skynet_socket_free_buffer(message->buffer);
 		}
 		break;
 	}
@@ -251,13 +251,20 @@ dispatch_socket_message(struct gate *g, const struct skynet_socket_message * mes
 		int id = hashid_remove(&g->hash, message->id);
 		if (id>=0) {
 			struct connection *c = &g->conn[id];
-			databuffer_clear(&c->buffer,&g->mp);
 			memset(c, 0, sizeof(*c));
 			c->id = -1;
 			_report(g, "%d close", message->id);
 		}
 		break;
 	}
+	case SKYNET_SOCKET_TYPE_WARNING:
+	case SKYNET_SOCKET_TYPE_WRITABLE:
+		// let watchdog decide to kick the slow connection
+		if (hashid_lookup(&g->hash, message->id) >= 0) {
+			_report(g, "%d %s %d", message->id,
+				message->type == SKYNET_SOCKET_TYPE_WARNING ? "warning" : "writable", message->ud);
+		}
+		break;
 	case SKYNET_SOCKET_TYPE_ACCEPT:
 		// report accept, then it will be get a SKYNET_SOCKET_TYPE_CONNECT message
 		assert(g->listen_id == message->id);
@@ -269,9 +276,14 @@ dispatch_socket_message(struct gate *g, const struct skynet_socket_message * mes
 				sz = sizeof(c->remote_name) - 1;
 			}
 			c->id = message->ud;
-			memcpy(c->remote_name, message+1, sz);
+			memcpy(c->remote_name, addr, sz);
 			c->remote_name[sz] = '\0';
+			// before start , so every data is a packet
+			skynet_socket_framing(ctx, message->ud, g->header_size, MAX_PACKET);
 			skynet_socket_start(ctx, message->ud);
+			if (g->high_watermark > 0) {
+				skynet_socket_watermark(ctx, message->ud, g->high_watermark, g->low_watermark);
+			}
 		}
 		break;
 	}
@@ -304,19 +316,34 @@ _cb(struct skynet_context * ctx, void * ud, int type, int session, uint32_t sour
 			break;
 		}
 	}
-	case PTYPE_SOCKET:
+	case PTYPE_SOCKET: {
 		assert(source == 0);
 		// recv socket message from skynet_socket
-		dispatch_socket_message(g, msg, (int)(sz-sizeof(struct skynet_socket_message)));
+		const struct skynet_socket_message * message = msg;
+		if (message->type == SKYNET_SOCKET_TYPE_BATCH) {
+			int i;
+			for (i=0;i<message->ud;i++) {
+				const struct skynet_socket_message * m = message + 1 + i;
+				if (m->type == SKYNET_SOCKET_TYPE_ACCEPT) {
+					dispatch_socket_message(g, m, m->buffer, (int)strlen(m->buffer));
+				} else {
+					dispatch_socket_message(g, m, NULL, 0);
+				}
+			}
+		} else {
+			dispatch_socket_message(g, message, (const char *)(message+1), (int)(sz-sizeof(struct skynet_socket_message)));
+		}
 		break;
 	}
+	}
 	return 0;
 }
 
 static int
-start_listen(struct gate *g, char * listen_addr) {
+start_listen(struct gate *g, char * listen_addr, int backlog, const struct socket_listen_opt *opt) {
 	struct skynet_context * ctx = g->ctx;
-	char * portstr = strchr(listen_addr,':');
+	// port is after the last ':' , ipv6 host is in brackets "[::1]:2013"
+	char * portstr = strrchr(listen_addr,':');
 	const char * host = "";
 	int port;
 	if (portstr == NULL) {
@@ -335,9 +362,13 @@ start_listen(struct gate *g, char * listen_addr) {
 		portstr[0] = '\0';
         //host addr
 		host = listen_addr;
+		if (host[0] == '[' && portstr[-1] == ']') {
+			portstr[-1] = '\0';
+			++host;
+		}
 	}
     //启动socket监听
-	g->listen_id = skynet_socket_listen(ctx, host, port, BACKLOG);
+	g->listen_id = skynet_socket_listen_opt(ctx, host, port, backlog, opt);
 	if (g->listen_id < 0) {
 		return 1;
 	}
@@ -352,9 +383,17 @@ gate_init(struct gate *g , struct skynet_context * ctx, char * parm) {
 	char watchdog[sz];
 	char binding[sz];
 	int client_tag = 0;
+	int backlog = 0;
+	int reuseport = 0;
+	int nodelay = 0;
+	int batch = 0;
 	char header;
-    // L ! 0.0.0.0:2013 5 256 0
-	int n = sscanf(parm, "%c %s %s %d %d %d",&header,watchdog, binding,&client_tag , &max,&buffer);
+    // L ! 0.0.0.0:2013 5 256 0 [backlog] [reuseport] [nodelay] [batch]
+    // reuseport 1 : many gates can listen the same address, the kernel spreads the connections
+    // nodelay 1 : TCP_NODELAY on the client connections
+    // batch 1 : the socket messages of one poll round come in one message
+    // the address may be "[ipv6]:port" , or only the port for all ipv4 and ipv6 addresses
+	int n = sscanf(parm, "%c %s %s %d %d %d %d %d %d %d",&header,watchdog, binding,&client_tag , &max,&buffer,&backlog,&reuseport,&nodelay,&batch);
 	if (n<4) {
 		skynet_error(ctx, "Invalid gate parm %s",parm);
 		return 1;
@@ -400,6 +439,15 @@ gate_init(struct gate *g , struct skynet_context * ctx, char * parm) {
 	g->header_size = header=='S' ? 2 : 4;
     //向系统指定服务回调方法
 	skynet_callback(ctx,g,_cb);
+	if (batch) {
+		skynet_socket_batch(ctx, 1);
+	}
 	//初始化监听
-	return start_listen(g,binding);
+	if (backlog <= 0) {
+		backlog = BACKLOG;
+	}
+	struct socket_listen_opt opt;
+	memset(&opt, 0, sizeof(opt));
+	opt.flags = (reuseport ? SOCKET_LISTEN_REUSEPORT : 0) | (nodelay ? SOCKET_LISTEN_NODELAY : 0);
+	return start_listen(g,binding,backlog,&opt);
 }
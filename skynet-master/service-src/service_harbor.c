@@ -1,6 +1,7 @@
 #include "skynet.h"
 #include "skynet_harbor.h"
 #include "skynet_socket.h"
+#include "skynet_tracepoint.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,6 +13,8 @@
 
 #define HASH_SIZE 4096
 #define DEFAULT_QUEUE_SIZE 1024
+// ms , the socket thread reports SKYNET_SOCKET_TYPE_ERROR "connect timeout" after it
+#define CONNECT_TIMEOUT 5000
 
 struct msg {
 	uint8_t * buffer;
@@ -54,6 +57,8 @@ struct harbor {
 	struct hashmap * map;
 	int master_fd;          //连接到master的socket fd
 	char * master_addr;     // master address
+	bool master_connected;
+	struct msg_queue * master_queue;	// packages to master before it is connected
 	int remote_fd[REMOTE_MAX];
 	bool connected[REMOTE_MAX];
 	char * remote_addr[REMOTE_MAX];
@@ -61,8 +66,8 @@ struct harbor {
 
 // hash table
 
-static void
-_push_queue(struct msg_queue * queue, const void * buffer, size_t sz, struct remote_message_header * header) {
+static struct msg *
+_queue_slot(struct msg_queue * queue) {
 	// If there is only 1 free slot which is reserved to distinguish full/empty
 	// of circular buffer, expand it.
 	if (((queue->tail + 1) % queue->size) == queue->head) {
@@ -79,7 +84,12 @@ _push_queue(struct msg_queue * queue, const void * buffer, size_t sz, struct rem
 	}
 	struct msg * slot = &queue->data[queue->tail];
 	queue->tail = (queue->tail + 1) % queue->size;
+	return slot;
+}
 
+static void
+_push_queue(struct msg_queue * queue, const void * buffer, size_t sz, struct remote_message_header * header) {
+	struct msg * slot = _queue_slot(queue);
 	slot->buffer = malloc(sz + sizeof(*header));
 	memcpy(slot->buffer, buffer, sz);
 	memcpy(slot->buffer + sz, header, sizeof(*header));
@@ -203,6 +213,8 @@ harbor_create(void) {
 	h->id = 0;
 	h->master_fd = -1;
 	h->master_addr = NULL;
+	h->master_connected = false;
+	h->master_queue = NULL;
 	int i;
 	for (i=0;i<REMOTE_MAX;i++) {
 		h->remote_fd[i] = -1;
@@ -220,6 +232,7 @@ harbor_release(struct harbor *h) {
 		skynet_socket_close(ctx, h->master_fd);
 	}
 	free(h->master_addr);
+	_release_queue(h->master_queue);
 	free(h->local_addr);
 	int i;
 	for (i=0;i<REMOTE_MAX;i++) {
@@ -233,7 +246,7 @@ harbor_release(struct harbor *h) {
 }
 
 static int
-_connect_to(struct harbor *h, const char *ipaddress, bool blocking) {
+_connect_to(struct harbor *h, const char *ipaddress) {
 	char * port = strchr(ipaddress,':');
 	if (port==NULL) {
 		return -1;
@@ -245,11 +258,7 @@ _connect_to(struct harbor *h, const char *ipaddress, bool blocking) {
 
 	int portid = (int)strtol(port+1, NULL,10);
 
-	if (blocking) {
-		return skynet_socket_block_connect(h->ctx, tmp, portid);
-	} else {
-		return skynet_socket_connect(h->ctx, tmp, portid);
-	}
+	return skynet_socket_connect_timeout(h->ctx, tmp, portid, CONNECT_TIMEOUT);
 }
 
 static inline void
@@ -295,6 +304,37 @@ _send_package(struct skynet_context *ctx, int fd, const void * buffer, size_t sz
 	}
 }
 
+// the packages are queued until master is connected
+static void
+_send_master(struct harbor *h, const void * buffer, size_t sz) {
+	if (h->master_connected) {
+		_send_package(h->ctx, h->master_fd, buffer, sz);
+		return;
+	}
+	if (h->master_queue == NULL) {
+		h->master_queue = _new_queue();
+	}
+	struct msg * slot = _queue_slot(h->master_queue);
+	slot->buffer = malloc(sz);
+	memcpy(slot->buffer, buffer, sz);
+	slot->size = sz;
+}
+
+static void
+_open_master(struct harbor *h) {
+	h->master_connected = true;
+	if (h->master_queue == NULL)
+		return;
+	struct msg * m = _pop_queue(h->master_queue);
+	while (m) {
+		_send_package(h->ctx, h->master_fd, m->buffer, m->size);
+		free(m->buffer);
+		m = _pop_queue(h->master_queue);
+	}
+	_release_queue(h->master_queue);
+	h->master_queue = NULL;
+}
+
 static void
 _send_remote(struct skynet_context * ctx, int fd, const char * buffer, size_t sz, struct remote_message_header * cookie) {
 	uint32_t sz_header = sz+sizeof(*cookie);
@@ -320,7 +360,7 @@ _update_remote_address(struct harbor *h, int harbor_id, const char * ipaddr) {
 		free(h->remote_addr[harbor_id]);
 		h->remote_addr[harbor_id] = NULL;
 	}
-	h->remote_fd[harbor_id] = _connect_to(h, ipaddr, false);
+	h->remote_fd[harbor_id] = _connect_to(h, ipaddr);
 	h->connected[harbor_id] = false;
 }
 
@@ -369,7 +409,7 @@ _request_master(struct harbor *h, const char name[GLOBALNAME_LENGTH], size_t i,
 	to_bigendian(buffer, handle);
 	memcpy(buffer+4,name,i);
 
-	_send_package(h->ctx, h->master_fd, buffer, 4+i);
+	_send_master(h, buffer, 4+i);
 }
 
 /*
@@ -451,11 +491,15 @@ harbor_id(struct harbor *h, int fd) {
 }
 
 static void
-close_harbor(struct harbor *h, int fd) {
+close_harbor(struct harbor *h, int fd, const char * reason) {
+	if (fd == h->master_fd && !h->master_connected) {
+		fprintf(stderr, "Harbor: Connect to master failed (%s)\n", reason);
+		exit(1);
+	}
 	int id = harbor_id(h,fd);
 	if (id == 0)
 		return;
-	skynet_error(h->ctx, "Harbor %d closed",id);
+	skynet_error(h->ctx, "Harbor %d closed (%s)",id, reason);
 	skynet_socket_close(h->ctx, fd);
 	h->remote_fd[id] = -1;
 	h->connected[id] = false;
@@ -463,6 +507,10 @@ close_harbor(struct harbor *h, int fd) {
 
 static void
 open_harbor(struct harbor *h, int fd) {
+	if (fd == h->master_fd) {
+		_open_master(h);
+		return;
+	}
 	int id = harbor_id(h,fd);
 	if (id == 0)
 		return;
@@ -478,15 +526,17 @@ _mainloop(struct skynet_context * context, void * ud, int type, int session, uin
 		const struct skynet_socket_message * message = msg;
 		switch(message->type) {
 		case SKYNET_SOCKET_TYPE_DATA:
-			free(message->buffer);
+			skynet_socket_free_buffer(message->buffer);
 			skynet_error(context, "recv invalid socket message (size=%d)", message->ud);
 			break;
 		case SKYNET_SOCKET_TYPE_ACCEPT:
 			skynet_error(context, "recv invalid socket accept message");
 			break;
 		case SKYNET_SOCKET_TYPE_ERROR:
+			close_harbor(h, message->id, sz > sizeof(*message) ? (const char *)(message+1) : "error");
+			break;
 		case SKYNET_SOCKET_TYPE_CLOSE:
-			close_harbor(h, message->id);
+			close_harbor(h, message->id, "closed");
 			break;
 		case SKYNET_SOCKET_TYPE_CONNECT:
 			open_harbor(h, message->id);
@@ -500,6 +550,8 @@ _mainloop(struct skynet_context * context, void * ud, int type, int session, uin
 		cookie += sz - 12;
 		struct remote_message_header header;
 		_message_to_header((const uint32_t *)cookie, &header);
+		SKYNET_TRACE(TRACE_HARBOR_RECV, header.source, sz)
+		skynet_harbor_recv(sz);
 		if (header.source == 0) {
 			if (header.destination < REMOTE_MAX) {
 				// 1 byte harbor id (0~255)
@@ -582,8 +634,8 @@ harbor_init(struct harbor *h, struct skynet_context *ctx, const char * args) {
 	int harbor_id = 0;
 	sscanf(args,"%s %s %d",master_addr, local_addr, &harbor_id);
 	h->master_addr = strdup(master_addr);
-    //连接到master
-	h->master_fd = _connect_to(h, master_addr, true);
+    //连接到master , the result comes to _mainloop. Packages to master are queued until then
+	h->master_fd = _connect_to(h, master_addr);
 	if (h->master_fd == -1) {
 		fprintf(stderr, "Harbor: Connect to master failed\n");
 		exit(1);
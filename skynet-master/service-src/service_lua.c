@@ -12,6 +12,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#define LOCK(l) while (__sync_lock_test_and_set(&(l)->lock,1)) {}
+#define UNLOCK(l) __sync_lock_release(&(l)->lock);
+
 static int
 _try_load(lua_State *L, const char * path, int pathlen, const char * name) {
 	int namelen = (int)strlen(name);
@@ -118,6 +121,58 @@ _report_error(lua_State *L, struct skynet_context *ctx, const char *filename, in
 	lua_pop(L,1);
 }
 
+static void
+_set_active(struct snlua *l, lua_State *co) {
+	LOCK(l)
+	l->activeL = co;
+	UNLOCK(l)
+}
+
+// track the running coroutine, so the monitor can hook the thread which is really stuck.
+// co stays on the stack of L while it runs, so it can't be collected before activeL is restored.
+static int
+_resume(lua_State *L) {
+	struct snlua *l = lua_touserdata(L, lua_upvalueindex(2));
+	lua_State *co = lua_tothread(L, 1);
+	lua_State *prev = l->activeL;
+	if (co) {
+		_set_active(l, co);
+	}
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	int err = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+	_set_active(l, prev);
+	if (err != LUA_OK) {
+		return lua_error(L);
+	}
+	return lua_gettop(L);
+}
+
+static void
+_hook_resume(lua_State *L, struct snlua *l) {
+	lua_getglobal(L, "coroutine");
+	lua_getfield(L, -1, "resume");
+	lua_pushlightuserdata(L, l);
+	lua_pushcclosure(L, _resume, 2);
+	lua_setfield(L, -2, "resume");
+	lua_pop(L,1);
+}
+
+static void
+_signal_hook(lua_State *L, lua_Debug *ar) {
+	lua_sethook(L, NULL, 0, 0);
+	lua_getfield(L, LUA_REGISTRYINDEX, "skynet_lua");
+	struct snlua *l = lua_touserdata(L, -1);
+	lua_pop(L,1);
+	if (l->signal == 0) {
+		luaL_traceback(L, L, "maybe in an endless loop", 0);
+		skynet_error(l->ctx, "%s", lua_tostring(L,-1));
+		lua_pop(L,1);
+	} else {
+		luaL_error(L, "endless loop preempted (%d checks)", l->signal);
+	}
+}
+
 static void
 _report_launcher_error(struct skynet_context *ctx) {
 	// sizeof "ERROR" == 5
@@ -133,6 +188,8 @@ _init(struct snlua *l, struct skynet_context *ctx, const char * args) {
 	luaL_openlibs(L);
 	lua_pushlightuserdata(L, l);
 	lua_setfield(L, LUA_REGISTRYINDEX, "skynet_lua");
+	l->activeL = NULL;
+	_hook_resume(L, l);
 	lua_gc(L, LUA_GCRESTART, 0);
 
 	char tmp[strlen(args)+1];
@@ -187,6 +244,10 @@ _launch(struct skynet_context * context, void *ud, int type, int session, uint32
 
 int
 snlua_init(struct snlua *l, struct skynet_context *ctx, const char * args) {
+	const char * preempt = skynet_command(ctx, "GETENV", "lua_preempt");
+	if (preempt) {
+		l->preempt = (int)strtol(preempt, NULL, 10);
+	}
 	int sz = (int)strlen(args);
 	char * tmp = malloc(sz+1);
 	memcpy(tmp, args, sz+1);
@@ -198,17 +259,71 @@ snlua_init(struct snlua *l, struct skynet_context *ctx, const char * args) {
 	return 0;
 }
 
+// report to metrics when the heap changed this many bytes
+#define MEMORY_REPORT (64 * 1024)
+
+// the allocator of luaL_newstate , and it counts the heap
+static void *
+_lalloc(void * ud, void *ptr, size_t osize, size_t nsize) {
+	struct snlua *l = ud;
+	if (ptr == NULL) {
+		// osize is the type of object when ptr is NULL
+		osize = 0;
+	}
+	l->mem += nsize;
+	l->mem -= osize;
+	if (l->ctx) {
+		size_t diff = l->mem > l->mem_report ? l->mem - l->mem_report : l->mem_report - l->mem;
+		if (diff >= MEMORY_REPORT) {
+			l->mem_report = l->mem;
+			skynet_memory_report(l->ctx, (int64_t)l->mem);
+		}
+	}
+	if (nsize == 0) {
+		free(ptr);
+		return NULL;
+	}
+	return realloc(ptr, nsize);
+}
+
+static int
+_panic(lua_State *L) {
+	fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+	return 0;
+}
+
 struct snlua *
 snlua_create(void) {
 	struct snlua * l = malloc(sizeof(*l));
 	memset(l,0,sizeof(*l));
-	l->L = luaL_newstate();
+	l->L = lua_newstate(_lalloc, l);
+	lua_atpanic(l->L, _panic);
 	l->init = _init;
 	return l;
 }
 
+/*
+	Called by the monitor thread while a message is stuck in this service.
+	signal 0 logs the lua traceback, signal >= preempt raises an error in the running coroutine.
+	lua_sethook is the only lua api safe to call from another thread , activeL is read under the lock
+	because the worker may finish the coroutine at the same time.
+ */
+void
+snlua_signal(struct snlua *l, int signal) {
+	if (signal > 0 && (l->preempt <= 0 || signal < l->preempt)) {
+		return;
+	}
+	l->signal = signal;
+	LOCK(l)
+	lua_State *L = l->activeL ? l->activeL : l->L;
+	lua_sethook(L, _signal_hook, LUA_MASKCOUNT, 1);
+	UNLOCK(l)
+}
+
 void
 snlua_release(struct snlua *l) {
+	// the context is being deleted , don't report any more
+	l->ctx = NULL;
 	lua_close(l->L);
 	free(l);
 }
@@ -6,6 +6,12 @@ struct snlua {
 	const char * reload;
 	struct skynet_context * ctx;
 	int (*init)(struct snlua *l, struct skynet_context *ctx, const char * args);
+	lua_State * activeL;	// running coroutine, NULL for main thread. write by the worker and read by the monitor under lock
+	int lock;
+	int preempt;	// break a message stuck for this many monitor checks, 0 for never
+	int signal;
+	size_t mem;	// bytes of the lua heap , counted by the allocator
+	size_t mem_report;	// mem at the last skynet_memory_report
 };
 
 #endif
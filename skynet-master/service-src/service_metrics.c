@@ -0,0 +1,340 @@
+#include "skynet.h"
+#include "skynet_socket.h"
+#include "socket_server.h"
+#include "skynet_server.h"
+#include "skynet_monitor.h"
+#include "skynet_mq.h"
+#include "skynet_timer.h"
+#include "skynet_harbor.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+/*
+	Prometheus text exposition of the core counters.
+	launch with config "metrics = 127.0.0.1:9100" , every http request gets the full metrics page.
+	Counters are read without lock, so they may be a little stale.
+	There is no malloc stats , glibc mallinfo takes the arena locks of every thread. The memory metrics
+	are counted by the allocators of the lua services and the socket read buffers instead.
+ */
+
+#define BACKLOG 32
+#define MAX_REQUEST 8192
+#define HTTP_HEADER "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n"
+
+// a connection waiting for the end of request header
+struct request {
+	struct request * next;
+	int id;
+	int sz;
+	int match;	// bytes of "\r\n\r\n" matched
+};
+
+struct metrics {
+	struct skynet_context * ctx;
+	int listen_id;
+	struct request * req;
+};
+
+struct page {
+	char * ptr;
+	int sz;
+	int cap;
+};
+
+static void
+_printf(struct page *p, const char * fmt, ...) {
+	for (;;) {
+		va_list ap;
+		va_start(ap, fmt);
+		int n = vsnprintf(p->ptr + p->sz, p->cap - p->sz, fmt, ap);
+		va_end(ap);
+		if (n < p->cap - p->sz) {
+			p->sz += n;
+			return;
+		}
+		p->cap = (p->cap + n) * 2;
+		p->ptr = realloc(p->ptr, p->cap);
+	}
+}
+
+static void
+_head(struct page *p, const char * name, const char * type, const char * help) {
+	_printf(p, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void
+_worker_metrics(struct page *p) {
+	int max = 16;
+	struct skynet_monitor_stat * stat = NULL;
+	int n;
+	for (;;) {
+		stat = realloc(stat, max * sizeof(*stat));
+		n = skynet_monitor_stat(stat, max);
+		if (n <= max)
+			break;
+		max = n;
+	}
+	int i;
+	_head(p, "skynet_worker_busy_seconds_total", "counter", "Time spent dispatching messages.");
+	for (i=0;i<n;i++) {
+		_printf(p, "skynet_worker_busy_seconds_total{worker=\"%d\"} %.6f\n", stat[i].id, stat[i].busy / 1000000.0);
+	}
+	_head(p, "skynet_worker_idle_seconds_total", "counter", "Time spent waiting for messages.");
+	for (i=0;i<n;i++) {
+		_printf(p, "skynet_worker_idle_seconds_total{worker=\"%d\"} %.6f\n", stat[i].id, stat[i].idle / 1000000.0);
+	}
+	_head(p, "skynet_worker_messages_total", "counter", "Messages dispatched by the worker.");
+	for (i=0;i<n;i++) {
+		_printf(p, "skynet_worker_messages_total{worker=\"%d\"} %llu\n", stat[i].id, (unsigned long long)stat[i].message);
+	}
+	free(stat);
+}
+
+static void
+_service_metrics(struct page *p) {
+	int max = 256;
+	struct skynet_context_stat * stat = NULL;
+	int n;
+	for (;;) {
+		stat = realloc(stat, max * sizeof(*stat));
+		n = skynet_context_stat(stat, max);
+		if (n <= max)
+			break;
+		max = n;
+	}
+	int i;
+	_head(p, "skynet_service_queue_length", "gauge", "Messages waiting in the service queue.");
+	for (i=0;i<n;i++) {
+		_printf(p, "skynet_service_queue_length{handle=\":%08x\",name=\"%s\"} %d\n", stat[i].handle, stat[i].name, stat[i].mqlen);
+	}
+	_head(p, "skynet_service_cpu_seconds_total", "counter", "Time spent in the service callback.");
+	for (i=0;i<n;i++) {
+		_printf(p, "skynet_service_cpu_seconds_total{handle=\":%08x\",name=\"%s\"} %.6f\n", stat[i].handle, stat[i].name, stat[i].cpu / 1000000.0);
+	}
+	_head(p, "skynet_service_messages_total", "counter", "Messages dispatched to the service.");
+	for (i=0;i<n;i++) {
+		_printf(p, "skynet_service_messages_total{handle=\":%08x\",name=\"%s\"} %llu\n", stat[i].handle, stat[i].name, (unsigned long long)stat[i].message);
+	}
+	int64_t total = 0;
+	_head(p, "skynet_service_memory_bytes", "gauge", "Heap of the service, reported by lua services in 64K steps.");
+	for (i=0;i<n;i++) {
+		if (stat[i].memory > 0) {
+			_printf(p, "skynet_service_memory_bytes{handle=\":%08x\",name=\"%s\"} %lld\n", stat[i].handle, stat[i].name, (long long)stat[i].memory);
+			total += stat[i].memory;
+		}
+	}
+	_head(p, "skynet_service_memory_bytes_total", "gauge", "Heap of all the services reporting memory.");
+	_printf(p, "skynet_service_memory_bytes_total %lld\n", (long long)total);
+	free(stat);
+}
+
+static void
+_socket_metrics(struct page *p) {
+	struct socket_server_stat ss;
+	skynet_socket_stat(&ss);
+	_head(p, "skynet_socket_received_bytes_total", "counter", "Bytes read by the socket thread.");
+	_printf(p, "skynet_socket_received_bytes_total %llu\n", (unsigned long long)ss.recv_bytes);
+	_head(p, "skynet_socket_sent_bytes_total", "counter", "Bytes written by the socket thread.");
+	_printf(p, "skynet_socket_sent_bytes_total %llu\n", (unsigned long long)ss.send_bytes);
+	_head(p, "skynet_socket_connections", "gauge", "Sockets in use.");
+	_printf(p, "skynet_socket_connections{state=\"connected\"} %d\n", ss.connected);
+	_printf(p, "skynet_socket_connections{state=\"listen\"} %d\n", ss.listen);
+	_printf(p, "skynet_socket_connections{state=\"other\"} %d\n", ss.other);
+	_head(p, "skynet_socket_write_buffer_bytes", "gauge", "Bytes queued to write.");
+	_printf(p, "skynet_socket_write_buffer_bytes %lld\n", (long long)ss.wbuffer);
+	_head(p, "skynet_socket_read_buffer_bytes", "gauge", "Bytes of read buffers taken from malloc, pooled ones included.");
+	_printf(p, "skynet_socket_read_buffer_bytes %lld\n", (long long)ss.rbuffer);
+	_head(p, "skynet_socket_read_buffers", "gauge", "Read buffers not freed by the receivers.");
+	_printf(p, "skynet_socket_read_buffers %lld\n", (long long)ss.rbuffer_count);
+}
+
+static void
+_harbor_metrics(struct page *p) {
+	struct skynet_harbor_stat hs;
+	skynet_harbor_stat(&hs);
+	_head(p, "skynet_harbor_sent_messages_total", "counter", "Messages sent to remote harbor.");
+	_printf(p, "skynet_harbor_sent_messages_total %llu\n", (unsigned long long)hs.send_message);
+	_head(p, "skynet_harbor_sent_bytes_total", "counter", "Bytes sent to remote harbor.");
+	_printf(p, "skynet_harbor_sent_bytes_total %llu\n", (unsigned long long)hs.send_bytes);
+	_head(p, "skynet_harbor_received_messages_total", "counter", "Messages received from remote harbor.");
+	_printf(p, "skynet_harbor_received_messages_total %llu\n", (unsigned long long)hs.recv_message);
+	_head(p, "skynet_harbor_received_bytes_total", "counter", "Bytes received from remote harbor.");
+	_printf(p, "skynet_harbor_received_bytes_total %llu\n", (unsigned long long)hs.recv_bytes);
+}
+
+static void
+_response(struct metrics *m, int id) {
+	struct page p;
+	p.cap = 4096;
+	p.ptr = malloc(p.cap);
+	p.sz = 0;
+	_printf(&p, "%s", HTTP_HEADER);
+
+	_head(&p, "skynet_global_queue_length", "gauge", "Service queues waiting for a worker.");
+	_printf(&p, "skynet_global_queue_length %d\n", skynet_globalmq_length());
+	_head(&p, "skynet_services", "gauge", "Number of services.");
+	_printf(&p, "skynet_services %d\n", skynet_context_total());
+	_head(&p, "skynet_timer_events", "gauge", "Pending timeout events.");
+	_printf(&p, "skynet_timer_events %d\n", skynet_timer_count());
+	_worker_metrics(&p);
+	_service_metrics(&p);
+	_socket_metrics(&p);
+	_harbor_metrics(&p);
+
+	// socket server owns p.ptr now
+	skynet_socket_send(m->ctx, id, p.ptr, p.sz);
+	skynet_socket_close(m->ctx, id);
+}
+
+static struct request **
+_find(struct metrics *m, int id) {
+	struct request **pr = &m->req;
+	while (*pr) {
+		if ((*pr)->id == id)
+			break;
+		pr = &(*pr)->next;
+	}
+	return pr;
+}
+
+static void
+_remove(struct request **pr) {
+	struct request *r = *pr;
+	if (r) {
+		*pr = r->next;
+		free(r);
+	}
+}
+
+// return 1 when the header ends in [data, data+sz)
+static int
+_header_end(struct request *r, const char *data, int sz) {
+	static const char eoh[4] = { '\r', '\n', '\r', '\n' };
+	int i;
+	for (i=0;i<sz;i++) {
+		char c = data[i];
+		if (c == eoh[r->match]) {
+			if (++r->match == 4)
+				return 1;
+		} else {
+			r->match = (c == '\r') ? 1 : 0;
+		}
+	}
+	r->sz += sz;
+	return 0;
+}
+
+static void
+_request(struct metrics *m, const struct skynet_socket_message * message) {
+	struct request **pr = _find(m, message->id);
+	struct request *r = *pr;
+	if (r == NULL) {
+		// responded already, ignore the rest of request
+		return;
+	}
+	// don't parse the request, any request gets the metrics page
+	if (_header_end(r, message->buffer + message->offset, message->ud)) {
+		_remove(pr);
+		_response(m, message->id);
+	} else if (r->sz > MAX_REQUEST) {
+		_remove(pr);
+		skynet_socket_close(m->ctx, message->id);
+	}
+}
+
+static void
+dispatch_socket_message(struct metrics *m, const struct skynet_socket_message * message) {
+	struct skynet_context * ctx = m->ctx;
+	switch(message->type) {
+	case SKYNET_SOCKET_TYPE_DATA:
+		_request(m, message);
+		skynet_socket_free_buffer(message->buffer);
+		break;
+	case SKYNET_SOCKET_TYPE_ACCEPT: {
+		struct request *r = malloc(sizeof(*r));
+		r->id = message->ud;
+		r->sz = 0;
+		r->match = 0;
+		r->next = m->req;
+		m->req = r;
+		skynet_socket_start(ctx, message->ud);
+		break;
+	}
+	case SKYNET_SOCKET_TYPE_CLOSE:
+		_remove(_find(m, message->id));
+		break;
+	case SKYNET_SOCKET_TYPE_ERROR:
+		_remove(_find(m, message->id));
+		if (message->id == m->listen_id) {
+			skynet_error(ctx, "Metrics listen error");
+			m->listen_id = -1;
+		}
+		break;
+	}
+}
+
+static int
+_cb(struct skynet_context * ctx, void * ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	struct metrics *m = ud;
+	if (type == PTYPE_SOCKET) {
+		dispatch_socket_message(m, msg);
+	}
+	return 0;
+}
+
+struct metrics *
+metrics_create(void) {
+	struct metrics * m = malloc(sizeof(*m));
+	m->ctx = NULL;
+	m->listen_id = -1;
+	m->req = NULL;
+	return m;
+}
+
+void
+metrics_release(struct metrics *m) {
+	if (m->listen_id >= 0) {
+		skynet_socket_close(m->ctx, m->listen_id);
+	}
+	while (m->req) {
+		_remove(&m->req);
+	}
+	free(m);
+}
+
+int
+metrics_init(struct metrics *m, struct skynet_context *ctx, const char * parm) {
+	if (parm == NULL) {
+		skynet_error(ctx, "Need metrics address");
+		return 1;
+	}
+	int sz = (int)strlen(parm)+1;
+	char host[sz];
+	int port = 0;
+	const char * portstr = strchr(parm, ':');
+	if (portstr) {
+		memcpy(host, parm, portstr - parm);
+		host[portstr - parm] = '\0';
+		port = (int)strtol(portstr + 1, NULL, 10);
+	} else {
+		host[0] = '\0';
+		port = (int)strtol(parm, NULL, 10);
+	}
+	if (port <= 0) {
+		skynet_error(ctx, "Invalid metrics address %s", parm);
+		return 1;
+	}
+	m->ctx = ctx;
+	m->listen_id = skynet_socket_listen(ctx, host, port, BACKLOG);
+	if (m->listen_id < 0) {
+		return 1;
+	}
+	skynet_socket_start(ctx, m->listen_id);
+	skynet_callback(ctx, m, _cb);
+	skynet_command(ctx, "REG", ".metrics");
+	return 0;
+}
@@ -25,6 +25,15 @@ function command:close()
 	skynet.kill(agent[2])
 end
 
+-- the client doesn't read, kick it (gate reports it after "watermark" command)
+function command:warning(size)
+	print("agent slow",self,string.format("%sK bytes queued",size))
+	skynet.send(gate, "text", "kick " .. self)
+end
+
+function command:writable()
+end
+
 function command:data(data, session)
 	local agent = agent_all[self]
 	if agent then
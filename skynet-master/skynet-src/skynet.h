@@ -32,6 +32,9 @@ int skynet_sendname(struct skynet_context * context, const char * destination ,
 void skynet_forward(struct skynet_context *, uint32_t destination);
 int skynet_isremote(struct skynet_context *, uint32_t handle, int * harbor);
 
+// the service reports the bytes of its heap , only from the worker dispatching it (see snlua). Read by metrics
+void skynet_memory_report(struct skynet_context *, int64_t bytes);
+
 typedef int (*skynet_cb)(struct skynet_context * context, void *ud, int type, int session, uint32_t source , const void * msg, size_t sz);
 void skynet_callback(struct skynet_context * context, void *ud, skynet_cb cb);
 
@@ -1,6 +1,7 @@
 #include "skynet.h"
 #include "skynet_harbor.h"
 #include "skynet_server.h"
+#include "skynet_tracepoint.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -8,15 +9,31 @@
 
 static struct skynet_context * REMOTE = 0;
 static unsigned int HARBOR = 0;
+static struct skynet_harbor_stat STAT;
 
 void 
 skynet_harbor_send(struct remote_message *rmsg, uint32_t source, int session) {
 	int type = (int)rmsg->sz >> HANDLE_REMOTE_SHIFT;
 	rmsg->sz &= HANDLE_MASK;
 	assert(type != PTYPE_SYSTEM && type != PTYPE_HARBOR);
+	SKYNET_TRACE(TRACE_HARBOR_SEND, rmsg->destination.handle, rmsg->sz)
+	__sync_add_and_fetch(&STAT.send_message, 1);
+	__sync_add_and_fetch(&STAT.send_bytes, rmsg->sz);
 	skynet_context_send(REMOTE, rmsg, sizeof(*rmsg) , source, type , session);
 }
 
+void
+skynet_harbor_recv(size_t sz) {
+	// only harbor service call it
+	++STAT.recv_message;
+	STAT.recv_bytes += sz;
+}
+
+void
+skynet_harbor_stat(struct skynet_harbor_stat *stat) {
+	*stat = STAT;
+}
+
 void 
 skynet_harbor_register(struct remote_name *rname) {
 	int i;
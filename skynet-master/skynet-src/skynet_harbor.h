@@ -36,4 +36,15 @@ void skynet_harbor_init(int harbor);
 // 启动harbor
 int skynet_harbor_start(const char * master, const char *local);
 
+struct skynet_harbor_stat {
+	uint64_t send_message;
+	uint64_t send_bytes;
+	uint64_t recv_message;
+	uint64_t recv_bytes;
+};
+
+// harbor service reports the remote messages it receives
+void skynet_harbor_recv(size_t sz);
+void skynet_harbor_stat(struct skynet_harbor_stat *stat);
+
 #endif
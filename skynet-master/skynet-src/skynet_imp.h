@@ -3,6 +3,12 @@
 
 struct skynet_config {
 	int thread; //线程数量
+	int socket_thread;	// socket poll threads, sockets are sharded across them
+	int socket_slice;	// size of the read block shared by small reads, 0 for off
+	int socket_edge;	// max bytes read from one edge triggered event, 0 for level triggered
+	int socket_max;	// max sockets , rounded up to power of 2
+	int resolver_thread;	// threads resolving host names of connect
+	int resolver_ttl;	// seconds the resolved address is cached
 	int harbor; //harbor id
 	const char * logger;    //日志
 	const char * module_path; //模块路径
@@ -10,6 +16,9 @@ struct skynet_config {
 	const char * local;     //harbor 地址
 	const char * start;     //启动文件（lua）
 	const char * standalone;    //master配置 （配置了该项就说明这节点是master）
+	int monitor_interval;	// ms between endless loop checks
+	int recorder;	// flight recorder size per worker, 0 for off
+	const char * metrics;	// prometheus metrics address, NULL for off
 };
 
 void skynet_start(struct skynet_config * config);
@@ -112,6 +112,12 @@ main(int argc, char *argv[]) {
 	optstring("luaservice","./service/?.lua");
 
 	config.thread =  optint("thread",8);
+	config.socket_thread = optint("socket_thread",1);
+	config.socket_slice = optint("socket_slice",0);
+	config.socket_edge = optint("socket_edge",0);
+	config.socket_max = optint("socket_max",65536);
+	config.resolver_thread = optint("resolver_thread",2);
+	config.resolver_ttl = optint("resolver_ttl",60);
 	config.module_path = optstring("cpath","./service/?.so");
 	config.logger = optstring("logger",NULL);
 	config.harbor = optint("harbor", 1);
@@ -119,6 +125,10 @@ main(int argc, char *argv[]) {
 	config.start = optstring("start","main.lua");
 	config.local = optstring("address","127.0.0.1:2525");
 	config.standalone = optstring("standalone",NULL);
+	config.monitor_interval = optint("monitor_interval",5000);
+	config.recorder = optint("recorder",4096);
+	config.metrics = optstring("metrics",NULL);
+	optint("lua_preempt",0);
 
 	lua_close(L);
 
@@ -1,44 +1,256 @@
 #include "skynet_monitor.h"
 #include "skynet_server.h"
+#include "skynet_harbor.h"
+#include "skynet_timer.h"
 #include "skynet.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+// one dispatched message in the flight recorder
+struct record {
+	uint64_t time;	// dispatch begin, usec (skynet_gettime_usec)
+	uint32_t source;
+	uint32_t destination;
+	uint32_t sz;	// type in high 8 bits, like skynet_message.sz
+	uint32_t duration;	// usec
+};
 
 struct skynet_monitor {
 	int version;
 	int check_version;
 	uint32_t source;
 	uint32_t destination;
+	int stuck;	// how many checks the current message has been seen
+
+	int id;
+	uint64_t create_time;
+	uint64_t busy;	// usec
+	uint64_t message;
+	struct skynet_monitor * next;	// all monitors, for dump
+	// flight recorder : written only by the owner worker, read by dump without lock
+	uint32_t rec_mask;
+	uint32_t rec_index;
+	uint64_t rec_start;
+	struct record * rec;
 };
 
-struct skynet_monitor * 
-skynet_monitor_new() {
+static struct skynet_monitor * ALL = NULL;
+static int ALL_COUNT = 0;
+
+struct skynet_monitor *
+skynet_monitor_new(int recorder) {
 	struct skynet_monitor * ret = malloc(sizeof(*ret));
 	memset(ret, 0, sizeof(*ret));
+	if (recorder > 0) {
+		uint32_t sz = 1;
+		while (sz < (uint32_t)recorder) {
+			sz *= 2;
+		}
+		ret->rec = malloc(sz * sizeof(struct record));
+		memset(ret->rec, 0, sz * sizeof(struct record));
+		ret->rec_mask = sz - 1;
+	}
+	ret->create_time = skynet_gettime_usec();
+	ret->id = __sync_fetch_and_add(&ALL_COUNT, 1);
+	do {
+		ret->next = ALL;
+	} while (!__sync_bool_compare_and_swap(&ALL, ret->next, ret));
 	return ret;
 }
 
-void 
+void
 skynet_monitor_delete(struct skynet_monitor *sm) {
+	// only at exit, no worker is running
+	struct skynet_monitor ** p = &ALL;
+	while (*p) {
+		if (*p == sm) {
+			*p = sm->next;
+			break;
+		}
+		p = &(*p)->next;
+	}
+	free(sm->rec);
 	free(sm);
 }
 
-void 
+void
 skynet_monitor_trigger(struct skynet_monitor *sm, uint32_t source, uint32_t destination) {
 	sm->source = source;
 	sm->destination = destination;
+	if (destination) {
+		sm->rec_start = skynet_gettime_usec();
+	}
 	__sync_fetch_and_add(&sm->version , 1);
 }
 
-void 
+uint32_t
+skynet_monitor_record(struct skynet_monitor *sm, size_t sz) {
+	uint32_t duration = (uint32_t)(skynet_gettime_usec() - sm->rec_start);
+	sm->busy += duration;
+	++sm->message;
+	if (sm->rec == NULL) {
+		return duration;
+	}
+	struct record * r = &sm->rec[sm->rec_index & sm->rec_mask];
+	r->time = sm->rec_start;
+	r->source = sm->source;
+	r->destination = sm->destination;
+	r->sz = (uint32_t)sz;
+	r->duration = duration;
+	__sync_synchronize();
+	++sm->rec_index;
+	return duration;
+}
+
+void
 skynet_monitor_check(struct skynet_monitor *sm) {
 	if (sm->version == sm->check_version) {
 		if (sm->destination) {
-			skynet_context_endless(sm->destination);
-			skynet_error(NULL, "A message from [ :%08x ] to [ :%08x ] maybe in an endless loop", sm->source , sm->destination);
+			if (sm->stuck == 0) {
+				skynet_error(NULL, "A message from [ :%08x ] to [ :%08x ] maybe in an endless loop", sm->source , sm->destination);
+			}
+			skynet_context_endless(sm->destination, sm->stuck);
+			++sm->stuck;
 		}
 	} else {
 		sm->check_version = sm->version;
+		sm->stuck = 0;
+	}
+}
+
+int
+skynet_monitor_stat(struct skynet_monitor_stat *stat, int max) {
+	uint64_t now = skynet_gettime_usec();
+	int n = 0;
+	struct skynet_monitor * sm = ALL;
+	while (sm) {
+		if (n < max) {
+			struct skynet_monitor_stat * s = &stat[n];
+			s->id = sm->id;
+			s->busy = sm->busy;
+			s->message = sm->message;
+			uint64_t alive = now - sm->create_time;
+			s->idle = alive > s->busy ? alive - s->busy : 0;
+		}
+		++n;
+		sm = sm->next;
+	}
+	return n;
+}
+
+// the dump runs in signal handler , so it formats by hand. Only async-signal-safe write and clock_gettime are called
+struct line {
+	int sz;
+	char buf[128];
+};
+
+static void
+_str(struct line *l, const char *str) {
+	while (*str && l->sz < (int)sizeof(l->buf)) {
+		l->buf[l->sz++] = *str++;
+	}
+}
+
+static void
+_dec(struct line *l, uint64_t v) {
+	char tmp[20];
+	int n = 0;
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n > 0 && l->sz < (int)sizeof(l->buf)) {
+		l->buf[l->sz++] = tmp[--n];
+	}
+}
+
+// 8 hex digits , like %08x
+static void
+_hex(struct line *l, uint32_t v) {
+	static const char digit[] = "0123456789abcdef";
+	int i;
+	for (i=28;i>=0 && l->sz < (int)sizeof(l->buf);i-=4) {
+		l->buf[l->sz++] = digit[(v >> i) & 0xf];
+	}
+}
+
+static void
+_flush(struct line *l, int fd) {
+	write(fd, l->buf, l->sz);
+	l->sz = 0;
+}
+
+static void
+_dump_one(struct skynet_monitor *sm, int fd) {
+	struct line l;
+	l.sz = 0;
+	uint32_t n = sm->rec_index;
+	uint32_t cap = sm->rec_mask + 1;
+	uint32_t i = n > cap ? n - cap : 0;
+	_str(&l, "worker "); _dec(&l, sm->id);
+	_str(&l, " : "); _dec(&l, n - i);
+	_str(&l, sm->destination ? " records (busy)\n" : " records\n");
+	_flush(&l, fd);
+	for (;i<n;i++) {
+		struct record * r = &sm->rec[i & sm->rec_mask];
+		_dec(&l, r->time);
+		_str(&l, " [:"); _hex(&l, r->source);
+		_str(&l, "] -> [:"); _hex(&l, r->destination);
+		_str(&l, "] type="); _dec(&l, r->sz >> HANDLE_REMOTE_SHIFT);
+		_str(&l, " size="); _dec(&l, r->sz & HANDLE_MASK);
+		_str(&l, " "); _dec(&l, r->duration);
+		_str(&l, "us\n");
+		_flush(&l, fd);
+	}
+	if (sm->destination) {
+		// the message being dispatched now
+		_dec(&l, sm->rec_start);
+		_str(&l, " [:"); _hex(&l, sm->source);
+		_str(&l, "] -> [:"); _hex(&l, sm->destination);
+		_str(&l, "] running\n");
+		_flush(&l, fd);
+	}
+}
+
+void
+skynet_monitor_dump(int fd) {
+	struct line l;
+	l.sz = 0;
+	_str(&l, "flight recorder now=");
+	_dec(&l, skynet_gettime_usec());
+	_str(&l, "\n");
+	_flush(&l, fd);
+	struct skynet_monitor * sm = ALL;
+	while (sm) {
+		if (sm->rec) {
+			_dump_one(sm, fd);
+		}
+		sm = sm->next;
 	}
 }
+
+static void
+_dump_signal(int sig) {
+	skynet_monitor_dump(STDERR_FILENO);
+	if (sig != SIGUSR1) {
+		// SA_RESETHAND restored the default action, crash as usual
+		raise(sig);
+	}
+}
+
+void
+skynet_monitor_signal(void) {
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _dump_signal;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, 0);
+	sa.sa_flags = SA_RESETHAND;
+	sigaction(SIGABRT, &sa, 0);
+	sigaction(SIGSEGV, &sa, 0);
+	sigaction(SIGBUS, &sa, 0);
+}
@@ -2,12 +2,31 @@
 #define SKYNET_MONITOR_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 struct skynet_monitor;
 
-struct skynet_monitor * skynet_monitor_new();
+// recorder is the size of the flight recorder ring (last dispatched messages), 0 for none
+struct skynet_monitor * skynet_monitor_new(int recorder);
 void skynet_monitor_delete(struct skynet_monitor *);
 void skynet_monitor_trigger(struct skynet_monitor *, uint32_t source, uint32_t destination);
+// call after dispatch, before skynet_monitor_trigger(sm, 0, 0) , return the cost of the message in usec
+uint32_t skynet_monitor_record(struct skynet_monitor *, size_t sz);
 void skynet_monitor_check(struct skynet_monitor *);
 
+struct skynet_monitor_stat {
+	int id;
+	uint64_t busy;	// usec
+	uint64_t idle;	// usec
+	uint64_t message;
+};
+
+// fill stat of all workers, return the number of workers (may be more than max)
+int skynet_monitor_stat(struct skynet_monitor_stat *stat, int max);
+
+// write all flight recorders to fd
+void skynet_monitor_dump(int fd);
+// dump on SIGUSR1, and before SIGABRT/SIGSEGV/SIGBUS crash
+void skynet_monitor_signal(void);
+
 #endif
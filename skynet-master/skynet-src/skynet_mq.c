@@ -2,6 +2,10 @@
 #include "skynet_mq.h"
 #include "skynet_handle.h"
 #include "skynet_multicast.h"
+#include "skynet_tracepoint.h"
+#ifdef QUEUE_WAIT_STAT
+#include "skynet_timer.h"
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,6 +35,7 @@ struct message_queue {
 	int lock_session;
 	int in_global; //该消息队列是否在全局消息队列中
 	struct skynet_message *queue; //消息队列数组
+	struct message_queue *next;	// in FREE_QUEUE
 };
 
 struct global_queue {
@@ -82,9 +87,23 @@ skynet_globalmq_pop() {
 	return mq;
 }
 
+// a released queue is kept for reuse , never freed , so skynet_mq_length can read it without lock after release
+static struct {
+	int lock;
+	struct message_queue * head;
+} FREE_QUEUE = { 0, NULL };
+
 struct message_queue * 
 skynet_mq_create(uint32_t handle) {
-	struct message_queue *q = malloc(sizeof(*q));
+	LOCK(&FREE_QUEUE)
+	struct message_queue *q = FREE_QUEUE.head;
+	if (q) {
+		FREE_QUEUE.head = q->next;
+	}
+	UNLOCK(&FREE_QUEUE)
+	if (q == NULL) {
+		q = malloc(sizeof(*q));
+	}
 	q->handle = handle;
 	q->cap = DEFAULT_QUEUE_SIZE;
 	q->head = 0;
@@ -101,7 +120,13 @@ skynet_mq_create(uint32_t handle) {
 static void 
 _release(struct message_queue *q) {
 	free(q->queue);
-	free(q);
+	q->queue = NULL;
+	q->head = 0;
+	q->tail = 0;
+	LOCK(&FREE_QUEUE)
+	q->next = FREE_QUEUE.head;
+	FREE_QUEUE.head = q;
+	UNLOCK(&FREE_QUEUE)
 }
 
 uint32_t 
@@ -109,6 +134,23 @@ skynet_mq_handle(struct message_queue *q) {
 	return q->handle;
 }
 
+int
+skynet_mq_length(struct message_queue *q) {
+	int head = q->head;
+	int tail = q->tail;
+	int cap = q->cap;
+	if (head <= tail) {
+		return tail - head;
+	}
+	return tail + cap - head;
+}
+
+int
+skynet_globalmq_length(void) {
+	struct global_queue *q = Q;
+	return (int)(q->tail - q->head);
+}
+
 //将最前面消息弹出队列
 int
 skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
@@ -182,6 +224,14 @@ _pushhead(struct message_queue *q, struct skynet_message *message) {
 void 
 skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
 	assert(message);
+#ifdef QUEUE_WAIT_STAT
+	// stamp outside the spin lock, the clock read is the expensive part
+	message->enqueue_time = skynet_gettime_usec();
+#endif
+#ifdef TRACEPOINT
+	message->trace_id = skynet_trace_newid();
+#endif
+	SKYNET_TRACE(TRACE_MQ_PUSH, q->handle, message->trace_id)
     //锁
 	LOCK(q)
 	
@@ -9,6 +9,12 @@ struct skynet_message {
 	int session;   //消息session ，用以标记消息
 	void * data;   //消息内容
 	size_t sz;      //消息大小
+#ifdef QUEUE_WAIT_STAT
+	uint64_t enqueue_time;	// usec, set by skynet_mq_push
+#endif
+#ifdef TRACEPOINT
+	uint32_t trace_id;	// links push and dispatch in the trace
+#endif
 };
 
 struct message_queue;
@@ -19,6 +25,9 @@ struct message_queue * skynet_mq_create(uint32_t handle);
 void skynet_mq_mark_release(struct message_queue *q);
 int skynet_mq_release(struct message_queue *q);
 uint32_t skynet_mq_handle(struct message_queue *);
+// lock free, may be a little stale. The queue can be read after release , it is reused but never freed
+int skynet_mq_length(struct message_queue *);
+int skynet_globalmq_length(void);
 
 // 0 for success
 int skynet_mq_pop(struct message_queue *q, struct skynet_message *message);
@@ -9,6 +9,7 @@
 #include "skynet_multicast.h"
 #include "skynet_group.h"
 #include "skynet_monitor.h"
+#include "skynet_tracepoint.h"
 
 #include <string.h>
 #include <assert.h>
@@ -32,12 +33,37 @@
 
 #endif
 
+#ifdef QUEUE_WAIT_STAT
+
+#include "skynet_timer.h"
+
+// bucket i counts waits in [2^(i-1), 2^i) usec, bucket 0 is < 1 usec
+#define WAIT_BUCKETS 32
+
+struct wait_stat {
+	uint32_t count;
+	uint32_t max;
+	uint32_t bucket[WAIT_BUCKETS];
+};
+
+#define WAITSTAT_INIT(ctx) memset(&ctx->wait, 0, sizeof(ctx->wait));
+#define WAITSTAT_RECORD(ctx, msg) _wait_record(&ctx->wait, &msg);
+#define WAITSTAT_DECL struct wait_stat wait;
+
+#else
+
+#define WAITSTAT_INIT(ctx)
+#define WAITSTAT_RECORD(ctx, msg)
+#define WAITSTAT_DECL
+
+#endif
+
 struct skynet_context {
 	void * instance; //调用对应_create方法返回的实例
 	struct skynet_module * mod; //动态.so模块
 	uint32_t handle;
 	int ref;
-	char result[32];
+	char result[48];
 	void * cb_ud;
 	skynet_cb cb; //回调函数
 	int session_id;
@@ -45,8 +71,11 @@ struct skynet_context {
 	struct message_queue *queue; //消息队列
 	bool init;                   //是否已经初始化
 	bool endless;
+	bool socket_batch;	// socket messages may come in SKYNET_SOCKET_TYPE_BATCH
+	struct stat_cell * stat;
 
 	CHECKCALLING_DECL
+	WAITSTAT_DECL
 };
 
 struct skynet_node {
@@ -56,6 +85,67 @@ struct skynet_node {
 
 static struct skynet_node G_NODE = { 0,0 };
 
+/*
+	The counters of each service for skynet_context_stat live in a cell out of the context.
+	Cells are allocated in chunks and never freed (a free cell is reused), the readers scan them without lock.
+ */
+#define STAT_CHUNK 1024
+#define MAX_STAT_CHUNK ((HANDLE_MASK + 1) / STAT_CHUNK)
+
+struct stat_cell {
+	uint32_t handle;	// 0 for free
+	const char * name;
+	struct message_queue * queue;	// reused but never freed , see skynet_mq_create
+	uint64_t cpu;	// usec
+	uint64_t message;
+	int64_t memory;	// see skynet_memory_report
+	struct stat_cell * next;	// free list
+};
+
+static struct {
+	int lock;
+	int n;	// cells allocated
+	struct stat_cell * free;
+	struct stat_cell * chunk[MAX_STAT_CHUNK];
+} STAT;
+
+static struct stat_cell *
+_stat_new(struct skynet_context *ctx) {
+	while (__sync_lock_test_and_set(&STAT.lock,1)) {}
+	struct stat_cell * cell = STAT.free;
+	if (cell) {
+		STAT.free = cell->next;
+	} else {
+		int n = STAT.n;
+		assert(n / STAT_CHUNK < MAX_STAT_CHUNK);
+		if (n % STAT_CHUNK == 0) {
+			STAT.chunk[n / STAT_CHUNK] = calloc(STAT_CHUNK, sizeof(struct stat_cell));
+		}
+		cell = &STAT.chunk[n / STAT_CHUNK][n % STAT_CHUNK];
+		// the chunk is ready before readers see it
+		__sync_synchronize();
+		STAT.n = n + 1;
+	}
+	__sync_lock_release(&STAT.lock);
+	cell->name = ctx->mod->name;
+	cell->queue = ctx->queue;
+	cell->cpu = 0;
+	cell->message = 0;
+	cell->memory = 0;
+	__sync_synchronize();
+	cell->handle = ctx->handle;
+	return cell;
+}
+
+static void
+_stat_delete(struct stat_cell *cell) {
+	cell->handle = 0;
+	while (__sync_lock_test_and_set(&STAT.lock,1)) {}
+	cell->next = STAT.free;
+	STAT.free = cell;
+	__sync_lock_release(&STAT.lock);
+}
+
 int 
 skynet_context_total() {
 	return G_NODE.total;
@@ -82,6 +172,42 @@ _id_to_hex(char * str, uint32_t id) {
 	str[9] = '\0';
 }
 
+#ifdef QUEUE_WAIT_STAT
+
+// Only the worker dispatching the context writes here, readers may see a torn snapshot.
+static void
+_wait_record(struct wait_stat *ws, struct skynet_message *msg) {
+	uint64_t diff = skynet_gettime_usec() - msg->enqueue_time;
+	uint32_t wait = diff > 0xffffffff ? 0xffffffff : (uint32_t)diff;
+	int i = 0;
+	while (i < WAIT_BUCKETS - 1 && (wait >> i)) {
+		++i;
+	}
+	++ws->bucket[i];
+	++ws->count;
+	if (wait > ws->max) {
+		ws->max = wait;
+	}
+}
+
+// upper bound (usec) of the bucket holding the given percentile
+static uint32_t
+_wait_percentile(struct wait_stat *ws, int percent) {
+	uint64_t target = ((uint64_t)ws->count * percent + 99) / 100;
+	uint64_t n = 0;
+	int i;
+	for (i=0;i<WAIT_BUCKETS;i++) {
+		n += ws->bucket[i];
+		if (n >= target) {
+			uint32_t bound = 1u << i;
+			return bound < ws->max ? bound : ws->max;
+		}
+	}
+	return ws->max;
+}
+
+#endif
+
 struct skynet_context * 
 skynet_context_new(const char * name, const char *param) {
 	struct skynet_module * mod = skynet_module_query(name);
@@ -105,9 +231,12 @@ skynet_context_new(const char * name, const char *param) {
 	ctx->forward = 0;
 	ctx->init = false;
 	ctx->endless = false;
+	ctx->socket_batch = false;
+	WAITSTAT_INIT(ctx)
 	ctx->handle = skynet_handle_register(ctx);//生成并注册handle
     //初始化一个消息队列
 	struct message_queue * queue = ctx->queue = skynet_mq_create(ctx->handle);
+	ctx->stat = _stat_new(ctx);
 	// init function maybe use ctx->handle, so it must init at last
 	_context_inc();
 
@@ -151,6 +280,7 @@ static void
 _delete_context(struct skynet_context *ctx) {
 	skynet_module_instance_release(ctx->mod, ctx->instance);
 	skynet_mq_mark_release(ctx->queue);
+	_stat_delete(ctx->stat);
 	free(ctx);
 	_context_dec();
 }
@@ -177,13 +307,60 @@ skynet_context_push(uint32_t handle, struct skynet_message *message) {
 	return 0;
 }
 
+int
+skynet_context_stat(struct skynet_context_stat *stat, int max) {
+	int n = STAT.n;
+	__sync_synchronize();
+	int count = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		struct stat_cell * cell = &STAT.chunk[i / STAT_CHUNK][i % STAT_CHUNK];
+		uint32_t handle = cell->handle;
+		if (handle == 0) {
+			continue;
+		}
+		if (count < max) {
+			struct skynet_context_stat * st = &stat[count];
+			st->handle = handle;
+			st->name = cell->name;
+			st->mqlen = skynet_mq_length(cell->queue);
+			st->cpu = cell->cpu;
+			st->message = cell->message;
+			st->memory = cell->memory;
+			if (cell->handle != handle) {
+				// reused while reading
+				continue;
+			}
+		}
+		++count;
+	}
+	return count;
+}
+
+void
+skynet_memory_report(struct skynet_context *ctx, int64_t bytes) {
+	ctx->stat->memory = bytes;
+}
+
+void
+skynet_context_socketbatch(struct skynet_context *ctx, int enable) {
+	ctx->socket_batch = enable != 0;
+}
+
+int
+skynet_context_batching(struct skynet_context *ctx) {
+	return ctx->socket_batch;
+}
+
 void 
-skynet_context_endless(uint32_t handle) {
+skynet_context_endless(uint32_t handle, int count) {
 	struct skynet_context * ctx = skynet_handle_grab(handle);
 	if (ctx == NULL) {
 		return;
 	}
 	ctx->endless = true;
+	// let the module report (signal 0) or break (signal >0) the running message, see snlua_signal
+	skynet_module_instance_signal(ctx->mod, ctx->instance, count);
 	skynet_context_release(ctx);
 }
 
@@ -283,6 +460,9 @@ skynet_context_message_dispatch(struct skynet_monitor *sm) {
 		return 0;
 	}
 
+	WAITSTAT_RECORD(ctx, msg)
+	SKYNET_TRACE(TRACE_DISPATCH_BEGIN, handle, msg.trace_id)
+
 	skynet_monitor_trigger(sm, msg.source , handle);
 
 	if (ctx->cb == NULL) {
@@ -292,6 +472,11 @@ skynet_context_message_dispatch(struct skynet_monitor *sm) {
 		_dispatch_message(ctx, &msg);
 	}
 
+	SKYNET_TRACE(TRACE_DISPATCH_END, handle, 0)
+	// only one worker dispatches ctx at a time, so no atomic add
+	ctx->stat->cpu += skynet_monitor_record(sm, msg.sz);
+	++ctx->stat->message;
+
 	assert(q == ctx->queue);
 	skynet_mq_pushglobal(q);
 	skynet_context_release(ctx);
@@ -538,6 +723,63 @@ skynet_command(struct skynet_context * context, const char * cmd , const char *
 		return NULL;
 	}
 
+	if (strcmp(cmd,"WAITSTAT") == 0) {
+		// count p50 p99 max (usec) of message queue wait time
+#ifdef QUEUE_WAIT_STAT
+		struct skynet_context * ctx = context;
+		if (param && param[0]) {
+			uint32_t handle = skynet_queryname(context, param);
+			ctx = skynet_handle_grab(handle);
+			if (ctx == NULL) {
+				return NULL;
+			}
+		} else {
+			skynet_context_grab(ctx);
+		}
+		struct wait_stat ws = ctx->wait;
+		skynet_context_release(ctx);
+		sprintf(context->result, "%u %u %u %u", ws.count, _wait_percentile(&ws, 50), _wait_percentile(&ws, 99), ws.max);
+		return context->result;
+#else
+		return NULL;
+#endif
+	}
+
+	if (strcmp(cmd,"RECORDER") == 0) {
+		// dump flight recorder of all workers to file param (or stderr)
+		if (param && param[0]) {
+			FILE *f = fopen(param, "a");
+			if (f == NULL) {
+				skynet_error(context, "Can't open %s for flight recorder", param);
+				return NULL;
+			}
+			fflush(f);
+			skynet_monitor_dump(fileno(f));
+			fclose(f);
+		} else {
+			skynet_monitor_dump(2);
+		}
+		return NULL;
+	}
+
+	if (strcmp(cmd,"TRACEFLUSH") == 0) {
+		// param : "json filename" or "binary filename" , return events count
+		if (param == NULL) {
+			return NULL;
+		}
+		int binary = strncmp(param, "binary ", 7) == 0;
+		const char * filename = strchr(param, ' ');
+		if (filename == NULL) {
+			return NULL;
+		}
+		int n = skynet_trace_flush(filename + 1, binary);
+		if (n < 0) {
+			return NULL;
+		}
+		sprintf(context->result, "%d", n);
+		return context->result;
+	}
+
 	if (strcmp(cmd,"ABORT") == 0) {
 		skynet_handle_retireall();
 		return NULL;
@@ -19,6 +19,23 @@ int skynet_context_newsession(struct skynet_context *);
 int skynet_context_message_dispatch(struct skynet_monitor *);	// return 1 when block
 int skynet_context_total();
 
-void skynet_context_endless(uint32_t handle);	// for monitor
+// socket messages to the service may be coalesced , see skynet_socket_batch
+void skynet_context_socketbatch(struct skynet_context *, int enable);
+int skynet_context_batching(struct skynet_context *);
+
+void skynet_context_endless(uint32_t handle, int count);	// for monitor, count is how many checks it has been stuck
+
+struct skynet_context_stat {
+	uint32_t handle;
+	const char * name;	// module name, lives as long as the process
+	int mqlen;
+	uint64_t cpu;	// usec
+	uint64_t message;
+	int64_t memory;	// bytes of heap reported by the service , 0 when it doesn't report
+};
+
+// lock free , the numbers may be a little stale.
+// fill at most max services, and return the number of services (call again with a larger array when it is > max)
+int skynet_context_stat(struct skynet_context_stat *stat, int max);
 
 #endif
@@ -3,102 +3,367 @@
 #include "skynet_server.h"
 #include "skynet_mq.h"
 #include "skynet_harbor.h"
+#include "skynet_tracepoint.h"
 #include "skynet.h"
 
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
+
+#define MAX_SOCKET_THREAD 64
 
 static struct socket_server * SOCKET_SERVER = NULL;
+// one shard per socket thread, they share the socket id space with SOCKET_SERVER (SHARD[0])
+static struct socket_server * SHARD[MAX_SOCKET_THREAD];
+static int SHARD_COUNT = 0;
 
-void 
-skynet_socket_init() {
-	SOCKET_SERVER = socket_server_create();
+// socket messages of one poll round held for the services of skynet_socket_batch, one batch per shard
+struct batch_owner {
+	uint32_t handle;
+	int n;
+	int addrsz;
+	int head;	// the first item , linked by next
+	int tail;
+};
+
+struct batch_item {
+	struct skynet_socket_message m;
+	int addr;	// offset in str of CONNECT , ACCEPT and ERROR , -1 for none
+	int addrsz;
+	int next;
+};
+
+struct socket_batch {
+	int owner_n;
+	int owner_cap;
+	struct batch_owner * owner;
+	int item_n;
+	int item_cap;
+	struct batch_item * item;
+	int str_sz;
+	int str_cap;
+	char * str;
+};
+
+static struct socket_batch BATCH[MAX_SOCKET_THREAD];
+static int BATCH_ON = 0;
+// the batching service of each socket slot , set when the socket is opened or started by it
+static uint32_t * BATCH_SOCKET = NULL;
+static int BATCH_MASK = 0;
+
+static void
+batch_free(struct socket_batch *b) {
+	free(b->owner);
+	free(b->item);
+	free(b->str);
+	memset(b, 0, sizeof(*b));
+}
+
+int 
+skynet_socket_init(int thread, int slice, int edge, int max) {
+	if (thread < 1) {
+		thread = 1;
+	} else if (thread > MAX_SOCKET_THREAD) {
+		thread = MAX_SOCKET_THREAD;
+	}
+	int i;
+	for (i=0;i<thread;i++) {
+		SHARD[i] = socket_server_create(SOCKET_SERVER, max);
+		if (SHARD[i] == NULL) {
+			break;
+		}
+		socket_server_edge(SHARD[i], edge);
+		if (slice > 0) {
+			socket_server_readslice(SHARD[i], slice);
+		}
+		SOCKET_SERVER = SHARD[0];
+	}
+	SHARD_COUNT = i;
+	if (SOCKET_SERVER) {
+		int cap = socket_server_capacity(SOCKET_SERVER);
+		BATCH_SOCKET = calloc(cap, sizeof(uint32_t));
+		BATCH_MASK = cap - 1;
+	}
+	return SHARD_COUNT;
+}
+
+void
+skynet_socket_resolver(int thread, int ttl) {
+	socket_server_resolver(SOCKET_SERVER, thread, ttl);
 }
 
 void
 skynet_socket_exit() {
-	socket_server_exit(SOCKET_SERVER);
+	int i;
+	for (i=0;i<SHARD_COUNT;i++) {
+		socket_server_exit(SHARD[i]);
+	}
 }
 
 void
 skynet_socket_free() {
-	socket_server_release(SOCKET_SERVER);
+	int i;
+	for (i=0;i<SHARD_COUNT;i++) {
+		socket_server_release(SHARD[i]);
+		SHARD[i] = NULL;
+		batch_free(&BATCH[i]);
+	}
+	SHARD_COUNT = 0;
 	SOCKET_SERVER = NULL;
+	BATCH_ON = 0;
+	free(BATCH_SOCKET);
+	BATCH_SOCKET = NULL;
 }
 
-// mainloop thread
+// the read buffers of DATA and UDP are freed with the message
 static void
-forward_message(int type, bool padding, struct socket_message * result) {
-	struct skynet_socket_message *sm;
-	int sz = sizeof(*sm);
-	if (padding) {
-		if (result->data) {
-			sz += strlen(result->data) + 1;
-		} else {
-			sz += 1;
-		}
+drop_message(struct skynet_socket_message *sm) {
+	int n = 1;
+	if (sm->type == SKYNET_SOCKET_TYPE_BATCH) {
+		n = sm->ud;
+		++sm;
 	}
-	sm = (struct skynet_socket_message *)malloc(sz);
-	sm->type = type;
-	sm->id = result->id;
-	sm->ud = result->ud;
-	if (padding) {
-		sm->buffer = NULL;
-		strcpy((char*)(sm+1), result->data);
-	} else {
-		sm->buffer = result->data;
+	int i;
+	for (i=0;i<n;i++) {
+		if (sm[i].type == SKYNET_SOCKET_TYPE_DATA || sm[i].type == SKYNET_SOCKET_TYPE_UDP) {
+			skynet_socket_free_buffer(sm[i].buffer);
+		}
 	}
+}
 
+static void
+push_message(uint32_t handle, struct skynet_socket_message *sm, int sz) {
 	struct skynet_message message;
 	message.source = 0;
 	message.session = 0;
 	message.data = sm;
 	message.sz = sz | PTYPE_SOCKET << HANDLE_REMOTE_SHIFT;
-	
-	if (skynet_context_push((uint32_t)result->opaque, &message)) {
+
+	if (skynet_context_push(handle, &message)) {
 		// todo: report somewhere to close socket
 		// don't call skynet_socket_close here (It will block mainloop)
+		drop_message(sm);
 		free(sm);
 	}
 }
 
+// addr (addrsz bytes with the tail 0) follows the message when it is not NULL
+static void
+send_message(uint32_t handle, const struct skynet_socket_message *m, const char *addr, int addrsz) {
+	struct skynet_socket_message *sm;
+	int sz = sizeof(*sm) + addrsz;
+	sm = (struct skynet_socket_message *)malloc(sz);
+	*sm = *m;
+	if (addr) {
+		sm->buffer = NULL;
+		memcpy(sm+1, addr, addrsz);
+	}
+	push_message(handle, sm, sz);
+}
+
+static struct batch_owner *
+batch_owner(struct socket_batch *b, uint32_t handle) {
+	int i;
+	for (i=b->owner_n-1;i>=0;i--) {
+		if (b->owner[i].handle == handle)
+			return &b->owner[i];
+	}
+	if (b->owner_n >= b->owner_cap) {
+		b->owner_cap = b->owner_cap ? b->owner_cap * 2 : 16;
+		b->owner = realloc(b->owner, b->owner_cap * sizeof(*b->owner));
+	}
+	struct batch_owner * o = &b->owner[b->owner_n++];
+	o->handle = handle;
+	o->n = 0;
+	o->addrsz = 0;
+	o->head = -1;
+	o->tail = -1;
+	return o;
+}
+
+static void
+batch_hold(struct socket_batch *b, uint32_t handle, const struct skynet_socket_message *m, const char *addr, int addrsz) {
+	struct batch_owner * o = batch_owner(b, handle);
+	if (b->item_n >= b->item_cap) {
+		b->item_cap = b->item_cap ? b->item_cap * 2 : 64;
+		b->item = realloc(b->item, b->item_cap * sizeof(*b->item));
+	}
+	int index = b->item_n++;
+	struct batch_item * item = &b->item[index];
+	item->m = *m;
+	item->addr = -1;
+	item->addrsz = addrsz;
+	item->next = -1;
+	if (addr) {
+		if (b->str_sz + addrsz > b->str_cap) {
+			b->str_cap = (b->str_sz + addrsz) * 2;
+			b->str = realloc(b->str, b->str_cap);
+		}
+		item->addr = b->str_sz;
+		memcpy(b->str + b->str_sz, addr, addrsz);
+		b->str_sz += addrsz;
+		o->addrsz += addrsz;
+	}
+	if (o->tail >= 0) {
+		b->item[o->tail].next = index;
+	} else {
+		o->head = index;
+	}
+	o->tail = index;
+	++o->n;
+}
+
+// push the held messages , one message for each service. return the number of messages pushed
+static int
+batch_flush(struct socket_batch *b) {
+	int pushed = 0;
+	int i;
+	for (i=0;i<b->owner_n;i++) {
+		struct batch_owner * o = &b->owner[i];
+		if (o->n == 0) {
+			continue;
+		}
+		++pushed;
+		if (o->n == 1) {
+			struct batch_item * item = &b->item[o->head];
+			if (item->addr >= 0) {
+				send_message(o->handle, &item->m, b->str + item->addr, o->addrsz);
+			} else {
+				send_message(o->handle, &item->m, NULL, 0);
+			}
+			continue;
+		}
+		struct skynet_socket_message *sm;
+		int sz = sizeof(*sm) * (o->n + 1) + o->addrsz;
+		sm = (struct skynet_socket_message *)malloc(sz);
+		sm->type = SKYNET_SOCKET_TYPE_BATCH;
+		sm->id = 0;
+		sm->ud = o->n;
+		sm->buffer = NULL;
+		struct skynet_socket_message * m = sm+1;
+		char * str = (char *)(m + o->n);
+		int index;
+		for (index = o->head; index >= 0; index = b->item[index].next) {
+			struct batch_item * item = &b->item[index];
+			*m = item->m;
+			if (item->addr >= 0) {
+				memcpy(str, b->str + item->addr, item->addrsz);
+				m->buffer = str;
+				str += item->addrsz;
+			}
+			++m;
+		}
+		push_message(o->handle, sm, sz);
+	}
+	b->owner_n = 0;
+	b->item_n = 0;
+	b->str_sz = 0;
+	return pushed;
+}
+
+// mainloop thread
+static void
+forward_message(int shard, int type, bool padding, struct socket_message * result) {
+	struct skynet_socket_message m;
+	m.type = type;
+	m.id = result->id;
+	m.ud = result->ud;
+	m.offset = result->offset;
+	m.buffer = result->data;
+	const char * addr = NULL;
+	int addrsz = 0;
+	if (padding) {
+		addr = result->data ? result->data : "";
+		addrsz = (int)strlen(addr) + 1;
+	}
+	uint32_t handle = (uint32_t)result->opaque;
+	if (BATCH_ON && BATCH_SOCKET[(unsigned)result->id & BATCH_MASK] == handle) {
+		batch_hold(&BATCH[shard], handle, &m, addr, addrsz);
+		return;
+	}
+	send_message(handle, &m, addr, addrsz);
+}
+
 int 
-skynet_socket_poll() {
-	struct socket_server *ss = SOCKET_SERVER;
+skynet_socket_poll(int shard) {
+	struct socket_server *ss = SHARD[shard];
 	assert(ss);
 	struct socket_message result;
 	int more = 1;
 	int type = socket_server_poll(ss, &result, &more);
 	switch (type) {
 	case SOCKET_EXIT:
+		batch_flush(&BATCH[shard]);
 		return 0;
+	case SOCKET_IDLE:
+		// the round is over , wake up the workers for the held messages
+		return batch_flush(&BATCH[shard]) ? 1 : -1;
 	case SOCKET_DATA:
-		forward_message(SKYNET_SOCKET_TYPE_DATA, false, &result);
+		forward_message(shard, SKYNET_SOCKET_TYPE_DATA, false, &result);
 		break;
 	case SOCKET_CLOSE:
-		forward_message(SKYNET_SOCKET_TYPE_CLOSE, false, &result);
+		forward_message(shard, SKYNET_SOCKET_TYPE_CLOSE, false, &result);
 		break;
 	case SOCKET_OPEN:
-		forward_message(SKYNET_SOCKET_TYPE_CONNECT, true, &result);
+		forward_message(shard, SKYNET_SOCKET_TYPE_CONNECT, true, &result);
 		break;
 	case SOCKET_ERROR:
-		forward_message(SKYNET_SOCKET_TYPE_ERROR, false, &result);
+		forward_message(shard, SKYNET_SOCKET_TYPE_ERROR, true, &result);
 		break;
 	case SOCKET_ACCEPT:
-		forward_message(SKYNET_SOCKET_TYPE_ACCEPT, true, &result);
+		forward_message(shard, SKYNET_SOCKET_TYPE_ACCEPT, true, &result);
+		break;
+	case SOCKET_UDP:
+		forward_message(shard, SKYNET_SOCKET_TYPE_UDP, false, &result);
+		break;
+	case SOCKET_WARNING:
+		forward_message(shard, SKYNET_SOCKET_TYPE_WARNING, false, &result);
+		break;
+	case SOCKET_WRITABLE:
+		forward_message(shard, SKYNET_SOCKET_TYPE_WRITABLE, false, &result);
 		break;
 	default:
 		skynet_error(NULL, "Unknown socket message type %d.",type);
 		return -1;
 	}
+	// only the forwarded messages , result is not filled for the others
+	SKYNET_TRACE(TRACE_SOCKET, type, result.id)
 	if (more) {
 		return -1;
 	}
 	return 1;
 }
 
+// the messages of a socket opened by the service may come out of batch , before batch_own
+static int
+batch_own(struct skynet_context *ctx, int id) {
+	if (id >= 0) {
+		uint32_t * owner = &BATCH_SOCKET[(unsigned)id & BATCH_MASK];
+		if (skynet_context_batching(ctx)) {
+			*owner = skynet_context_handle(ctx);
+		} else if (*owner) {
+			*owner = 0;
+		}
+	}
+	return id;
+}
+
+void
+skynet_socket_batch(struct skynet_context *ctx, int enable) {
+	skynet_context_socketbatch(ctx, enable);
+	if (enable && !BATCH_ON) {
+		int i;
+		for (i=0;i<SHARD_COUNT;i++) {
+			socket_server_idle(SHARD[i], 1);
+		}
+		// SOCKET_IDLE must be on before the messages are held
+		__sync_synchronize();
+		BATCH_ON = 1;
+	}
+}
+
 int
 skynet_socket_send(struct skynet_context *ctx, int id, void *buffer, int sz) {
 	int err = socket_server_send(SOCKET_SERVER, id, buffer, sz);
@@ -108,28 +373,43 @@ skynet_socket_send(struct skynet_context *ctx, int id, void *buffer, int sz) {
 	return err;
 }
 
+int
+skynet_socket_sendfile(struct skynet_context *ctx, int id, int fd, int64_t offset, int sz) {
+	int err = socket_server_sendfile(SOCKET_SERVER, id, fd, offset, sz);
+	if (err < 0) {
+		close(fd);
+	}
+	return err;
+}
+
 int 
 skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int backlog) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_listen(SOCKET_SERVER, source, host, port, backlog);
+	return batch_own(ctx, socket_server_listen(SOCKET_SERVER, source, host, port, backlog));
+}
+
+int
+skynet_socket_listen_opt(struct skynet_context *ctx, const char *host, int port, int backlog, const struct socket_listen_opt *opt) {
+	uint32_t source = skynet_context_handle(ctx);
+	return batch_own(ctx, socket_server_listen_opt(SOCKET_SERVER, source, host, port, backlog, opt));
 }
 
 int 
 skynet_socket_connect(struct skynet_context *ctx, const char *host, int port) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_connect(SOCKET_SERVER, source, host, port);
+	return batch_own(ctx, socket_server_connect(SOCKET_SERVER, source, host, port));
 }
 
-int 
-skynet_socket_block_connect(struct skynet_context *ctx, const char *host, int port) {
+int
+skynet_socket_connect_timeout(struct skynet_context *ctx, const char *host, int port, int timeout) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_block_connect(SOCKET_SERVER, source, host, port);
+	return batch_own(ctx, socket_server_connect_timeout(SOCKET_SERVER, source, host, port, timeout));
 }
 
 int 
 skynet_socket_bind(struct skynet_context *ctx, int fd) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_bind(SOCKET_SERVER, source, fd);
+	return batch_own(ctx, socket_server_bind(SOCKET_SERVER, source, fd));
 }
 
 void 
@@ -143,5 +423,77 @@ skynet_socket_start(struct skynet_context *ctx, int id) {
     //取服务handle
 	uint32_t source = skynet_context_handle(ctx);
     //启动socket
+	batch_own(ctx, id);
 	socket_server_start(SOCKET_SERVER, source, id);
 }
+
+void
+skynet_socket_watermark(struct skynet_context *ctx, int id, int high, int low) {
+	socket_server_watermark(SOCKET_SERVER, id, high, low);
+}
+
+void
+skynet_socket_setopt(struct skynet_context *ctx, int id, int what, int value) {
+	socket_server_setopt(SOCKET_SERVER, id, what, value);
+}
+
+void
+skynet_socket_framing(struct skynet_context *ctx, int id, int header, int max) {
+	socket_server_framing(SOCKET_SERVER, id, header, max);
+}
+
+int
+skynet_socket_udp(struct skynet_context *ctx, const char * addr, int port) {
+	uint32_t source = skynet_context_handle(ctx);
+	return batch_own(ctx, socket_server_udp(SOCKET_SERVER, source, addr, port));
+}
+
+int
+skynet_socket_udp_connect(struct skynet_context *ctx, int id, const char * addr, int port) {
+	return socket_server_udp_connect(SOCKET_SERVER, id, addr, port);
+}
+
+int
+skynet_socket_udp_send(struct skynet_context *ctx, int id, const struct socket_udp_address *address, const void *buffer, int sz) {
+	int err = socket_server_udp_send(SOCKET_SERVER, id, address, buffer, sz);
+	if (err < 0) {
+		free((void *)buffer);
+	}
+	return err;
+}
+
+const struct socket_udp_address *
+skynet_socket_udp_address(struct skynet_socket_message *msg, int *addrsz) {
+	if (msg->type != SKYNET_SOCKET_TYPE_UDP) {
+		return NULL;
+	}
+	struct socket_message sm;
+	sm.id = msg->id;
+	sm.opaque = 0;
+	sm.ud = msg->ud;
+	sm.data = msg->buffer;
+	return socket_server_udp_address(&sm, addrsz);
+}
+
+void
+skynet_socket_free_buffer(void *buffer) {
+	socket_server_free_buffer(buffer);
+}
+
+void
+skynet_socket_stat(struct socket_server_stat *stat) {
+	socket_server_stat(SHARD[0], stat);
+	int i;
+	for (i=1;i<SHARD_COUNT;i++) {
+		struct socket_server_stat tmp;
+		socket_server_stat(SHARD[i], &tmp);
+		stat->recv_bytes += tmp.recv_bytes;
+		stat->send_bytes += tmp.send_bytes;
+	}
+}
+
+int
+skynet_socket_info(struct socket_info *info, int max) {
+	// the socket id space is shared by all the shards
+	return socket_server_info(SHARD[0], info, max);
+}
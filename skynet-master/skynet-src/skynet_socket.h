@@ -1,32 +1,80 @@
 #ifndef skynet_socket_h
 #define skynet_socket_h
 
+#include <stdint.h>
+
 struct skynet_context;
+struct socket_server_stat;
+struct socket_info;
+struct socket_listen_opt;
 
 #define SKYNET_SOCKET_TYPE_DATA 1
 #define SKYNET_SOCKET_TYPE_CONNECT 2
 #define SKYNET_SOCKET_TYPE_CLOSE 3
 #define SKYNET_SOCKET_TYPE_ACCEPT 4
+// the reason follows the message , like the address of CONNECT
 #define SKYNET_SOCKET_TYPE_ERROR 5
+#define SKYNET_SOCKET_TYPE_UDP 6
+// write queue reaches the high watermark (ud is the queued K bytes) , or is under the low watermark again
+#define SKYNET_SOCKET_TYPE_WARNING 7
+#define SKYNET_SOCKET_TYPE_WRITABLE 8
+// ud messages of one poll round follow this one , only for the service of skynet_socket_batch.
+// The buffer of CONNECT , ACCEPT and ERROR in the batch is the string (0 terminated) , it lives as long as the batch
+#define SKYNET_SOCKET_TYPE_BATCH 9
 
 struct skynet_socket_message {
 	int type;
 	int id;
 	int ud;
+	int offset;	// DATA of a framing socket is at buffer + offset , free the buffer
 	char * buffer;
 };
 
-void skynet_socket_init();
+// return the number of socket threads (shards) created. slice is the size of shared read block, 0 for off
+// edge is the max bytes read from one edge triggered event, 0 for level triggered
+// max is the max sockets (rounded up to power of 2), 0 for 65536
+int skynet_socket_init(int thread, int slice, int edge, int max);
+// host names of connect are resolved by threads , and cached for ttl seconds
+void skynet_socket_resolver(int thread, int ttl);
 void skynet_socket_exit();
 void skynet_socket_free();
-int skynet_socket_poll();
+int skynet_socket_poll(int shard);
+// the socket messages of one poll round to the service are coalesced into one SKYNET_SOCKET_TYPE_BATCH.
+// It works for the sockets opened or started by the service after the call
+void skynet_socket_batch(struct skynet_context *ctx, int enable);
 
 int skynet_socket_send(struct skynet_context *ctx, int id, void *buffer, int sz);
+// fd is closed after sz bytes from offset are sent , or when error
+int skynet_socket_sendfile(struct skynet_context *ctx, int id, int fd, int64_t offset, int sz);
 int skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int backlog);
+// opt is struct socket_listen_opt of socket_server.h , NULL for default
+int skynet_socket_listen_opt(struct skynet_context *ctx, const char *host, int port, int backlog, const struct socket_listen_opt *opt);
 int skynet_socket_connect(struct skynet_context *ctx, const char *host, int port);
-int skynet_socket_block_connect(struct skynet_context *ctx, const char *host, int port);
+// SKYNET_SOCKET_TYPE_ERROR "connect timeout" when it is not connected in timeout ms , 0 for no timeout
+int skynet_socket_connect_timeout(struct skynet_context *ctx, const char *host, int port, int timeout);
 int skynet_socket_bind(struct skynet_context *ctx, int fd);
 void skynet_socket_close(struct skynet_context *ctx, int id);
 void skynet_socket_start(struct skynet_context *ctx, int id);
+// high 0 for off , low < 0 for high/2
+void skynet_socket_watermark(struct skynet_context *ctx, int id, int high, int low);
+// what is SOCKET_OPT_* of socket_server.h
+void skynet_socket_setopt(struct skynet_context *ctx, int id, int what, int value);
+// SKYNET_SOCKET_TYPE_DATA is one packet (at buffer + offset) of 2 or 4 bytes big-endian size header , header 0 for off.
+// max is the max packet (0 for 16M). Call it before skynet_socket_start of an accepted socket
+void skynet_socket_framing(struct skynet_context *ctx, int id, int header, int max);
+
+// udp , the buffer of SKYNET_SOCKET_TYPE_UDP is the datagram (ud bytes) followed by the peer address
+struct socket_udp_address;
+int skynet_socket_udp(struct skynet_context *ctx, const char * addr, int port);
+int skynet_socket_udp_connect(struct skynet_context *ctx, int id, const char * addr, int port);
+int skynet_socket_udp_send(struct skynet_context *ctx, int id, const struct socket_udp_address *address, const void *buffer, int sz);
+const struct socket_udp_address * skynet_socket_udp_address(struct skynet_socket_message *, int *addrsz);
+
+// the buffer of SKYNET_SOCKET_TYPE_DATA is pooled by socket thread, use it instead of free()
+void skynet_socket_free_buffer(void *buffer);
+
+void skynet_socket_stat(struct socket_server_stat *stat);
+// traffic of every live socket in one call , return the number of live sockets (at most max are filled)
+int skynet_socket_info(struct socket_info *info, int max);
 
 #endif
@@ -9,6 +9,7 @@
 #include "skynet_group.h"
 #include "skynet_monitor.h"
 #include "skynet_socket.h"
+#include "skynet_tracepoint.h"
 
 #include <pthread.h>
 #include <unistd.h>
@@ -23,6 +24,7 @@ struct monitor {
 	pthread_cond_t cond;
 	pthread_mutex_t mutex;
 	int sleep; //睡眠 ？
+	int interval;	// monitor check interval (ms)
 };
 
 struct worker_parm {
@@ -50,9 +52,12 @@ wakeup(struct monitor *m, int busy) {
 
 static void *
 _socket(void *p) {
-	struct monitor * m = p;
+	struct worker_parm *wp = p;
+	struct monitor * m = wp->m;
+	int shard = wp->id;
+	SKYNET_TRACE_THREAD("socket")
 	for (;;) {
-		int r = skynet_socket_poll();
+		int r = skynet_socket_poll(shard);
 		if (r==0)
 			break;
 		if (r<0) {
@@ -87,9 +92,10 @@ _monitor(void *p) {
 		for (i=0;i<n;i++) {
 			skynet_monitor_check(m->m[i]);
 		}
-		for (i=0;i<5;i++) {
+		int t;
+		for (t=m->interval;t>0;t-=1000) {
 			CHECK_ABORT
-			sleep(1);
+			usleep((t > 1000 ? 1000 : t) * 1000);
 		}
 	}
 
@@ -99,6 +105,7 @@ _monitor(void *p) {
 static void *
 _timer(void *p) {
 	struct monitor * m = p;
+	SKYNET_TRACE_THREAD("timer")
 	for (;;) {
 		skynet_updatetime();
 		CHECK_ABORT
@@ -118,6 +125,7 @@ _worker(void *p) {
 	int id = wp->id;
 	struct monitor *m = wp->m;
 	struct skynet_monitor *sm = m->m[id];
+	SKYNET_TRACE_THREAD("worker")
 	for (;;) {
 		if (skynet_context_message_dispatch(sm)) {
 			CHECK_ABORT
@@ -149,18 +157,23 @@ _worker(void *p) {
  该线程主要是从epoll_wait的结果中读取消息，若有需要处理的消息则进行相关的处理。这里面的消息目前要说明的有三个：第一个是管道，作者把管道的读端放到了epoll中进行管理，也就是说，每次向管道中写数据，都是socket线程读取并处理的；第二个是gate产生的监听端口，也是由epoll管理，并且一旦产生了数据也是由socket处理；第三个是accept客户端的socket后，客户端发送到服务端的数据，此数据也由socket线程处理。
 */
 static void
-_start(int thread) {
-	pthread_t pid[thread+3];
+_start(int thread, int socket_thread, int interval, int recorder) {
+	int n = thread + socket_thread + 2;
+	pthread_t pid[n];
 
 	struct monitor *m = malloc(sizeof(*m));
 	memset(m, 0, sizeof(*m));
 	m->count = thread;
 	m->sleep = 0;
+	m->interval = interval > 0 ? interval : 5000;
 
 	m->m = malloc(thread * sizeof(struct skynet_monitor *));
 	int i;
 	for (i=0;i<thread;i++) {
-		m->m[i] = skynet_monitor_new();
+		m->m[i] = skynet_monitor_new(recorder);
+	}
+	if (recorder > 0) {
+		skynet_monitor_signal();
 	}
 	if (pthread_mutex_init(&m->mutex, NULL)) {
 		fprintf(stderr, "Init mutex error");
@@ -173,16 +186,22 @@ _start(int thread) {
 
 	create_thread(&pid[0], _monitor, m);
 	create_thread(&pid[1], _timer, m);
-	create_thread(&pid[2], _socket, m);
+
+	struct worker_parm sp[socket_thread];
+	for (i=0;i<socket_thread;i++) {
+		sp[i].m = m;
+		sp[i].id = i;
+		create_thread(&pid[i+2], _socket, &sp[i]);
+	}
 
 	struct worker_parm wp[thread];
 	for (i=0;i<thread;i++) {
 		wp[i].m = m;
 		wp[i].id = i;
-		create_thread(&pid[i+3], _worker, &wp[i]);
+		create_thread(&pid[i+2+socket_thread], _worker, &wp[i]);
 	}
 
-	for (i=0;i<thread+3;i++) {
+	for (i=0;i<n;i++) {
 		pthread_join(pid[i], NULL); 
 	}
 
@@ -212,7 +231,12 @@ skynet_start(struct skynet_config * config) {
     //初始化timmer
 	skynet_timer_init();
     //初始化 server socket
-	skynet_socket_init();
+	int socket_thread = skynet_socket_init(config->socket_thread, config->socket_slice, config->socket_edge, config->socket_max);
+	if (socket_thread == 0) {
+		fprintf(stderr, "Init fail : socket server");
+		return;
+	}
+	skynet_socket_resolver(config->resolver_thread, config->resolver_ttl);
    //启动master
 	if (config->standalone) {
         printf("debug _start_master start \n");
@@ -238,13 +262,19 @@ skynet_start(struct skynet_config * config) {
 		fprintf(stderr,"launch local cast error");
 		exit(1);
 	}
+	if (config->metrics) {
+		ctx = skynet_context_new("metrics", config->metrics);
+		if (ctx == NULL) {
+			fprintf(stderr,"launch metrics error");
+		}
+	}
 	ctx = skynet_context_new("snlua", "launcher");
 	if (ctx) {
 		skynet_command(ctx, "REG", ".launcher");
 		ctx = skynet_context_new("snlua", config->start);
 	}
 
-	_start(config->thread);
+	_start(config->thread, socket_thread, config->monitor_interval, config->recorder);
 	skynet_socket_free();
 }
 
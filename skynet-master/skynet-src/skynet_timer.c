@@ -2,6 +2,7 @@
 #include "skynet_mq.h"
 #include "skynet_server.h"
 #include "skynet_handle.h"
+#include "skynet_tracepoint.h"
 #include "skynet.h"
 
 #include <time.h>
@@ -41,6 +42,7 @@ struct timer {
 	struct link_list near[TIME_NEAR];
 	struct link_list t[4][TIME_LEVEL-1];
 	int lock;
+	int count;
 	int time;
 	uint32_t current;
 	uint32_t starttime;
@@ -98,6 +100,7 @@ timer_add(struct timer *T,void *arg,size_t sz,int time)
 
 		node->expire=time+T->time;
 		add_node(T,node);
+		++T->count;
 
 	__sync_lock_release(&T->lock);
 }
@@ -109,11 +112,21 @@ timer_execute(struct timer *T)
 	int idx=T->time & TIME_NEAR_MASK;
 	struct timer_node *current;
 	int mask,i,time;
+#ifdef TRACEPOINT
+	// trace only the ticks which fire timeout
+	int fired = 0;
+	if (T->near[idx].head.next) {
+		SKYNET_TRACE(TRACE_TIMER_BEGIN, T->time, 0)
+	}
+#endif
 	
 	while (T->near[idx].head.next) {
 		current=link_clear(&T->near[idx]);
 		
 		do {
+#ifdef TRACEPOINT
+			++fired;
+#endif
 			struct timer_event * event = (struct timer_event *)(current+1);
 			struct skynet_message message;
 			message.source = 0;
@@ -126,9 +139,15 @@ timer_execute(struct timer *T)
 			struct timer_node * temp = current;
 			current=current->next;
 			free(temp);	
+			--T->count;
 		} while (current);
 	}
 	
+#ifdef TRACEPOINT
+	if (fired) {
+		SKYNET_TRACE(TRACE_TIMER_END, T->time, fired)
+	}
+#endif
 	++T->time;
 	
 	mask = TIME_NEAR;
@@ -217,6 +236,19 @@ _gettime(void) {
 	return t;
 }
 
+uint64_t
+skynet_gettime_usec(void) {
+#if !defined(__APPLE__)
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000 + ti.tv_nsec / 1000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
 void
 skynet_updatetime(void) {
 	uint32_t ct = _gettime();
@@ -230,6 +262,11 @@ skynet_updatetime(void) {
 	}
 }
 
+int
+skynet_timer_count(void) {
+	return TI->count;
+}
+
 uint32_t
 skynet_gettime_fixsec(void) {
 	return TI->starttime;
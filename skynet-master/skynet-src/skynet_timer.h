@@ -7,6 +7,10 @@ int skynet_timeout(uint32_t handle, int time, int session);
 void skynet_updatetime(void);
 uint32_t skynet_gettime(void);
 uint32_t skynet_gettime_fixsec(void);
+// monotonic microseconds, for profiling
+uint64_t skynet_gettime_usec(void);
+// number of pending timeout in the wheel
+int skynet_timer_count(void);
 
 void skynet_timer_init(void);
 
@@ -0,0 +1,206 @@
+#include "skynet_tracepoint.h"
+
+#include <stdio.h>
+
+#ifdef TRACEPOINT
+
+#include "skynet_timer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// 2^16 events per thread , the oldest events are overwritten
+#define TRACE_BUFFER_P 16
+#define TRACE_BUFFER (1 << TRACE_BUFFER_P)
+#define TRACE_MASK (TRACE_BUFFER - 1)
+#define MAX_NAME 16
+
+struct trace_event {
+	uint64_t time;	// usec
+	uint32_t a;
+	uint32_t b;
+	uint32_t type;
+};
+
+// one per thread, written only by the owner thread
+struct trace_buffer {
+	struct trace_buffer * next;
+	int tid;
+	char name[MAX_NAME];
+	uint32_t index;
+	uint32_t flushed;
+	struct trace_event ev[TRACE_BUFFER];
+};
+
+static struct trace_buffer * ALL = NULL;
+static int THREAD_COUNT = 0;
+static uint32_t TRACE_ID = 0;
+static int FLUSH_LOCK = 0;
+static __thread struct trace_buffer * T = NULL;
+
+static struct trace_buffer *
+_new_buffer(const char * name) {
+	struct trace_buffer * tb = malloc(sizeof(*tb));
+	memset(tb, 0, sizeof(*tb) - sizeof(tb->ev));
+	tb->tid = __sync_add_and_fetch(&THREAD_COUNT, 1);
+	strncpy(tb->name, name, MAX_NAME-1);
+	do {
+		tb->next = ALL;
+	} while (!__sync_bool_compare_and_swap(&ALL, tb->next, tb));
+	return tb;
+}
+
+void
+skynet_trace_thread(const char * name) {
+	if (T == NULL) {
+		T = _new_buffer(name);
+	}
+}
+
+uint32_t
+skynet_trace_newid(void) {
+	return __sync_add_and_fetch(&TRACE_ID, 1);
+}
+
+void
+skynet_trace(int type, uint32_t a, uint32_t b) {
+	struct trace_buffer * tb = T;
+	if (tb == NULL) {
+		tb = T = _new_buffer("thread");
+	}
+	struct trace_event * e = &tb->ev[tb->index & TRACE_MASK];
+	e->time = skynet_gettime_usec();
+	e->type = type;
+	e->a = a;
+	e->b = b;
+	__sync_synchronize();
+	++tb->index;
+}
+
+static void
+_json_event(FILE *f, int tid, struct trace_event *e) {
+	const char * fmt = "{\"pid\":1,\"tid\":%d,\"ts\":%llu,";
+	unsigned long long ts = (unsigned long long)e->time;
+	switch (e->type) {
+	case TRACE_MQ_PUSH:
+		fprintf(f, fmt, tid, ts);
+		fprintf(f, "\"name\":\"push\",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"to\":\":%08x\"}},\n", e->a);
+		fprintf(f, fmt, tid, ts);
+		fprintf(f, "\"name\":\"message\",\"cat\":\"mq\",\"ph\":\"s\",\"id\":%u},\n", e->b);
+		break;
+	case TRACE_DISPATCH_BEGIN:
+		fprintf(f, fmt, tid, ts);
+		fprintf(f, "\"name\":\"dispatch\",\"ph\":\"B\",\"args\":{\"handle\":\":%08x\"}},\n", e->a);
+		if (e->b) {
+			fprintf(f, fmt, tid, ts);
+			fprintf(f, "\"name\":\"message\",\"cat\":\"mq\",\"ph\":\"f\",\"bp\":\"e\",\"id\":%u},\n", e->b);
+		}
+		break;
+	case TRACE_DISPATCH_END:
+	case TRACE_TIMER_END:
+		fprintf(f, fmt, tid, ts);
+		fprintf(f, "\"ph\":\"E\",\"args\":{\"n\":%u}},\n", e->b);
+		break;
+	case TRACE_TIMER_BEGIN:
+		fprintf(f, fmt, tid, ts);
+		fprintf(f, "\"name\":\"timer\",\"ph\":\"B\",\"args\":{\"tick\":%u}},\n", e->a);
+		break;
+	case TRACE_SOCKET:
+		fprintf(f, fmt, tid, ts);
+		fprintf(f, "\"name\":\"socket\",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"type\":%d,\"id\":%u}},\n", (int)e->a, e->b);
+		break;
+	case TRACE_HARBOR_SEND:
+	case TRACE_HARBOR_RECV:
+		fprintf(f, fmt, tid, ts);
+		fprintf(f, "\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"handle\":\":%08x\",\"size\":%u}},\n",
+			e->type == TRACE_HARBOR_SEND ? "harbor send" : "harbor recv", e->a, e->b);
+		break;
+	}
+}
+
+/*
+	binary format (native endian) :
+	"SKTRACE1"
+	uint32 thread count, then { uint32 tid; char name[16]; } per thread
+	then { uint64 time; uint32 a; uint32 b; uint32 type; uint32 tid; } per event until EOF
+ */
+struct binary_event {
+	uint64_t time;
+	uint32_t a;
+	uint32_t b;
+	uint32_t type;
+	uint32_t tid;
+};
+
+static void
+_binary_event(FILE *f, int tid, struct trace_event *e) {
+	struct binary_event be;
+	be.time = e->time;
+	be.a = e->a;
+	be.b = e->b;
+	be.type = e->type;
+	be.tid = (uint32_t)tid;
+	fwrite(&be, sizeof(be), 1, f);
+}
+
+int
+skynet_trace_flush(const char * filename, int binary) {
+	FILE *f = fopen(filename, binary ? "wb" : "w");
+	if (f == NULL) {
+		return -1;
+	}
+	while (__sync_lock_test_and_set(&FLUSH_LOCK,1)) {}
+	struct trace_buffer * tb;
+	if (binary) {
+		uint32_t n = 0;
+		for (tb = ALL; tb; tb = tb->next) {
+			++n;
+		}
+		fwrite("SKTRACE1", 8, 1, f);
+		fwrite(&n, sizeof(n), 1, f);
+		for (tb = ALL; tb; tb = tb->next) {
+			uint32_t tid = (uint32_t)tb->tid;
+			fwrite(&tid, sizeof(tid), 1, f);
+			fwrite(tb->name, MAX_NAME, 1, f);
+		}
+	} else {
+		fprintf(f, "{\"traceEvents\":[\n");
+		for (tb = ALL; tb; tb = tb->next) {
+			fprintf(f, "{\"pid\":1,\"tid\":%d,\"ph\":\"M\",\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}},\n", tb->tid, tb->name);
+		}
+	}
+	int count = 0;
+	for (tb = ALL; tb; tb = tb->next) {
+		uint32_t n = tb->index;
+		uint32_t i = tb->flushed;
+		if (n - i > TRACE_BUFFER) {
+			i = n - TRACE_BUFFER;
+		}
+		for (;i!=n;i++) {
+			struct trace_event * e = &tb->ev[i & TRACE_MASK];
+			if (binary) {
+				_binary_event(f, tb->tid, e);
+			} else {
+				_json_event(f, tb->tid, e);
+			}
+			++count;
+		}
+		tb->flushed = n;
+	}
+	if (!binary) {
+		// chrome accepts no trailing comma, so end with a metadata event
+		fprintf(f, "{\"pid\":1,\"ph\":\"M\",\"name\":\"process_name\",\"args\":{\"name\":\"skynet\"}}\n]}\n");
+	}
+	__sync_lock_release(&FLUSH_LOCK);
+	fclose(f);
+	return count;
+}
+
+#else
+
+int
+skynet_trace_flush(const char * filename, int binary) {
+	return -1;
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef SKYNET_TRACEPOINT_H
+#define SKYNET_TRACEPOINT_H
+
+#include <stdint.h>
+
+// build with -DTRACEPOINT , or all SKYNET_TRACE* macros are empty
+
+#define TRACE_MQ_PUSH 1	// a : destination handle, b : message trace id
+#define TRACE_DISPATCH_BEGIN 2	// a : handle, b : message trace id
+#define TRACE_DISPATCH_END 3	// a : handle
+#define TRACE_TIMER_BEGIN 4	// a : timer tick
+#define TRACE_TIMER_END 5	// a : timer tick, b : timeout messages
+#define TRACE_SOCKET 6	// a : socket_server_poll result type, b : socket id
+#define TRACE_HARBOR_SEND 7	// a : destination handle, b : size
+#define TRACE_HARBOR_RECV 8	// a : source handle, b : size
+
+#ifdef TRACEPOINT
+
+void skynet_trace(int type, uint32_t a, uint32_t b);
+void skynet_trace_thread(const char * name);
+uint32_t skynet_trace_newid(void);
+
+#define SKYNET_TRACE(type, a, b) skynet_trace(type, a, b);
+#define SKYNET_TRACE_THREAD(name) skynet_trace_thread(name);
+
+#else
+
+#define SKYNET_TRACE(type, a, b)
+#define SKYNET_TRACE_THREAD(name)
+
+#endif
+
+// write events recorded since last flush, return number of events, -1 when failed or not built in
+int skynet_trace_flush(const char * filename, int binary);
+
+#endif
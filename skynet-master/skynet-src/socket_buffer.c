@@ -0,0 +1,260 @@
+#include "socket_buffer.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// size class c is 2^(c+MIN_CLASS) bytes, 64 bytes to 64K
+#define MIN_CLASS 6
+#define MAX_CLASS 16
+#define CLASSES (MAX_CLASS - MIN_CLASS + 1)
+// max bytes cached in each size class
+#define POOL_CACHE (1024 * 1024)
+#define MIN_CACHE 16
+#define SLICE_ALIGN(sz) (((sz) + 15) & ~15)
+
+#define BUFFER_MALLOC 0
+#define BUFFER_POOL 1
+#define BUFFER_SLICE 2
+
+// the data of a block starts at BLOCK_HEADER
+struct read_block {
+	int ref;	// 1 for the pool (while it is the current block) + slices not freed
+	int size;
+};
+
+struct buffer_header {
+	int type;
+	int cls;	// size of data for BUFFER_MALLOC
+	union {
+		struct socket_buffer_pool * pool;	// BUFFER_POOL
+		struct read_block * block;	// BUFFER_SLICE
+	} u;
+	struct buffer_header * next;	// in free list
+	int ref;	// owners of the buffer , see socket_buffer_ref
+};
+
+// headers are padded to 16 bytes , so every buffer (slices too) is 16 bytes aligned as malloc does
+#define BLOCK_HEADER SLICE_ALIGN(sizeof(struct read_block))
+#define BUFFER_HEADER SLICE_ALIGN(sizeof(struct buffer_header))
+#define BLOCK_DATA(b) ((char *)(b) + BLOCK_HEADER)
+#define BUFFER_DATA(h) ((void *)((char *)(h) + BUFFER_HEADER))
+#define HEADER_OF(buffer) ((struct buffer_header *)((char *)(buffer) - BUFFER_HEADER))
+
+struct socket_buffer_pool {
+	int ref;	// 1 for the owner + pooled buffers not freed
+	int slice;
+	struct read_block * block;
+	int offset;
+	// only for owner
+	struct buffer_header * free_list[CLASSES];
+	// lock free stack, pushed by any thread, taken by owner at once
+	struct buffer_header * returned[CLASSES];
+};
+
+// all pools , updated by atomic add
+static struct socket_buffer_stat STAT;
+
+#define CLASS_SIZE(cls) (BUFFER_HEADER + (1 << ((cls) + MIN_CLASS)))
+
+static void *
+_malloc(int sz) {
+	__sync_add_and_fetch(&STAT.bytes, sz);
+	return malloc(sz);
+}
+
+static void
+_free(void * p, int sz) {
+	__sync_sub_and_fetch(&STAT.bytes, sz);
+	free(p);
+}
+
+void
+socket_buffer_stat(struct socket_buffer_stat *stat) {
+	stat->bytes = STAT.bytes;
+	stat->buffers = STAT.buffers;
+}
+
+struct socket_buffer_pool *
+socket_buffer_pool_new(int slice) {
+	struct socket_buffer_pool * pool = _malloc(sizeof(*pool));
+	pool->ref = 1;
+	pool->slice = slice > 0 ? slice : 0;
+	pool->block = NULL;
+	pool->offset = 0;
+	int i;
+	for (i=0;i<CLASSES;i++) {
+		pool->free_list[i] = NULL;
+		pool->returned[i] = NULL;
+	}
+	return pool;
+}
+
+static void
+_free_list(struct buffer_header * h) {
+	while (h) {
+		struct buffer_header * tmp = h;
+		h = h->next;
+		_free(tmp, CLASS_SIZE(tmp->cls));
+	}
+}
+
+static void
+_pool_release(struct socket_buffer_pool *pool) {
+	if (__sync_sub_and_fetch(&pool->ref, 1) != 0) {
+		return;
+	}
+	int i;
+	for (i=0;i<CLASSES;i++) {
+		_free_list(pool->free_list[i]);
+		_free_list(pool->returned[i]);
+	}
+	_free(pool, sizeof(*pool));
+}
+
+static void
+_block_release(struct read_block *b) {
+	if (__sync_sub_and_fetch(&b->ref, 1) == 0) {
+		_free(b, BLOCK_HEADER + b->size);
+	}
+}
+
+void
+socket_buffer_pool_delete(struct socket_buffer_pool *pool) {
+	if (pool->block) {
+		_block_release(pool->block);
+		pool->block = NULL;
+	}
+	_pool_release(pool);
+}
+
+static void *
+_alloc_slice(struct socket_buffer_pool *pool, int sz) {
+	int need = BUFFER_HEADER + SLICE_ALIGN(sz);
+	struct read_block * b = pool->block;
+	if (b == NULL || pool->offset + need > b->size) {
+		if (b) {
+			_block_release(b);
+		}
+		b = _malloc(BLOCK_HEADER + pool->slice);
+		b->ref = 1;
+		b->size = pool->slice;
+		pool->block = b;
+		pool->offset = 0;
+	}
+	struct buffer_header * h = (struct buffer_header *)(BLOCK_DATA(b) + pool->offset);
+	h->type = BUFFER_SLICE;
+	h->ref = 1;
+	h->u.block = b;
+	__sync_add_and_fetch(&b->ref, 1);
+	pool->offset += need;
+	__sync_add_and_fetch(&STAT.buffers, 1);
+	return BUFFER_DATA(h);
+}
+
+// move the buffers freed by other threads to free list, keep at most POOL_CACHE bytes
+static struct buffer_header *
+_take_returned(struct socket_buffer_pool *pool, int cls) {
+	struct buffer_header * h = __sync_lock_test_and_set(&pool->returned[cls], NULL);
+	int cache = POOL_CACHE >> (cls + MIN_CLASS);
+	if (cache < MIN_CACHE) {
+		cache = MIN_CACHE;
+	}
+	struct buffer_header * p = h;
+	int n = 1;
+	while (p && p->next) {
+		if (n >= cache) {
+			_free_list(p->next);
+			p->next = NULL;
+			break;
+		}
+		p = p->next;
+		++n;
+	}
+	return h;
+}
+
+void *
+socket_buffer_alloc(struct socket_buffer_pool *pool, int sz) {
+	if (pool->slice && sz <= pool->slice / 4) {
+		return _alloc_slice(pool, sz);
+	}
+	int cls = 0;
+	while (cls < CLASSES && (1 << (cls + MIN_CLASS)) < sz) {
+		++cls;
+	}
+	struct buffer_header * h;
+	if (cls == CLASSES) {
+		h = _malloc(BUFFER_HEADER + sz);
+		h->type = BUFFER_MALLOC;
+		h->cls = sz;
+		h->ref = 1;
+		__sync_add_and_fetch(&STAT.buffers, 1);
+		return BUFFER_DATA(h);
+	}
+	h = pool->free_list[cls];
+	if (h == NULL) {
+		h = _take_returned(pool, cls);
+	}
+	if (h) {
+		pool->free_list[cls] = h->next;
+	} else {
+		h = _malloc(CLASS_SIZE(cls));
+		h->type = BUFFER_POOL;
+		h->cls = cls;
+		h->u.pool = pool;
+	}
+	h->ref = 1;
+	__sync_add_and_fetch(&pool->ref, 1);
+	__sync_add_and_fetch(&STAT.buffers, 1);
+	return BUFFER_DATA(h);
+}
+
+void
+socket_buffer_shrink(struct socket_buffer_pool *pool, void * buffer, int sz, int n) {
+	struct buffer_header * h = HEADER_OF(buffer);
+	if (h->type != BUFFER_SLICE || h->u.block != pool->block) {
+		return;
+	}
+	char * end = (char *)buffer + SLICE_ALIGN(sz);
+	if (end == BLOCK_DATA(pool->block) + pool->offset) {
+		// the last slice of current block
+		pool->offset -= SLICE_ALIGN(sz) - SLICE_ALIGN(n);
+	}
+}
+
+void
+socket_buffer_ref(void * buffer) {
+	struct buffer_header * h = HEADER_OF(buffer);
+	__sync_add_and_fetch(&h->ref, 1);
+}
+
+void
+socket_buffer_free(void * buffer) {
+	if (buffer == NULL) {
+		return;
+	}
+	struct buffer_header * h = HEADER_OF(buffer);
+	// ref 1 is read without atomic , nobody else owns it then
+	if (h->ref != 1 && __sync_sub_and_fetch(&h->ref, 1) > 0) {
+		return;
+	}
+	__sync_sub_and_fetch(&STAT.buffers, 1);
+	switch (h->type) {
+	case BUFFER_SLICE:
+		_block_release(h->u.block);
+		break;
+	case BUFFER_POOL: {
+		struct socket_buffer_pool * pool = h->u.pool;
+		struct buffer_header * head;
+		do {
+			head = pool->returned[h->cls];
+			h->next = head;
+		} while (!__sync_bool_compare_and_swap(&pool->returned[h->cls], head, h));
+		_pool_release(pool);
+		break;
+	}
+	default:
+		_free(h, BUFFER_HEADER + h->cls);
+		break;
+	}
+}
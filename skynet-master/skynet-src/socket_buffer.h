@@ -0,0 +1,35 @@
+#ifndef skynet_socket_buffer_h
+#define skynet_socket_buffer_h
+
+// read buffers of socket thread.
+// Buffers are pooled in power of 2 size classes, and can be freed by any thread.
+// With slice mode, small reads share a large block and the buffer is a slice of it.
+
+#include <stdint.h>
+
+struct socket_buffer_pool;
+
+// of all pools , read without lock
+struct socket_buffer_stat {
+	int64_t bytes;	// taken from malloc , cached buffers and blocks included
+	int64_t buffers;	// alloced and not freed yet
+};
+
+// slice is the size of the shared block, 0 for off
+struct socket_buffer_pool * socket_buffer_pool_new(int slice);
+// buffers not freed yet keep the pool alive
+void socket_buffer_pool_delete(struct socket_buffer_pool *);
+
+// only the owner thread (socket thread) can alloc and shrink
+void * socket_buffer_alloc(struct socket_buffer_pool *, int sz);
+// after read n bytes into the buffer just alloced, give the unused space back to the slice block
+void socket_buffer_shrink(struct socket_buffer_pool *, void * buffer, int sz, int n);
+
+// any thread. The buffer is freed when all of its owners free it
+void socket_buffer_free(void * buffer);
+// one more owner of the buffer , called by an owner
+void socket_buffer_ref(void * buffer);
+
+void socket_buffer_stat(struct socket_buffer_stat *stat);
+
+#endif
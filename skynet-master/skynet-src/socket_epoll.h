@@ -49,16 +49,39 @@ sp_write(int efd, int sock, void *ud, bool enable) {
 	epoll_ctl(efd, EPOLL_CTL_MOD, sock, &ev);
 }
 
+static void
+sp_edge(int efd, int sock, void *ud, bool write) {
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET | (write ? EPOLLOUT : 0);
+	ev.data.ptr = ud;
+	epoll_ctl(efd, EPOLL_CTL_MOD, sock, &ev);
+}
+
+static void
+sp_again(int efd, int sock, void *ud) {
+}
+
+static bool
+sp_recv(int efd, int sock, void *ud, int size) {
+	return false;
+}
+
+static bool
+sp_accept(int efd, int sock, void *ud) {
+	return false;
+}
+
 static int 
-sp_wait(int efd, struct event *e, int max) {
+sp_wait(int efd, struct event *e, int max, int timeout) {
 	struct epoll_event ev[max];
-	int n = epoll_wait(efd , ev, max, -1);
+	int n = epoll_wait(efd , ev, max, timeout);
 	int i;
 	for (i=0;i<n;i++) {
 		e[i].s = ev[i].data.ptr;
 		unsigned flag = ev[i].events;
 		e[i].write = (flag & EPOLLOUT) != 0;
 		e[i].read = (flag & EPOLLIN) != 0;
+		e[i].done = false;
 	}
 
 	return n;
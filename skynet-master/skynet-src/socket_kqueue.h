@@ -4,6 +4,7 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/event.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -64,10 +65,35 @@ sp_write(int kfd, int sock, void *ud, bool enable) {
 	}
 }
 
+static void
+sp_edge(int kfd, int sock, void *ud, bool write) {
+	struct kevent ke[2];
+	EV_SET(&ke[0], sock, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, ud);
+	EV_SET(&ke[1], sock, EVFILT_WRITE, EV_ADD | EV_CLEAR | (write ? EV_ENABLE : EV_DISABLE), 0, 0, ud);
+	kevent(kfd, ke, 2, NULL, 0, NULL);
+}
+
+static void
+sp_again(int kfd, int sock, void *ud) {
+}
+
+static bool
+sp_recv(int kfd, int sock, void *ud, int size) {
+	return false;
+}
+
+static bool
+sp_accept(int kfd, int sock, void *ud) {
+	return false;
+}
+
 static int 
-sp_wait(int kfd, struct event *e, int max) {
+sp_wait(int kfd, struct event *e, int max, int timeout) {
 	struct kevent ev[max];
-	int n = kevent(kfd, NULL, 0, ev, max, NULL);
+	struct timespec ts;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000;
+	int n = kevent(kfd, NULL, 0, ev, max, timeout < 0 ? NULL : &ts);
 
 	int i;
 	for (i=0;i<n;i++) {
@@ -75,6 +101,7 @@ sp_wait(int kfd, struct event *e, int max) {
 		unsigned filter = ev[i].filter;
 		e[i].write = (filter == EVFILT_WRITE);
 		e[i].read = (filter == EVFILT_READ);
+		e[i].done = false;
 	}
 
 	return n;
@@ -3,12 +3,22 @@
 
 #include <stdbool.h>
 
+#if defined(__linux__) && defined(SOCKET_URING)
+struct uring;
+typedef struct uring * poll_fd;
+#else
 typedef int poll_fd;
+#endif
 
 struct event {
 	void * s;
 	bool read;
 	bool write;
+	// the io is done by the poller , see sp_recv and sp_accept
+	bool done;
+	int res;	// bytes read (0 for eof) , or the fd accepted. -errno when failed
+	void * data;	// the data read , or the address of peer. valid until the next sp_wait
+	int sz;	// size of the address
 };
 
 static bool sp_invalid(poll_fd fd);
@@ -17,10 +27,23 @@ static void sp_release(poll_fd fd);
 static int sp_add(poll_fd fd, int sock, void *ud);
 static void sp_del(poll_fd fd, int sock);
 static void sp_write(poll_fd, int sock, void *ud, bool enable);
-static int sp_wait(poll_fd, struct event *e, int max);
+// switch an added sock to edge triggered , or rearm it (report again if it is still ready)
+static void sp_edge(poll_fd, int sock, void *ud, bool write);
+// the level triggered sock is still ready after it is handled , report it in the next wait.
+// It does nothing for epoll and kqueue , they report it anyway
+static void sp_again(poll_fd, int sock, void *ud);
+// timeout in ms , -1 for infinite. return 0 when timeout
+static int sp_wait(poll_fd, struct event *e, int max, int timeout);
+// let the poller read the added sock itself , at most size bytes a time (size can be changed by calling again).
+// The data comes with the event (done) , instead of the read event. return false when the poller can't (only io_uring can)
+static bool sp_recv(poll_fd, int sock, void *ud, int size);
+// let the poller accept the connections of the added listen sock , like sp_recv
+static bool sp_accept(poll_fd, int sock, void *ud);
 static void sp_nonblocking(int sock);
 
-#ifdef __linux__
+#if defined(__linux__) && defined(SOCKET_URING)
+#include "socket_uring.h"
+#elif defined(__linux__)
 #include "socket_epoll.h"
 #endif
 
@@ -0,0 +1,263 @@
+#include "socket_resolver.h"
+
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_THREAD 2
+#define MAX_THREAD 16
+#define DEFAULT_TTL 60
+#define HASH_SIZE 256
+
+struct query {
+	struct query * next;
+	struct socket_addrlist * list;
+	int port;
+	void * ud;
+};
+
+struct cache_entry {
+	struct cache_entry * next;	// in hash bucket
+	struct cache_entry * job;	// in job queue when resolving
+	time_t expire;
+	bool resolving;
+	struct query * waiting;	// queries of the same host wait for one lookup
+	struct socket_addrlist addr;	// port is 0
+	char host[1];
+};
+
+struct socket_resolver {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	socket_resolver_done done;
+	void * ud;
+	int threads;
+	int ttl;
+	int started;
+	bool quit;
+	pthread_t pid[MAX_THREAD];
+	struct cache_entry * job_head;
+	struct cache_entry * job_tail;
+	struct cache_entry * hash[HASH_SIZE];
+};
+
+struct socket_resolver *
+socket_resolver_new(socket_resolver_done done, void *ud) {
+	struct socket_resolver * r = malloc(sizeof(*r));
+	memset(r, 0, sizeof(*r));
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	r->done = done;
+	r->ud = ud;
+	r->threads = DEFAULT_THREAD;
+	r->ttl = DEFAULT_TTL;
+	return r;
+}
+
+void
+socket_resolver_delete(struct socket_resolver *r) {
+	pthread_mutex_lock(&r->lock);
+	r->quit = true;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	int i;
+	for (i=0;i<r->started;i++) {
+		pthread_join(r->pid[i], NULL);
+	}
+	// queries not resolved yet are dropped, it happens only at exit
+	for (i=0;i<HASH_SIZE;i++) {
+		struct cache_entry * e = r->hash[i];
+		while (e) {
+			struct cache_entry * next = e->next;
+			struct query * q = e->waiting;
+			while (q) {
+				struct query * tmp = q;
+				q = q->next;
+				free(tmp);
+			}
+			free(e);
+			e = next;
+		}
+	}
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	free(r);
+}
+
+void
+socket_resolver_config(struct socket_resolver *r, int threads, int ttl) {
+	if (threads > 0) {
+		r->threads = threads > MAX_THREAD ? MAX_THREAD : threads;
+	}
+	if (ttl >= 0) {
+		r->ttl = ttl;
+	}
+}
+
+static unsigned
+_hash(const char *host) {
+	unsigned h = 5381;
+	while (*host) {
+		h = h * 33 + (unsigned char)*host++;
+	}
+	return h % HASH_SIZE;
+}
+
+static void
+_fill(struct socket_addrlist *list, const struct socket_addrlist *addr, int port) {
+	*list = *addr;
+	int i;
+	for (i=0;i<list->n;i++) {
+		struct sockaddr * sa = (struct sockaddr *)&list->a[i].addr;
+		if (sa->sa_family == AF_INET) {
+			((struct sockaddr_in *)sa)->sin_port = htons(port);
+		} else if (sa->sa_family == AF_INET6) {
+			((struct sockaddr_in6 *)sa)->sin6_port = htons(port);
+		}
+	}
+}
+
+// return 0 when host is not a numeric address , or the lookup failed
+static int
+_getaddr(const char *host, int flags, struct socket_addrlist *list) {
+	struct addrinfo ai_hints;
+	struct addrinfo *ai_list = NULL;
+	struct addrinfo *ai_ptr;
+	memset(&ai_hints, 0, sizeof(ai_hints));
+	ai_hints.ai_family = AF_UNSPEC;
+	ai_hints.ai_socktype = SOCK_STREAM;
+	ai_hints.ai_protocol = IPPROTO_TCP;
+	ai_hints.ai_flags = flags;
+	list->n = 0;
+	if (getaddrinfo(host, NULL, &ai_hints, &ai_list) != 0) {
+		return 0;
+	}
+	for (ai_ptr = ai_list; ai_ptr && list->n < SOCKET_RESOLVE_MAX; ai_ptr = ai_ptr->ai_next) {
+		if (ai_ptr->ai_addrlen > sizeof(list->a[0].addr))
+			continue;
+		list->a[list->n].len = ai_ptr->ai_addrlen;
+		memcpy(&list->a[list->n].addr, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
+		++list->n;
+	}
+	freeaddrinfo(ai_list);
+	return list->n;
+}
+
+// remove the expired entries of the bucket, return the entry of host. lock before calling
+static struct cache_entry *
+_find(struct socket_resolver *r, const char *host, time_t now) {
+	struct cache_entry ** p = &r->hash[_hash(host)];
+	struct cache_entry * result = NULL;
+	while (*p) {
+		struct cache_entry * e = *p;
+		if (!e->resolving && e->expire <= now) {
+			*p = e->next;
+			free(e);
+			continue;
+		}
+		if (strcmp(e->host, host) == 0) {
+			result = e;
+		}
+		p = &e->next;
+	}
+	return result;
+}
+
+static struct cache_entry *
+_insert(struct socket_resolver *r, const char *host) {
+	size_t sz = strlen(host);
+	struct cache_entry * e = malloc(sizeof(*e) + sz);
+	memset(e, 0, sizeof(*e));
+	memcpy(e->host, host, sz+1);
+	unsigned h = _hash(host);
+	e->next = r->hash[h];
+	r->hash[h] = e;
+	return e;
+}
+
+static void *
+_thread(void *p) {
+	struct socket_resolver * r = p;
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		while (r->job_head == NULL && !r->quit) {
+			pthread_cond_wait(&r->cond, &r->lock);
+		}
+		if (r->quit)
+			break;
+		struct cache_entry * e = r->job_head;
+		r->job_head = e->job;
+		if (r->job_head == NULL) {
+			r->job_tail = NULL;
+		}
+		pthread_mutex_unlock(&r->lock);
+
+		// entry is not freed while resolving
+		struct socket_addrlist addr;
+		_getaddr(e->host, 0, &addr);
+
+		pthread_mutex_lock(&r->lock);
+		e->addr = addr;
+		// failures are not cached
+		e->expire = time(NULL) + (addr.n > 0 ? r->ttl : 0);
+		e->resolving = false;
+		struct query * q = e->waiting;
+		e->waiting = NULL;
+		pthread_mutex_unlock(&r->lock);
+
+		while (q) {
+			struct query * tmp = q;
+			q = q->next;
+			_fill(tmp->list, &addr, tmp->port);
+			r->done(r->ud, tmp->ud);
+			free(tmp);
+		}
+		pthread_mutex_lock(&r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+int
+socket_resolver_query(struct socket_resolver *r, const char *host, int port, struct socket_addrlist *list, void *query) {
+	struct socket_addrlist addr;
+	if (_getaddr(host, AI_NUMERICHOST, &addr)) {
+		_fill(list, &addr, port);
+		return 1;
+	}
+	time_t now = time(NULL);
+	pthread_mutex_lock(&r->lock);
+	struct cache_entry * e = _find(r, host, now);
+	if (e && !e->resolving) {
+		_fill(list, &e->addr, port);
+		pthread_mutex_unlock(&r->lock);
+		return 1;
+	}
+	if (e == NULL) {
+		e = _insert(r, host);
+		e->resolving = true;
+		if (r->job_tail) {
+			r->job_tail->job = e;
+		} else {
+			r->job_head = e;
+		}
+		r->job_tail = e;
+		if (r->started < r->threads && pthread_create(&r->pid[r->started], NULL, _thread, r) == 0) {
+			++r->started;
+		}
+		pthread_cond_signal(&r->cond);
+	}
+	struct query * q = malloc(sizeof(*q));
+	q->list = list;
+	q->port = port;
+	q->ud = query;
+	q->next = e->waiting;
+	e->waiting = q;
+	pthread_mutex_unlock(&r->lock);
+	return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef skynet_socket_resolver_h
+#define skynet_socket_resolver_h
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// name resolution for socket_server, out of socket thread.
+// Lookups run in a small thread pool (started at the first lookup), and the results are cached for ttl seconds.
+// Numeric addresses are converted in the caller without any lookup.
+
+#define SOCKET_RESOLVE_MAX 4
+
+struct socket_addrlist {
+	int n;	// 0 when failed
+	struct {
+		socklen_t len;
+		struct sockaddr_storage addr;
+	} a[SOCKET_RESOLVE_MAX];
+};
+
+struct socket_resolver;
+
+// done is called in a resolver thread with (ud, query ud) when an async query finishes
+typedef void (*socket_resolver_done)(void *ud, void *query);
+
+struct socket_resolver * socket_resolver_new(socket_resolver_done done, void *ud);
+void socket_resolver_delete(struct socket_resolver *);
+// call before the first query. threads <= 0 or ttl < 0 keeps the default
+void socket_resolver_config(struct socket_resolver *, int threads, int ttl);
+
+// return 1 when host is numeric or cached, list is filled.
+// return 0 when the lookup is queued, list is filled before done(ud, query) is called ; list must live until then.
+int socket_resolver_query(struct socket_resolver *, const char *host, int port, struct socket_addrlist *list, void *query);
+
+#endif
@@ -1,9 +1,23 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// accept4
+#define _GNU_SOURCE
+#endif
+
 #include "socket_server.h"
 #include "socket_poll.h"
+#include "socket_buffer.h"
+#include "socket_resolver.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <stddef.h>
+#include <limits.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -11,12 +25,28 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#elif defined(__APPLE__)
+#include <sys/uio.h>
+#endif
 
 #define MAX_INFO 128
-// MAX_SOCKET will be 2^MAX_SOCKET_P
-#define MAX_SOCKET_P 16
+// default capacity of socket slots is 2^DEFAULT_SOCKET_P , see socket_server_create
+#define DEFAULT_SOCKET_P 16
+#define MAX_SOCKET_P 24
 #define MAX_EVENT 64
 #define MIN_READ_BUFFER 64
+#define MAX_SHARD 64
+// max connections accepted from one listen event
+#define MAX_ACCEPT 64
+#ifdef IOV_MAX
+#define MAX_IOV IOV_MAX
+#else
+#define MAX_IOV 1024
+#endif
 #define SOCKET_TYPE_INVALID 0
 #define SOCKET_TYPE_RESERVE 1
 #define SOCKET_TYPE_PLISTEN 2
@@ -27,13 +57,26 @@
 #define SOCKET_TYPE_PACCEPT 7
 #define SOCKET_TYPE_BIND 8
 
-#define MAX_SOCKET (1<<MAX_SOCKET_P)
+#define PROTOCOL_TCP 0
+#define PROTOCOL_UDP 1
+#define PROTOCOL_UDPv6 2
+
+// udp address : 1 byte protocol, 2 bytes port (network order), 4 or 16 bytes ip
+#define UDP_ADDRESS_SIZE 19
+#define MAX_UDP_PACKAGE 65535
+// datagrams in one recvmmsg/sendmmsg
+#define MAX_UDP_BATCH 16
+// default max packet of socket_server_framing , the same limit as gate
+#define DEFAULT_MAX_PACKET 0xffffff
 
 struct write_buffer {
 	struct write_buffer * next;
 	char *ptr;
 	int sz;
 	void *buffer;
+	int file;	// file segment of sendfile (ptr is NULL) , -1 for memory
+	off_t offset;	// file segment : offset of the next byte , sz is the bytes left
+	uint8_t udp_address[UDP_ADDRESS_SIZE];	// udp only
 };
 
 struct socket {
@@ -44,30 +87,124 @@ struct socket {
 	uintptr_t opaque;	//在skynet中用于保存服务handle
 	struct write_buffer * head; 	//发送缓冲区链表头指针
 	struct write_buffer * tail;	//发送缓冲区链表尾指针
+	bool edge;	// edge triggered, see socket_server_edge
+	bool nodelay;	// listen : set TCP_NODELAY on the accepted sockets
+	int protocol;	// PROTOCOL_*
+	bool write_wait;	// udp : waiting for writable event
+	bool warning;	// wb_size reached high , SOCKET_WARNING is reported
+	int64_t wb_size;	// bytes queued in head , only for socket thread
+	int high;	// watermarks of wb_size , 0 for off
+	int low;
+	uint8_t udp_address[UDP_ADDRESS_SIZE];	// udp : default peer set by udp_connect, [0] is 0 when not set
+	int sending;	// 'D' and 'F' requests in the ctrl queue, worker can't write directly until they are done
+	int dw_lock;	// direct write lock, see socket_server_send
+	unsigned gen;	// id = gen << bits | slot index , so an id is not reused soon
+	// traffic of this socket, see socket_server_info. read side is written only by socket thread , write side by atomic add
+	uint64_t rbytes;
+	uint64_t wbytes;
+	uint64_t rcall;	// read syscalls
+	uint64_t wcall;	// write syscalls
+	uint64_t rtime;	// unix time of the last read / write
+	uint64_t wtime;
+	struct socket_frame * frame;	// packet framing , see socket_server_framing
+};
+
+// a stream split into packets of big-endian size header , only for socket thread
+struct socket_frame {
+	int header;	// 2 or 4
+	int max;
+	uint8_t head[4];
+	int head_got;
+	int size;	// size of the packet being received , -1 when the header is not complete
+	int got;
+	char * packet;	// only for the packet across reads , it grows as the data comes
+	int cap;
+	// the data read, packets are split from it one by one
+	char * chunk;
+	int chunk_sz;
+	int chunk_off;
+};
+
+struct socket_server;
+struct request_package;
+
+// free slot indices of one shard , a fifo so that a slot is reserved again as late as possible
+struct free_ring {
+	int base;	// in free_slot
+	int size;	// slots of the shard
+	int head;
+	int n;
+};
+
+// socket id space, shared by all shards. socket id belongs to shard[index % shards] , index is id & mask
+struct socket_storage {
+	int ref;
+	int shards;
+	struct socket_resolver * resolver;	// host names of connect are resolved out of socket thread
+	struct socket_server * shard[MAX_SHARD];
+	int bits;	// capacity is 2^bits
+	unsigned mask;
+	// reverve_id takes the rings of shards round robin , so new sockets are spread across the shards
+	int free_lock;
+	int free_next;
+	struct free_ring ring[MAX_SHARD];
+	int * free_slot;
+	struct socket * slot;
 };
 
 struct socket_server {
-	int recvctrl_fd; //管道读端，用于接受控制命令
-	int sendctrl_fd;//管道写端，用于发送控制命令
+	int recvctrl_fd; //eventfd (or pipe read end) , wakeup poll when ctrl_queue is not empty
+	int sendctrl_fd; //the same eventfd (or pipe write end)
+	struct request_package * ctrl_queue;	// lock free stack, pushed by any thread
+	struct request_package * ctrl_pending;	// taken from ctrl_queue in fifo order, only for socket thread
+	bool checkctrl;
 	poll_fd event_fd;	//epoll fd
-	int alloc_id;
+	struct socket_storage * storage;
+	struct socket * slot;	// storage->slot
+	unsigned mask;	// storage->mask , slot of id is slot[id & mask]
+	struct socket_buffer_pool * pool;	// read buffers
+	int edge_budget;	// max bytes read from one edge triggered event, 0 for level triggered
 	int event_n;
 	int event_index;
+	int accept_n;	// connections accepted from current listen event
+	int idle_report;	// SOCKET_IDLE before wait , set by socket_server_idle
+	bool idle;	// SOCKET_IDLE of this round is reported
+	// min heap of connect deadlines , the entry of a socket connected or closed is dropped when it is popped
+	struct connect_timer * timer;
+	int timer_n;
+	int timer_cap;
+	bool checktimer;
+	// datagrams received by one recvmmsg, reported one by one before anything else
+	struct socket * udp_s;
+	int udp_n;
+	int udp_index;
+	struct udp_recv * udp_recv;
+	struct socket * frame_s;	// the socket with packets not reported in its chunk
+	// traffic counters, recv_bytes is written only by socket thread , send_bytes by atomic add
+	uint64_t recv_bytes;
+	uint64_t send_bytes;
 	struct event ev[MAX_EVENT];
-	struct socket slot[MAX_SOCKET];
 	char buffer[MAX_INFO];
 };
 
+struct connect_timer {
+	uint64_t deadline;
+	int id;
+};
+
 struct request_open {
 	int id;
 	int port;
 	uintptr_t opaque;
+	uint64_t deadline;	// ms of monotonic clock , 0 for no timeout
+	struct socket_addrlist addr;	// resolved before the request is sent to socket thread
 	char host[1];
 };
 
 struct request_send {
 	int id;
 	int sz;
+	int offset;	// bytes written directly by the worker
 	char * buffer;
 };
 
@@ -79,6 +216,7 @@ struct request_close {
 struct request_listen {
 	int id;
 	int fd;
+	int flags;	// SOCKET_LISTEN_* applied by socket thread
 	uintptr_t opaque;   //服务 handle
 	char host[1];
 };
@@ -94,69 +232,348 @@ struct request_start {
 	uintptr_t opaque;
 };
 
+struct request_udp {
+	int id;
+	int fd;	// -1 when the bind address is resolving , the socket thread opens it
+	int family;
+	uintptr_t opaque;
+	struct socket_addrlist addr;	// the bind address when fd is -1
+};
+
+struct request_send_udp {
+	struct request_send send;
+	uint8_t address[UDP_ADDRESS_SIZE];
+};
+
+struct request_setudp {
+	int id;
+	struct socket_addrlist addr;	// resolved before the request is sent to socket thread
+};
+
+struct request_watermark {
+	int id;
+	int high;
+	int low;
+};
+
+struct request_sendfile {
+	int id;
+	int fd;
+	off_t offset;
+	int sz;
+};
+
+struct request_setopt {
+	int id;
+	int what;
+	int value;
+};
+
+struct request_framing {
+	int id;
+	int header;
+	int max;
+};
+
+// sent before request_open , so the deadline counts the time of resolving
+struct request_deadline {
+	int id;
+	uintptr_t opaque;
+	uint64_t deadline;
+};
+
+// allocated by the caller, freed by socket thread after ctrl_cmd
 struct request_package {
-	uint8_t header[8];	// 6 bytes dummy
+	struct request_package * next;
+	int type;
 	union {
-		char buffer[256];
 		struct request_open open;
 		struct request_send send;
 		struct request_close close;
 		struct request_listen listen;
 		struct request_bind bind;
 		struct request_start start;
+		struct request_udp udp;
+		struct request_send_udp send_udp;
+		struct request_setudp set_udp;
+		struct request_watermark watermark;
+		struct request_sendfile sendfile;
+		struct request_setopt setopt;
+		struct request_framing framing;
+		struct request_deadline deadline;
 	} u;
-	uint8_t dummy[256];
+	// request_open.host may extend here
 };
 
 union sockaddr_all {
 	struct sockaddr s;
 	struct sockaddr_in v4;
 	struct sockaddr_in6 v6;
+	struct sockaddr_un un;
+};
+
+// staging buffers of recvmmsg, one per shard, allocated at the first udp read
+struct udp_recv {
+	union sockaddr_all addr[MAX_UDP_BATCH];
+	int sz[MAX_UDP_BATCH];
+	char buffer[MAX_UDP_BATCH][MAX_UDP_PACKAGE];
 };
 
 #define MALLOC malloc
 #define FREE free
 
+#define DW_LOCK(s) while (__sync_lock_test_and_set(&(s)->dw_lock,1)) {}
+#define DW_UNLOCK(s) __sync_lock_release(&(s)->dw_lock);
+
+#define FREE_LOCK(S) while (__sync_lock_test_and_set(&(S)->free_lock,1)) {}
+#define FREE_UNLOCK(S) __sync_lock_release(&(S)->free_lock);
+
+static inline struct socket *
+slot_of(struct socket_server *ss, int id) {
+	return &ss->slot[(unsigned)id & ss->mask];
+}
+
+// O(1) , take the slot freed earliest of the next shard
 static int
 reverve_id(struct socket_server *ss) {
+	struct socket_storage * S = ss->storage;
+	int index = -1;
 	int i;
-	for (i=0;i<MAX_SOCKET;i++) {
-		int id = __sync_add_and_fetch(&(ss->alloc_id), 1);
-		if (id < 0) {
-			id = __sync_and_and_fetch(&(ss->alloc_id), 0x7fffffff);//0x7fffffff = 2147483647
+	FREE_LOCK(S)
+	for (i=0;i<S->shards;i++) {
+		int shard = (S->free_next + i) % S->shards;
+		struct free_ring * r = &S->ring[shard];
+		if (r->n > 0) {
+			index = S->free_slot[r->base + r->head];
+			r->head = (r->head + 1) % r->size;
+			--r->n;
+			S->free_next = (shard + 1) % S->shards;
+			break;
 		}
-		struct socket *s = &ss->slot[id % MAX_SOCKET];
-		if (s->type == SOCKET_TYPE_INVALID) {
-			if (__sync_bool_compare_and_swap(&s->type, SOCKET_TYPE_INVALID, SOCKET_TYPE_RESERVE)) {
-				return id;
-			} else {
-				// retry
-				--i;
-			}
+	}
+	FREE_UNLOCK(S)
+	if (index < 0) {
+		return -1;
+	}
+	struct socket * s = &S->slot[index];
+	assert(s->type == SOCKET_TYPE_INVALID);
+	int id = (int)((s->gen++ << S->bits | (unsigned)index) & 0x7fffffff);
+	// a late close of the last id must not take the reservation
+	s->id = id;
+	__sync_synchronize();
+	s->type = SOCKET_TYPE_RESERVE;
+	return id;
+}
+
+static void
+free_push(struct socket_storage *S, int index) {
+	struct free_ring * r = &S->ring[index % S->shards];
+	S->free_slot[r->base + (r->head + r->n) % r->size] = index;
+	++r->n;
+}
+
+// the slot is invalid already, it can be reserved again
+static void
+free_slot(struct socket_server *ss, struct socket *s) {
+	struct socket_storage * S = ss->storage;
+	FREE_LOCK(S)
+	free_push(S, (int)(s - S->slot));
+	FREE_UNLOCK(S)
+}
+
+// split the free slots into the rings of shards , when a shard is added
+static void
+free_split(struct socket_storage *S) {
+	int cap = S->mask + 1;
+	int base = 0;
+	int i;
+	for (i=0;i<S->shards;i++) {
+		struct free_ring * r = &S->ring[i];
+		r->base = base;
+		r->size = (cap - i + S->shards - 1) / S->shards;
+		r->head = 0;
+		r->n = 0;
+		base += r->size;
+	}
+	S->free_next = 0;
+	// slot 0 is the last one , so the first id is 1
+	for (i=1;i<=cap;i++) {
+		int index = i & S->mask;
+		if (S->slot[index].type == SOCKET_TYPE_INVALID) {
+			free_push(S, index);
 		}
 	}
-	return -1;
 }
 
-struct socket_server * 
-socket_server_create() {
+static void
+invalid_slot(struct socket_server *ss, struct socket *s) {
+	s->type = SOCKET_TYPE_INVALID;
+	free_slot(ss, s);
+}
+
+#ifdef __linux__
+
+// one eventfd for both side, writes between two reads coalesce into one wakeup
+static int
+ctrl_create(int fd[2]) {
+	int efd = eventfd(0, EFD_NONBLOCK);
+	if (efd < 0) {
+		return 1;
+	}
+	fd[0] = fd[1] = efd;
+	return 0;
+}
+
+static void
+ctrl_release(int fd[2]) {
+	close(fd[0]);
+}
+
+static void
+ctrl_wakeup(int fd) {
+	uint64_t one = 1;
+	for (;;) {
+		if (write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+			continue;
+		return;
+	}
+}
+
+static void
+ctrl_clear(int fd) {
+	uint64_t n;
+	while (read(fd, &n, sizeof(n)) < 0 && errno == EINTR) {}
+}
+
+#else
+
+static int
+ctrl_create(int fd[2]) {
+	if (pipe(fd)) {
+		return 1;
+	}
+	sp_nonblocking(fd[0]);
+	sp_nonblocking(fd[1]);
+	return 0;
+}
+
+static void
+ctrl_release(int fd[2]) {
+	close(fd[0]);
+	close(fd[1]);
+}
+
+static void
+ctrl_wakeup(int fd) {
+	char one = 1;
+	for (;;) {
+		// EAGAIN means the pipe is full of wakeup already
+		if (write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+			continue;
+		return;
+	}
+}
+
+static void
+ctrl_clear(int fd) {
+	char tmp[64];
+	for (;;) {
+		int n = read(fd, tmp, sizeof(tmp));
+		if (n == sizeof(tmp) || (n < 0 && errno == EINTR))
+			continue;
+		return;
+	}
+}
+
+#endif
+
+static struct socket_server * shard_of(struct socket_server *ss, int id);
+static void send_request(struct socket_server *ss, struct request_package *request, char type);
+
+// resolver thread
+// the type of request is set before the query , see resolve_request
+static void
+request_resolved(void *ud, void *query) {
+	struct socket_storage * S = ud;
+	struct request_package * request = query;
+	int id;
+	switch (request->type) {
+	case 'U':
+		id = request->u.udp.id;
+		break;
+	case 'C':
+		id = request->u.set_udp.id;
+		break;
+	default:
+		id = request->u.open.id;
+		break;
+	}
+	send_request(S->shard[((unsigned)id & S->mask) % S->shards], request, request->type);
+}
+
+static struct socket_storage *
+new_storage(int capacity) {
+	struct socket_storage * S = MALLOC(sizeof(*S));
+	int bits = DEFAULT_SOCKET_P;
+	if (capacity > 0) {
+		bits = 1;
+		while (bits < MAX_SOCKET_P && (1 << bits) < capacity) {
+			++bits;
+		}
+	}
+	int cap = 1 << bits;
+	S->bits = bits;
+	S->mask = cap - 1;
+	S->slot = MALLOC(cap * sizeof(struct socket));
+	S->free_slot = MALLOC(cap * sizeof(int));
 	int i;
+	for (i=0;i<cap;i++) {
+		struct socket *s = &S->slot[i];
+		s->type = SOCKET_TYPE_INVALID;
+		s->head = NULL;
+		s->tail = NULL;
+		s->sending = 0;
+		s->dw_lock = 0;
+		s->gen = 0;
+		s->frame = NULL;
+	}
+	S->slot[0].gen = 1;
+	S->free_lock = 0;
+	S->free_next = 0;
+	S->ref = 0;
+	S->shards = 0;
+	S->resolver = socket_resolver_new(request_resolved, S);
+	return S;
+}
+
+// the shard which polls the socket id
+static inline struct socket_server *
+shard_of(struct socket_server *ss, int id) {
+	struct socket_storage * S = ss->storage;
+	return S->shard[((unsigned)id & S->mask) % S->shards];
+}
+
+struct socket_server * 
+socket_server_create(struct socket_server *shard, int capacity) {
 	int fd[2];
+	if (shard && shard->storage->shards >= MAX_SHARD) {
+		fprintf(stderr, "socket-server: create too many shards.\n");
+		return NULL;
+	}
 	poll_fd efd = sp_create();
 	if (sp_invalid(efd)) {
 		fprintf(stderr, "socket-server: create event pool failed.\n");
 		return NULL;
 	}
-	if (pipe(fd)) {
+	if (ctrl_create(fd)) {
 		sp_release(efd);
-		fprintf(stderr, "socket-server: create socket pair failed.\n");
+		fprintf(stderr, "socket-server: create ctrl fd failed.\n");
 		return NULL;
 	}
 	if (sp_add(efd, fd[0], NULL)) {
 		// add recvctrl_fd to event poll
 		fprintf(stderr, "socket-server: can't add server fd to event pool.\n");
-		close(fd[0]);
-		close(fd[1]);
+		ctrl_release(fd);
 		sp_release(efd);
 		return NULL;
 	}
@@ -165,20 +582,63 @@ socket_server_create() {
 	ss->event_fd = efd;
 	ss->recvctrl_fd = fd[0];
 	ss->sendctrl_fd = fd[1];
-
-	for (i=0;i<MAX_SOCKET;i++) {
-		struct socket *s = &ss->slot[i];
-		s->type = SOCKET_TYPE_INVALID;
-		s->head = NULL;
-		s->tail = NULL;
-	}
-	ss->alloc_id = 0;
+	ss->ctrl_queue = NULL;
+	ss->ctrl_pending = NULL;
+	ss->checkctrl = false;
+
+	ss->storage = shard ? shard->storage : new_storage(capacity);
+	__sync_add_and_fetch(&ss->storage->ref, 1);
+	ss->storage->shard[ss->storage->shards++] = ss;
+	FREE_LOCK(ss->storage)
+	free_split(ss->storage);
+	FREE_UNLOCK(ss->storage)
+	ss->slot = ss->storage->slot;
+	ss->mask = ss->storage->mask;
+	ss->pool = socket_buffer_pool_new(0);
+	ss->edge_budget = 0;
 	ss->event_n = 0;
 	ss->event_index = 0;
+	ss->accept_n = 0;
+	ss->idle_report = 0;
+	ss->idle = false;
+	ss->timer = NULL;
+	ss->timer_n = 0;
+	ss->timer_cap = 0;
+	ss->checktimer = false;
+	ss->udp_s = NULL;
+	ss->frame_s = NULL;
+	ss->udp_n = 0;
+	ss->udp_index = 0;
+	ss->udp_recv = NULL;
 
 	return ss;
 }
 
+static void
+free_write_buffer(struct write_buffer *wb) {
+	if (wb->file >= 0) {
+		close(wb->file);
+	} else {
+		FREE(wb->buffer);
+	}
+	FREE(wb);
+}
+
+static void
+free_frame(struct socket_server *ss, struct socket *s) {
+	struct socket_frame * f = s->frame;
+	if (f == NULL) {
+		return;
+	}
+	socket_buffer_free(f->packet);
+	socket_buffer_free(f->chunk);
+	FREE(f);
+	s->frame = NULL;
+	if (ss->frame_s == s) {
+		ss->frame_s = NULL;
+	}
+}
+
 static void
 force_close(struct socket_server *ss, struct socket *s, struct socket_message *result) {
 	result->id = s->id;
@@ -193,49 +653,109 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_message *r
 	while (wb) {
 		struct write_buffer *tmp = wb;
 		wb = wb->next;
-		FREE(tmp->buffer);
-		FREE(tmp);
+		free_write_buffer(tmp);
 	}
 	s->head = s->tail = NULL;
+	s->wb_size = 0;
+	s->warning = false;
+	free_frame(ss, s);
 	if (s->type != SOCKET_TYPE_PACCEPT && s->type != SOCKET_TYPE_PLISTEN) {
 		sp_del(ss->event_fd, s->fd);
 	}
+	// the worker may be writing directly, wait for it before the fd is closed
+	DW_LOCK(s)
 	if (s->type != SOCKET_TYPE_BIND) {
 		close(s->fd);
 	}
 	s->type = SOCKET_TYPE_INVALID;
+	DW_UNLOCK(s)
+	free_slot(ss, s);
+}
+
+static void
+free_request(struct request_package *req) {
+	while (req) {
+		struct request_package * tmp = req;
+		req = req->next;
+		if (tmp->type == 'D') {
+			FREE(tmp->u.send.buffer);
+		} else if (tmp->type == 'A') {
+			FREE(tmp->u.send_udp.send.buffer);
+		} else if (tmp->type == 'U' && tmp->u.udp.fd >= 0) {
+			close(tmp->u.udp.fd);
+		} else if (tmp->type == 'F') {
+			close(tmp->u.sendfile.fd);
+		}
+		FREE(tmp);
+	}
+}
+
+int
+socket_server_capacity(struct socket_server *ss) {
+	return (int)ss->mask + 1;
 }
 
 void 
 socket_server_release(struct socket_server *ss) {
 	int i;
 	struct socket_message dummy;
-	for (i=0;i<MAX_SOCKET;i++) {
-		struct socket *s = &ss->slot[i];
-		if (s->type != SOCKET_TYPE_RESERVE) {
-			force_close(ss, s , &dummy);
+	// stop resolving at the first release, so no request is sent to a released shard
+	struct socket_resolver * r = __sync_lock_test_and_set(&ss->storage->resolver, NULL);
+	if (r) {
+		socket_resolver_delete(r);
+	}
+	if (__sync_sub_and_fetch(&ss->storage->ref, 1) == 0) {
+		// the last shard closes all sockets
+		for (i=0;i<=(int)ss->mask;i++) {
+			struct socket *s = &ss->slot[i];
+			if (s->type != SOCKET_TYPE_RESERVE) {
+				force_close(ss, s , &dummy);
+			}
 		}
+		FREE(ss->storage->slot);
+		FREE(ss->storage->free_slot);
+		FREE(ss->storage);
 	}
-	close(ss->sendctrl_fd);
-	close(ss->recvctrl_fd);
+	free_request(ss->ctrl_pending);
+	free_request(ss->ctrl_queue);
+	int fd[2] = { ss->recvctrl_fd, ss->sendctrl_fd };
+	ctrl_release(fd);
+	socket_buffer_pool_delete(ss->pool);
+	FREE(ss->udp_recv);
+	FREE(ss->timer);
 	sp_release(ss->event_fd);
 	FREE(ss);
 }
 
 static struct socket *
 new_fd(struct socket_server *ss, int id, int fd, uintptr_t opaque, bool add) {
-	struct socket * s = &ss->slot[id % MAX_SOCKET];
+	struct socket * s = slot_of(ss, id);
 	assert(s->type == SOCKET_TYPE_RESERVE);
 
 	if (add) {
 		if (sp_add(ss->event_fd, fd, s)) {
-			s->type = SOCKET_TYPE_INVALID;
+			// still reserved, the caller frees it
 			return NULL;
 		}
 	}
 
 	s->id = id;
 	s->fd = fd;
+	s->edge = false;
+	s->nodelay = false;
+	s->protocol = PROTOCOL_TCP;
+	s->write_wait = false;
+	s->udp_address[0] = 0;
+	s->warning = false;
+	s->wb_size = 0;
+	s->high = 0;
+	s->low = 0;
+	s->sending = 0;
+	s->rbytes = 0;
+	s->wbytes = 0;
+	s->rcall = 0;
+	s->wcall = 0;
+	s->rtime = s->wtime = time(NULL);
 	s->size = MIN_READ_BUFFER;
 	s->opaque = opaque;
 	assert(s->head == NULL);
@@ -243,41 +763,233 @@ new_fd(struct socket_server *ss, int id, int fd, uintptr_t opaque, bool add) {
 	return s;
 }
 
+static inline void
+stat_read(struct socket *s, int n) {
+	++s->rcall;
+	if (n > 0) {
+		s->rbytes += n;
+		s->rtime = time(NULL);
+	}
+}
+
+// called by socket thread or the worker in direct write
+static inline void
+stat_write(struct socket *s, int n) {
+	__sync_add_and_fetch(&s->wcall, 1);
+	if (n > 0) {
+		__sync_add_and_fetch(&s->wbytes, n);
+		s->wtime = time(NULL);
+	}
+}
+
+// data sockets are edge triggered when ss->edge_budget > 0
+static void
+poll_edge(struct socket_server *ss, struct socket *s) {
+	if (ss->edge_budget > 0) {
+		s->edge = true;
+		sp_edge(ss->event_fd, s->fd, s, false);
+	}
+}
+
+// the poller reads the connected socket itself if it can (io_uring) , see forward_message_recv
+static void
+poll_recv(struct socket_server *ss, struct socket *s) {
+	if (!s->edge && s->protocol == PROTOCOL_TCP) {
+		sp_recv(ss->event_fd, s->fd, s, s->size);
+	}
+}
+
+static void
+poll_write(struct socket_server *ss, struct socket *s, bool enable) {
+	if (s->edge) {
+		sp_edge(ss->event_fd, s->fd, s, enable);
+	} else {
+		sp_write(ss->event_fd, s->fd, s, enable);
+	}
+}
+
 // return -1 when connecting
+// unix domain socket address is "unix:path" or an absolute path, return the path or NULL
+static const char *
+unix_path(const char *host) {
+	if (strncmp(host, "unix:", 5) == 0) {
+		return host + 5;
+	}
+	if (host[0] == '/') {
+		return host;
+	}
+	return NULL;
+}
+
+// return 0 when the path is too long
+static socklen_t
+unix_address(const char *path, struct sockaddr_un *su) {
+	size_t sz = strlen(path);
+	if (sz == 0 || sz >= sizeof(su->sun_path)) {
+		return 0;
+	}
+	memset(su, 0, sizeof(*su));
+	su->sun_family = AF_UNIX;
+	memcpy(su->sun_path, path, sz);
+	return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + sz + 1);
+}
+
+// printable address in ss->buffer , NULL when failed. unix domain socket is "unix:path" ("unix:" when unnamed)
+static char *
+address_name(struct socket_server *ss, const union sockaddr_all *u, socklen_t len) {
+	switch (u->s.sa_family) {
+	case AF_INET:
+		return inet_ntop(AF_INET, &u->v4.sin_addr, ss->buffer, sizeof(ss->buffer)) ? ss->buffer : NULL;
+	case AF_INET6:
+		if (IN6_IS_ADDR_V4MAPPED(&u->v6.sin6_addr)) {
+			// ipv4 peer of dual stack listen socket
+			return inet_ntop(AF_INET, &u->v6.sin6_addr.s6_addr[12], ss->buffer, sizeof(ss->buffer)) ? ss->buffer : NULL;
+		}
+		return inet_ntop(AF_INET6, &u->v6.sin6_addr, ss->buffer, sizeof(ss->buffer)) ? ss->buffer : NULL;
+	case AF_UNIX: {
+		int n = (int)len - (int)offsetof(struct sockaddr_un, sun_path);
+		if (n < 0) {
+			n = 0;
+		}
+		snprintf(ss->buffer, sizeof(ss->buffer), "unix:%.*s", n, u->un.sun_path);
+		return ss->buffer;
+	}
+	default:
+		return NULL;
+	}
+}
+
+static uint64_t
+clock_ms() {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000 + ti.tv_nsec / 1000000;
+}
+
+static void
+timer_push(struct socket_server *ss, uint64_t deadline, int id) {
+	if (ss->timer_n >= ss->timer_cap) {
+		ss->timer_cap = ss->timer_cap ? ss->timer_cap * 2 : 64;
+		ss->timer = realloc(ss->timer, ss->timer_cap * sizeof(struct connect_timer));
+	}
+	int i = ss->timer_n++;
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (ss->timer[parent].deadline <= deadline)
+			break;
+		ss->timer[i] = ss->timer[parent];
+		i = parent;
+	}
+	ss->timer[i].deadline = deadline;
+	ss->timer[i].id = id;
+}
+
+static void
+timer_pop(struct socket_server *ss) {
+	struct connect_timer last = ss->timer[--ss->timer_n];
+	int i = 0;
+	for (;;) {
+		int child = i * 2 + 1;
+		if (child >= ss->timer_n)
+			break;
+		if (child + 1 < ss->timer_n && ss->timer[child+1].deadline < ss->timer[child].deadline)
+			++child;
+		if (last.deadline <= ss->timer[child].deadline)
+			break;
+		ss->timer[i] = ss->timer[child];
+		i = child;
+	}
+	ss->timer[i] = last;
+}
+
+// ms to the first connect deadline , -1 for none
+static int
+timer_wait(struct socket_server *ss) {
+	if (ss->timer_n == 0) {
+		return -1;
+	}
+	uint64_t now = clock_ms();
+	uint64_t deadline = ss->timer[0].deadline;
+	if (deadline <= now) {
+		return 0;
+	}
+	return deadline - now > INT_MAX ? INT_MAX : (int)(deadline - now);
+}
+
+// close one socket connecting after its deadline , return -1 when no more
 static int
-open_socket(struct socket_server *ss, struct request_open * request, struct socket_message *result, bool blocking) {
+connect_timeout(struct socket_server *ss, struct socket_message *result) {
+	uint64_t now = clock_ms();
+	while (ss->timer_n > 0 && ss->timer[0].deadline <= now) {
+		int id = ss->timer[0].id;
+		timer_pop(ss);
+		struct socket * s = slot_of(ss, id);
+		if (s->id != id)
+			continue;
+		if (s->type == SOCKET_TYPE_CONNECTING) {
+			force_close(ss, s, result);
+			result->data = "connect timeout";
+			return SOCKET_ERROR;
+		}
+		if (s->type == SOCKET_TYPE_RESERVE) {
+			// still resolving , open_socket will drop it
+			s->id = -1;
+			result->opaque = s->opaque;
+			result->id = id;
+			result->ud = 0;
+			result->data = "connect timeout";
+			return SOCKET_ERROR;
+		}
+	}
+	return -1;
+}
+
+static void
+set_deadline(struct socket_server *ss, struct request_deadline *request) {
+	struct socket * s = slot_of(ss, request->id);
+	if (s->type == SOCKET_TYPE_RESERVE && s->id == request->id) {
+		// opaque of the slot is not used until new_fd
+		s->opaque = request->opaque;
+		timer_push(ss, request->deadline, request->id);
+	}
+}
+
+static int
+open_socket(struct socket_server *ss, struct request_open * request, struct socket_message *result) {
 	int id = request->id;
 	result->opaque = request->opaque;
 	result->id = id;
 	result->ud = 0;
 	result->data = NULL;
 	struct socket *ns;
-	int status;
-	struct addrinfo ai_hints;
-	struct addrinfo *ai_list = NULL;
-	struct addrinfo *ai_ptr = NULL;
-	char port[16];
-	sprintf(port, "%d", request->port);
-	memset( &ai_hints, 0, sizeof( ai_hints ) );
-	ai_hints.ai_family = AF_UNSPEC;
-	ai_hints.ai_socktype = SOCK_STREAM;
-	ai_hints.ai_protocol = IPPROTO_TCP;
-
-	status = getaddrinfo( request->host, port, &ai_hints, &ai_list );
-	if ( status != 0 ) {
+	int status = -1;
+	if (slot_of(ss, id)->id != id) {
+		// closed while resolving, SOCKET_CLOSE is reported already
+		invalid_slot(ss, slot_of(ss, id));
+		return -1;
+	}
+	if (request->deadline && clock_ms() >= request->deadline) {
+		// resolved too late , don't connect
+		result->data = "connect timeout";
 		goto _failed;
 	}
+	// the address is numeric now, see socket_resolver
+	struct socket_addrlist * list = &request->addr;
+	struct sockaddr * addr = NULL;
 	int sock= -1;
-	for	( ai_ptr = ai_list;	ai_ptr != NULL;	ai_ptr = ai_ptr->ai_next ) {
-		sock = socket( ai_ptr->ai_family, ai_ptr->ai_socktype, ai_ptr->ai_protocol );
+	int err = 0;
+	int i;
+	for (i=0;i<list->n;i++) {
+		addr = (struct sockaddr *)&list->a[i].addr;
+		sock = socket( addr->sa_family, SOCK_STREAM, addr->sa_family == AF_UNIX ? 0 : IPPROTO_TCP );
 		if ( sock < 0 ) {
+			err = errno;
 			continue;
 		}
-		if (!blocking) {
-			sp_nonblocking(sock);
-		}
-		status = connect( sock,	ai_ptr->ai_addr, ai_ptr->ai_addrlen	);
+		sp_nonblocking(sock);
+		status = connect( sock, addr, list->a[i].len );
 		if ( status	!= 0 && errno != EINPROGRESS) {
+			err = errno;
 			close(sock);
 			sock = -1;
 			continue;
@@ -286,74 +998,195 @@ open_socket(struct socket_server *ss, struct request_open * request, struct sock
 	}
 
 	if (sock < 0) {
+		result->data = list->n == 0 ? "unknown host" : strerror(err);
 		goto _failed;
 	}
 
 	ns = new_fd(ss, id, sock, request->opaque, true);
 	if (ns == NULL) {
 		close(sock);
+		result->data = "poll error";
 		goto _failed;
 	}
+	poll_edge(ss, ns);
 
 	if(status == 0) {
 		ns->type = SOCKET_TYPE_CONNECTED;
-		struct sockaddr * addr = ai_ptr->ai_addr;
-		void * sin_addr = (ai_ptr->ai_family == AF_INET) ? (void*)&((struct sockaddr_in *)addr)->sin_addr : (void*)&((struct sockaddr_in6 *)addr)->sin6_addr;
-		if (inet_ntop(ai_ptr->ai_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
-			result->data = ss->buffer;
-		}
-		freeaddrinfo( ai_list );
+		poll_recv(ss, ns);
+		result->data = address_name(ss, (union sockaddr_all *)addr, list->a[i].len);
 		return SOCKET_OPEN;
 	} else {
 		ns->type = SOCKET_TYPE_CONNECTING;
-		sp_write(ss->event_fd, ns->fd, ns, true);
+		poll_write(ss, ns, true);
+		// the deadline is in the timer already , see set_deadline
 	}
 
-	freeaddrinfo( ai_list );
 	return -1;
 _failed:
-	freeaddrinfo( ai_list );
-	ss->slot[id % MAX_SOCKET].type = SOCKET_TYPE_INVALID;
+	invalid_slot(ss, slot_of(ss, id));
 	return SOCKET_ERROR;
 }
 
+static void
+report_watermark(struct socket *s, struct socket_message *result) {
+	result->opaque = s->opaque;
+	result->id = s->id;
+	// K bytes queued
+	int64_t kb = s->wb_size / 1024;
+	result->ud = kb > INT_MAX ? INT_MAX : (int)kb;
+	result->data = NULL;
+}
+
+// the write queue grows, report once when it reaches the high watermark
+static int
+check_high(struct socket *s, struct socket_message *result) {
+	if (s->high > 0 && !s->warning && s->wb_size >= s->high) {
+		s->warning = true;
+		report_watermark(s, result);
+		return SOCKET_WARNING;
+	}
+	return -1;
+}
+
+// the write queue shrinks, report once when it is under the low watermark after a warning
+static int
+check_low(struct socket *s, struct socket_message *result) {
+	if (s->warning && s->wb_size <= s->low) {
+		s->warning = false;
+		report_watermark(s, result);
+		return SOCKET_WRITABLE;
+	}
+	return -1;
+}
+
+// write the file segment to socket without copying to user space , return bytes written or -1
+static ssize_t
+write_file(int sock, struct write_buffer *wb) {
+#if defined(__linux__)
+	return sendfile(sock, wb->file, &wb->offset, wb->sz);
+#elif defined(__APPLE__)
+	off_t len = wb->sz;
+	if (sendfile(wb->file, sock, wb->offset, &len, NULL, 0) < 0 && (errno != EAGAIN || len == 0)) {
+		return -1;
+	}
+	wb->offset += len;
+	return len;
+#else
+	char tmp[16 * 1024];
+	ssize_t n = pread(wb->file, tmp, wb->sz < sizeof(tmp) ? wb->sz : sizeof(tmp), wb->offset);
+	if (n <= 0) {
+		return n;
+	}
+	n = write(sock, tmp, n);
+	if (n > 0) {
+		wb->offset += n;
+	}
+	return n;
+#endif
+}
+
+// return 0 when the file segment is done , -1 when the socket is not writable , SOCKET_CLOSE when error
+static int
+send_file(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+	struct write_buffer * wb = s->head;
+	while (wb->sz > 0) {
+		ssize_t sz = write_file(s->fd, wb);
+		stat_write(s, (int)sz);
+		if (sz < 0) {
+			switch(errno) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+				return -1;
+			}
+			fprintf(stderr, "socket-server: sendfile to %d (fd=%d) error %s.\n", s->id, s->fd, strerror(errno));
+			force_close(ss, s, result);
+			return SOCKET_CLOSE;
+		}
+		if (sz == 0) {
+			// the file is shorter than the segment , the stream is broken
+			fprintf(stderr, "socket-server: sendfile to %d (fd=%d) end of file.\n", s->id, s->fd);
+			force_close(ss, s, result);
+			return SOCKET_CLOSE;
+		}
+		__sync_add_and_fetch(&ss->send_bytes, sz);
+		s->wb_size -= sz;
+		wb->sz -= sz;
+	}
+	s->head = wb->next;
+	free_write_buffer(wb);
+	return 0;
+}
+
+// flush the write buffer chain, MAX_IOV nodes per writev , and the file segments by sendfile in order
 static int
 send_buffer(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+	struct iovec iov[MAX_IOV];
 	while (s->head) {
-		struct write_buffer * tmp = s->head;
+		if (s->head->file >= 0) {
+			int type = send_file(ss, s, result);
+			if (type == -1) {
+				return check_low(s, result);
+			}
+			if (type != 0) {
+				return type;
+			}
+			continue;
+		}
+		int n = 0;
+		ssize_t total = 0;
+		struct write_buffer * tmp;
+		for (tmp = s->head; tmp && tmp->file < 0 && n < MAX_IOV; tmp = tmp->next) {
+			iov[n].iov_base = tmp->ptr;
+			iov[n].iov_len = tmp->sz;
+			total += tmp->sz;
+			++n;
+		}
+		ssize_t sz;
 		for (;;) {
-			int sz = write(s->fd, tmp->ptr, tmp->sz);
+			sz = writev(s->fd, iov, n);
+			stat_write(s, (int)sz);
 			if (sz < 0) {
 				switch(errno) {
 				case EINTR:
 					continue;
 				case EAGAIN:
-					return 0;
+					return -1;
 				}
 				force_close(ss,s, result);
 				return SOCKET_CLOSE;
 			}
-			if (sz != tmp->sz) {
-				tmp->ptr += sz;
-				tmp->sz -= sz;
-				return -1;
-			}
 			break;
 		}
-		s->head = tmp->next;
-		FREE(tmp->buffer);
-		FREE(tmp);
+		__sync_add_and_fetch(&ss->send_bytes, sz);
+		s->wb_size -= sz;
+		// free the nodes written, the last one may be written partly
+		ssize_t left = sz;
+		while (left > 0) {
+			tmp = s->head;
+			if (left < tmp->sz) {
+				tmp->ptr += left;
+				tmp->sz -= left;
+				break;
+			}
+			left -= tmp->sz;
+			s->head = tmp->next;
+			free_write_buffer(tmp);
+		}
+		if (sz != total) {
+			// kernel buffer is full, wait for next writable event
+			return check_low(s, result);
+		}
 	}
 	s->tail = NULL;
-	sp_write(ss->event_fd, s->fd, s, false);
+	poll_write(ss, s, false);
 
-	return -1;
+	return check_low(s, result);
 }
 
 static int
-send_socket(struct socket_server *ss, struct request_send * request, struct socket_message *result) {
+append_send(struct socket_server *ss, struct socket *s, struct request_send * request, struct socket_message *result) {
 	int id = request->id;
-	struct socket * s = &ss->slot[id % MAX_SOCKET];
 	if (s->type == SOCKET_TYPE_INVALID || s->id != id 
 		|| s->type == SOCKET_TYPE_HALFCLOSE
 		|| s->type == SOCKET_TYPE_PACCEPT) {
@@ -362,7 +1195,8 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 	}
 	assert(s->type != SOCKET_TYPE_PLISTEN && s->type != SOCKET_TYPE_LISTEN);
 	if (s->head == NULL) {
-		int n = write(s->fd, request->buffer, request->sz);
+		int n = write(s->fd, request->buffer + request->offset, request->sz - request->offset);
+		stat_write(s, n);
 		if (n<0) {
 			switch(errno) {
 			case EINTR:
@@ -375,6 +1209,8 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 				return SOCKET_CLOSE;
 			}
 		}
+		__sync_add_and_fetch(&ss->send_bytes, n);
+		n += request->offset;
 		if (n == request->sz) {
 			FREE(request->buffer);
 			return -1;
@@ -382,23 +1218,536 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 
 		struct write_buffer * buf = MALLOC(sizeof(*buf));
 		buf->next = NULL;
+		buf->file = -1;
 		buf->ptr = request->buffer+n;
 		buf->sz = request->sz - n;
 		buf->buffer = request->buffer;
 		s->head = s->tail = buf;
+		s->wb_size += buf->sz;
 
-		sp_write(ss->event_fd, s->fd, s, true);
+		poll_write(ss, s, true);
 	} else {
 		struct write_buffer * buf = MALLOC(sizeof(*buf));
-		buf->ptr = request->buffer;
+		buf->file = -1;
+		buf->ptr = request->buffer + request->offset;
 		buf->buffer = request->buffer;
-		buf->sz = request->sz;
+		buf->sz = request->sz - request->offset;
 		assert(s->tail != NULL);
 		assert(s->tail->next == NULL);
 		buf->next = s->tail->next;
 		s->tail->next = buf;
 		s->tail = buf;
+		s->wb_size += buf->sz;
+	}
+	return check_high(s, result);
+}
+
+// udp address <-> sockaddr, return size
+static int
+gen_udp_address(int protocol, const union sockaddr_all *sa, uint8_t * udp_address) {
+	udp_address[0] = (uint8_t)protocol;
+	if (protocol == PROTOCOL_UDP) {
+		memcpy(udp_address+1, &sa->v4.sin_port, sizeof(sa->v4.sin_port));
+		memcpy(udp_address+3, &sa->v4.sin_addr, sizeof(sa->v4.sin_addr));
+		return 1 + 2 + 4;
+	} else {
+		memcpy(udp_address+1, &sa->v6.sin6_port, sizeof(sa->v6.sin6_port));
+		memcpy(udp_address+3, &sa->v6.sin6_addr, sizeof(sa->v6.sin6_addr));
+		return 1 + 2 + 16;
+	}
+}
+
+static socklen_t
+udp_socket_address(const uint8_t * udp_address, union sockaddr_all *sa) {
+	memset(sa, 0, sizeof(*sa));
+	switch (udp_address[0]) {
+	case PROTOCOL_UDP:
+		sa->v4.sin_family = AF_INET;
+		memcpy(&sa->v4.sin_port, udp_address+1, sizeof(sa->v4.sin_port));
+		memcpy(&sa->v4.sin_addr, udp_address+3, sizeof(sa->v4.sin_addr));
+		return sizeof(sa->v4);
+	case PROTOCOL_UDPv6:
+		sa->v6.sin6_family = AF_INET6;
+		memcpy(&sa->v6.sin6_port, udp_address+1, sizeof(sa->v6.sin6_port));
+		memcpy(&sa->v6.sin6_addr, udp_address+3, sizeof(sa->v6.sin6_addr));
+		return sizeof(sa->v6);
+	}
+	return 0;
+}
+
+static int
+udp_address_size(const uint8_t * udp_address) {
+	switch (udp_address[0]) {
+	case PROTOCOL_UDP:
+		return 1 + 2 + 4;
+	case PROTOCOL_UDPv6:
+		return 1 + 2 + 16;
+	}
+	return 0;
+}
+
+static void
+drop_udp(struct socket *s, int n) {
+	while (n-- > 0 && s->head) {
+		struct write_buffer * tmp = s->head;
+		s->head = tmp->next;
+		s->wb_size -= tmp->sz;
+		free_write_buffer(tmp);
+	}
+}
+
+// flush the datagram queue, MAX_UDP_BATCH datagrams per sendmmsg
+static int
+send_udp_buffer(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+	while (s->head) {
+		union sockaddr_all sa[MAX_UDP_BATCH];
+		struct iovec iov[MAX_UDP_BATCH];
+		int n = 0;
+		struct write_buffer * tmp;
+		for (tmp = s->head; tmp && n < MAX_UDP_BATCH; tmp = tmp->next) {
+			iov[n].iov_base = tmp->ptr;
+			iov[n].iov_len = tmp->sz;
+			++n;
+		}
+#ifdef __linux__
+		struct mmsghdr msg[MAX_UDP_BATCH];
+		int i;
+		for (i=0, tmp = s->head; i<n; i++, tmp = tmp->next) {
+			memset(&msg[i], 0, sizeof(msg[i]));
+			msg[i].msg_hdr.msg_name = &sa[i];
+			msg[i].msg_hdr.msg_namelen = udp_socket_address(tmp->udp_address, &sa[i]);
+			msg[i].msg_hdr.msg_iov = &iov[i];
+			msg[i].msg_hdr.msg_iovlen = 1;
+		}
+		int sent = sendmmsg(s->fd, msg, n, 0);
+		int bytes = 0;
+		for (i=0;i<sent;i++) {
+			bytes += msg[i].msg_len;
+		}
+#else
+		socklen_t len = udp_socket_address(s->head->udp_address, &sa[0]);
+		int sent = sendto(s->fd, iov[0].iov_base, iov[0].iov_len, 0, &sa[0].s, len) < 0 ? -1 : 1;
+		int bytes = sent > 0 ? (int)iov[0].iov_len : 0;
+#endif
+		__sync_add_and_fetch(&ss->send_bytes, bytes);
+		stat_write(s, bytes);
+		if (sent < 0) {
+			switch(errno) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+				if (!s->write_wait) {
+					s->write_wait = true;
+					poll_write(ss, s, true);
+				}
+				return check_high(s, result);
+			}
+			// the first datagram can't be sent (too large , peer unreachable , etc.) , drop it and keep the socket
+			fprintf(stderr, "socket-server: udp (id=%d) sendto error %s.\n", s->id, strerror(errno));
+			sent = 1;
+		}
+		drop_udp(s, sent);
+	}
+	s->tail = NULL;
+	if (s->write_wait) {
+		s->write_wait = false;
+		poll_write(ss, s, false);
+	}
+	return check_low(s, result);
+}
+
+// queue a datagram, it is sent at once unless the next command sends to the same socket too
+static int
+append_udp(struct socket_server *ss, struct socket *s, char * buffer, int sz, const uint8_t * udp_address, struct socket_message *result) {
+	if (udp_address[0] != s->protocol) {
+		// no default peer , or the address family is not the socket's
+		FREE(buffer);
+		return -1;
+	}
+	struct write_buffer * buf = MALLOC(sizeof(*buf));
+	buf->next = NULL;
+	buf->file = -1;
+	buf->ptr = buffer;
+	buf->sz = sz;
+	buf->buffer = buffer;
+	memcpy(buf->udp_address, udp_address, udp_address_size(udp_address));
+	if (s->head == NULL) {
+		s->head = s->tail = buf;
+	} else {
+		s->tail->next = buf;
+		s->tail = buf;
+	}
+	s->wb_size += sz;
+	if (s->write_wait) {
+		return check_high(s, result);
+	}
+	struct request_package * next = ss->ctrl_pending;
+	if (next && next->type == 'A' && next->u.send_udp.send.id == s->id) {
+		// batch them into one sendmmsg
+		return -1;
+	}
+	return send_udp_buffer(ss, s, result);
+}
+
+static int
+send_udp_socket(struct socket_server *ss, struct request_send_udp * request, struct socket_message *result) {
+	int id = request->send.id;
+	struct socket * s = slot_of(ss, id);
+	if (s->type != SOCKET_TYPE_CONNECTED || s->id != id || s->protocol == PROTOCOL_TCP) {
+		FREE(request->send.buffer);
+		return -1;
+	}
+	return append_udp(ss, s, request->send.buffer, request->send.sz, request->address, result);
+}
+
+static int
+send_socket(struct socket_server *ss, struct request_send * request, struct socket_message *result) {
+	int id = request->id;
+	struct socket * s = slot_of(ss, id);
+	int type;
+	if (s->id == id && s->type == SOCKET_TYPE_CONNECTED && s->protocol != PROTOCOL_TCP) {
+		// send to the peer of udp_connect
+		type = append_udp(ss, s, request->buffer + request->offset, request->sz - request->offset, s->udp_address, result);
+	} else {
+		type = append_send(ss, s, request, result);
+	}
+	if (s->id == id) {
+		// after the data is written or queued in s->head
+		__sync_sub_and_fetch(&s->sending, 1);
+	}
+	return type;
+}
+
+static int
+sendfile_socket(struct socket_server *ss, struct request_sendfile * request, struct socket_message *result) {
+	int id = request->id;
+	struct socket * s = slot_of(ss, id);
+	if (s->type == SOCKET_TYPE_INVALID || s->id != id
+		|| s->type == SOCKET_TYPE_HALFCLOSE
+		|| s->type == SOCKET_TYPE_PACCEPT
+		|| s->protocol != PROTOCOL_TCP) {
+		close(request->fd);
+		if (s->id == id) {
+			__sync_sub_and_fetch(&s->sending, 1);
+		}
+		return -1;
+	}
+	assert(s->type != SOCKET_TYPE_PLISTEN && s->type != SOCKET_TYPE_LISTEN);
+	struct write_buffer * buf = MALLOC(sizeof(*buf));
+	buf->next = NULL;
+	buf->ptr = NULL;
+	buf->sz = request->sz;
+	buf->buffer = NULL;
+	buf->file = request->fd;
+	buf->offset = request->offset;
+	s->wb_size += buf->sz;
+	if (s->head) {
+		s->tail->next = buf;
+		s->tail = buf;
+		__sync_sub_and_fetch(&s->sending, 1);
+		return check_high(s, result);
+	}
+	s->head = s->tail = buf;
+	__sync_sub_and_fetch(&s->sending, 1);
+	poll_write(ss, s, true);
+	if (s->type == SOCKET_TYPE_CONNECTED) {
+		int type = send_buffer(ss, s, result);
+		if (type != -1) {
+			return type;
+		}
+	}
+	return check_high(s, result);
+}
+
+static void
+set_framing(struct socket_server *ss, struct request_framing * request) {
+	int id = request->id;
+	struct socket * s = slot_of(ss, id);
+	if (s->type == SOCKET_TYPE_INVALID || s->type == SOCKET_TYPE_RESERVE || s->id != id || s->protocol != PROTOCOL_TCP) {
+		return;
+	}
+	// the packet being received is dropped
+	free_frame(ss, s);
+	if (request->header != 2 && request->header != 4) {
+		return;
+	}
+	struct socket_frame * f = MALLOC(sizeof(*f));
+	memset(f, 0, sizeof(*f));
+	f->header = request->header;
+	f->max = request->max > 0 ? request->max : DEFAULT_MAX_PACKET;
+	f->size = -1;
+	s->frame = f;
+}
+
+// report the next complete packet of ss->frame_s , return -1 when the chunk is used up
+static int
+frame_split(struct socket_server *ss, struct socket_message *result) {
+	struct socket * s = ss->frame_s;
+	struct socket_frame * f = s->frame;
+	for (;;) {
+		int left = f->chunk_sz - f->chunk_off;
+		const uint8_t * ptr = (const uint8_t *)f->chunk + f->chunk_off;
+		if (f->size < 0) {
+			int n = f->header - f->head_got;
+			if (n > left) {
+				n = left;
+			}
+			memcpy(f->head + f->head_got, ptr, n);
+			f->head_got += n;
+			f->chunk_off += n;
+			left -= n;
+			ptr += n;
+			if (f->head_got < f->header) {
+				break;
+			}
+			uint32_t size;
+			if (f->header == 2) {
+				size = f->head[0] << 8 | f->head[1];
+			} else {
+				size = (uint32_t)f->head[0] << 24 | f->head[1] << 16 | f->head[2] << 8 | f->head[3];
+			}
+			f->head_got = 0;
+			if (size > (uint32_t)f->max) {
+				force_close(ss, s, result);
+				result->data = "packet too large";
+				return SOCKET_ERROR;
+			}
+			if ((int)size <= left) {
+				// the whole packet is in the chunk , report a slice of it
+				socket_buffer_ref(f->chunk);
+				result->opaque = s->opaque;
+				result->id = s->id;
+				result->ud = (int)size;
+				result->data = f->chunk;
+				result->offset = f->chunk_off;
+				f->chunk_off += size;
+				return SOCKET_DATA;
+			}
+			f->size = (int)size;
+			f->got = 0;
+		}
+		int n = f->size - f->got;
+		if (n > left) {
+			n = left;
+		}
+		if (f->got + n > f->cap) {
+			// don't alloc the size in header at once , the peer may never send it
+			int cap = f->cap * 2;
+			if (cap < f->got + n) {
+				cap = f->got + n;
+			}
+			if (cap > f->size) {
+				cap = f->size;
+			}
+			char * packet = socket_buffer_alloc(ss->pool, cap);
+			if (f->got > 0) {
+				memcpy(packet, f->packet, f->got);
+			}
+			socket_buffer_free(f->packet);
+			f->packet = packet;
+			f->cap = cap;
+		}
+		if (n > 0) {
+			memcpy(f->packet + f->got, ptr, n);
+			f->got += n;
+			f->chunk_off += n;
+		}
+		if (f->got == f->size) {
+			result->opaque = s->opaque;
+			result->id = s->id;
+			result->ud = f->size;
+			result->data = f->packet;
+			result->offset = 0;
+			f->packet = NULL;
+			f->cap = 0;
+			f->size = -1;
+			return SOCKET_DATA;
+		}
+		break;
+	}
+	socket_buffer_free(f->chunk);
+	f->chunk = NULL;
+	ss->frame_s = NULL;
+	return -1;
+}
+
+// the data read from a framing socket , it is split into packets
+static int
+frame_input(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+	struct socket_frame * f = s->frame;
+	f->chunk = result->data;
+	f->chunk_sz = result->ud;
+	f->chunk_off = 0;
+	ss->frame_s = s;
+	return frame_split(ss, result);
+}
+
+static int
+set_option(struct socket_server *ss, struct request_setopt * request) {
+	int id = request->id;
+	struct socket * s = slot_of(ss, id);
+	if (s->type == SOCKET_TYPE_INVALID || s->type == SOCKET_TYPE_RESERVE || s->type == SOCKET_TYPE_BIND || s->id != id) {
+		return -1;
+	}
+	int level = IPPROTO_TCP;
+	int name;
+	switch (request->what) {
+	case SOCKET_OPT_NODELAY:
+		name = TCP_NODELAY;
+		break;
+	case SOCKET_OPT_KEEPALIVE:
+		level = SOL_SOCKET;
+		name = SO_KEEPALIVE;
+		break;
+	case SOCKET_OPT_KEEPIDLE:
+#if defined(TCP_KEEPIDLE)
+		name = TCP_KEEPIDLE;
+#elif defined(TCP_KEEPALIVE)
+		name = TCP_KEEPALIVE;
+#else
+		return -1;
+#endif
+		break;
+	case SOCKET_OPT_SNDBUF:
+		level = SOL_SOCKET;
+		name = SO_SNDBUF;
+		break;
+	case SOCKET_OPT_RCVBUF:
+		level = SOL_SOCKET;
+		name = SO_RCVBUF;
+		break;
+	case SOCKET_OPT_QUICKACK:
+#ifdef TCP_QUICKACK
+		name = TCP_QUICKACK;
+		break;
+#else
+		return -1;
+#endif
+	default:
+		return -1;
+	}
+	if (setsockopt(s->fd, level, name, &request->value, sizeof(request->value)) < 0) {
+		fprintf(stderr, "socket-server: setopt %d of %d (fd=%d) error %s.\n", request->what, id, s->fd, strerror(errno));
+	}
+	return -1;
+}
+
+static int
+set_watermark(struct socket_server *ss, struct request_watermark * request, struct socket_message *result) {
+	int id = request->id;
+	struct socket * s = slot_of(ss, id);
+	if (s->type == SOCKET_TYPE_INVALID || s->id != id) {
+		return -1;
+	}
+	s->high = request->high;
+	s->low = request->low;
+	if (s->warning && s->high == 0) {
+		// turned off
+		s->warning = false;
+		report_watermark(s, result);
+		return SOCKET_WRITABLE;
+	}
+	int type = check_high(s, result);
+	if (type != -1)
+		return type;
+	return check_low(s, result);
+}
+
+// pick the address of family , or the first one when family is 0
+static int
+pick_udp_address(const struct socket_addrlist *list, int family) {
+	int i;
+	int pick = -1;
+	for (i=0;i<list->n;i++) {
+		int f = ((const struct sockaddr *)&list->a[i].addr)->sa_family;
+		if (f != AF_INET && f != AF_INET6)
+			continue;
+		if (pick < 0 || f == family) {
+			pick = i;
+			if (f == family)
+				break;
+		}
+	}
+	return pick;
+}
+
+// return -1 and set errno when failed
+static int
+bind_udp(const struct sockaddr *sa, socklen_t len) {
+	int fd = socket(sa->sa_family, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (bind(fd, sa, len) == -1) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	sp_nonblocking(fd);
+	return fd;
+}
+
+static int
+add_udp_socket(struct socket_server *ss, struct request_udp * request, struct socket_message *result) {
+	int id = request->id;
+	result->opaque = request->opaque;
+	result->id = id;
+	result->ud = 0;
+	result->data = NULL;
+	if (request->fd < 0) {
+		// the bind address is resolved now
+		if (slot_of(ss, id)->id != id) {
+			// closed while resolving
+			invalid_slot(ss, slot_of(ss, id));
+			return -1;
+		}
+		int pick = pick_udp_address(&request->addr, 0);
+		if (pick < 0) {
+			result->data = "unknown host";
+			invalid_slot(ss, slot_of(ss, id));
+			return SOCKET_ERROR;
+		}
+		struct sockaddr * sa = (struct sockaddr *)&request->addr.a[pick].addr;
+		request->fd = bind_udp(sa, request->addr.a[pick].len);
+		if (request->fd < 0) {
+			result->data = strerror(errno);
+			invalid_slot(ss, slot_of(ss, id));
+			return SOCKET_ERROR;
+		}
+		request->family = sa->sa_family;
+	}
+	struct socket * ns = new_fd(ss, id, request->fd, request->opaque, true);
+	if (ns == NULL) {
+		close(request->fd);
+		invalid_slot(ss, slot_of(ss, id));
+		return SOCKET_ERROR;
+	}
+	ns->protocol = request->family == AF_INET6 ? PROTOCOL_UDPv6 : PROTOCOL_UDP;
+	ns->type = SOCKET_TYPE_CONNECTED;
+	return -1;
+}
+
+static int
+set_udp_address(struct socket_server *ss, struct request_setudp * request, struct socket_message *result) {
+	int id = request->id;
+	struct socket * s = slot_of(ss, id);
+	if (s->type != SOCKET_TYPE_CONNECTED || s->id != id || s->protocol == PROTOCOL_TCP) {
+		return -1;
+	}
+	int family = s->protocol == PROTOCOL_UDPv6 ? AF_INET6 : AF_INET;
+	int pick = pick_udp_address(&request->addr, family);
+	if (pick < 0 || ((struct sockaddr *)&request->addr.a[pick].addr)->sa_family != family) {
+		// unknown host or address family mismatch
+		result->opaque = s->opaque;
+		result->id = id;
+		result->ud = 0;
+		result->data = pick < 0 ? "unknown host" : NULL;
+		return SOCKET_ERROR;
 	}
+	union sockaddr_all sa;
+	memcpy(&sa, &request->addr.a[pick].addr, request->addr.a[pick].len);
+	gen_udp_address(s->protocol, &sa, s->udp_address);
 	return -1;
 }
 
@@ -411,6 +1760,7 @@ listen_socket(struct socket_server *ss, struct request_listen * request, struct
 		goto _failed;
 	}
 	s->type = SOCKET_TYPE_PLISTEN;
+	s->nodelay = (request->flags & SOCKET_LISTEN_NODELAY) != 0;
 	return -1;
 _failed:
 	close(listen_fd);
@@ -418,7 +1768,7 @@ _failed:
 	result->id = id;
 	result->ud = 0;
 	result->data = NULL;
-	ss->slot[id % MAX_SOCKET].type = SOCKET_TYPE_INVALID;
+	invalid_slot(ss, slot_of(ss, id));
 
 	return SOCKET_ERROR;
 }
@@ -426,7 +1776,7 @@ _failed:
 static int
 close_socket(struct socket_server *ss, struct request_close *request, struct socket_message *result) {
 	int id = request->id;
-	struct socket * s = &ss->slot[id % MAX_SOCKET];
+	struct socket * s = slot_of(ss, id);
 	if (s->type == SOCKET_TYPE_INVALID || s->id != id) {
 		result->id = id;
 		result->opaque = request->opaque;
@@ -434,9 +1784,27 @@ close_socket(struct socket_server *ss, struct request_close *request, struct soc
 		result->data = NULL;
 		return SOCKET_CLOSE;
 	}
+	if (s->type == SOCKET_TYPE_RESERVE) {
+		// connect is resolving, open_socket will drop it
+		s->id = -1;
+		result->id = id;
+		result->opaque = request->opaque;
+		result->ud = 0;
+		result->data = NULL;
+		return SOCKET_CLOSE;
+	}
+	if (s->protocol != PROTOCOL_TCP) {
+		// try once, the datagrams can't be sent now are dropped
+		send_udp_buffer(ss, s, result);
+		force_close(ss, s, result);
+		result->id = id;
+		result->opaque = request->opaque;
+		return SOCKET_CLOSE;
+	}
 	if (s->head) { 
 		int type = send_buffer(ss,s,result);
-		if (type != -1)
+		// SOCKET_WRITABLE is useless now
+		if (type != -1 && type != SOCKET_WRITABLE)
 			return type;
 	}
 	if (s->head == NULL) {
@@ -458,6 +1826,7 @@ bind_socket(struct socket_server *ss, struct request_bind *request, struct socke
 	result->ud = 0;
 	struct socket *s = new_fd(ss, id, request->fd, request->opaque, true);
 	if (s == NULL) {
+		invalid_slot(ss, slot_of(ss, id));
 		result->data = NULL;
 		return SOCKET_ERROR;
 	}
@@ -474,15 +1843,22 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 	result->opaque = request->opaque;
 	result->ud = 0;
 	result->data = NULL;
-	struct socket *s = &ss->slot[id % MAX_SOCKET];
+	struct socket *s = slot_of(ss, id);
 	if (s->type == SOCKET_TYPE_INVALID || s->id !=id) {
 		return SOCKET_ERROR;
 	}
 	if (s->type == SOCKET_TYPE_PACCEPT || s->type == SOCKET_TYPE_PLISTEN) {
 		if (sp_add(ss->event_fd, s->fd, s)) {
-			s->type = SOCKET_TYPE_INVALID;
+			force_close(ss, s, result);
 			return SOCKET_ERROR;
 		}
+		if (s->type == SOCKET_TYPE_PACCEPT) {
+			// listen socket keeps level triggered, accept one connection per event
+			poll_edge(ss, s);
+			poll_recv(ss, s);
+		} else {
+			sp_accept(ss->event_fd, s->fd, s);
+		}
 		s->type = (s->type == SOCKET_TYPE_PACCEPT) ? SOCKET_TYPE_CONNECTED : SOCKET_TYPE_LISTEN;
 		s->opaque = request->opaque;
 		result->data = "start";
@@ -491,45 +1867,40 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 	return -1;
 }
 
-static void
-block_readpipe(int pipefd, void *buffer, int sz) {
-	for (;;) {
-		int n = read(pipefd, buffer, sz);
-		if (n<0) {
-			if (errno == EINTR)
-				continue;
-			fprintf(stderr, "socket-server : read pipe error %s.",strerror(errno));
-			return;
-		}
-		// must atomic read from a pipe
-		assert(n == sz);
-		return;
+// take all the commands pushed since last time, return false when there is none
+static bool
+has_cmd(struct socket_server *ss) {
+	if (ss->ctrl_pending) {
+		return true;
 	}
+	// clear the wakeup before taking the queue, so a command pushed after it wakes poll again
+	ctrl_clear(ss->recvctrl_fd);
+	struct request_package * req = __sync_lock_test_and_set(&ss->ctrl_queue, NULL);
+	// the queue is a stack, reverse it to keep the order of commands
+	struct request_package * pending = NULL;
+	while (req) {
+		struct request_package * next = req->next;
+		req->next = pending;
+		pending = req;
+		req = next;
+	}
+	ss->ctrl_pending = pending;
+	return pending != NULL;
 }
 
-// return type
 static int
-ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
-	int fd = ss->recvctrl_fd;
-	// the length of message is one byte, so 256+8 buffer size is enough.
-	uint8_t buffer[256];
-	uint8_t header[2];
-	block_readpipe(fd, header, sizeof(header));
-	int type = header[0];
-	int len = header[1];
-	block_readpipe(fd, buffer, len);
-	// ctrl command only exist in local fd, so don't worry about endian.
-	switch (type) {
+dispatch_cmd(struct socket_server *ss, struct request_package *req, struct socket_message *result) {
+	switch (req->type) {
 	case 'S':
-		return start_socket(ss,(struct request_start *)buffer, result);
+		return start_socket(ss, &req->u.start, result);
 	case 'B':
-		return bind_socket(ss,(struct request_bind *)buffer, result);
+		return bind_socket(ss, &req->u.bind, result);
 	case 'L':
-		return listen_socket(ss,(struct request_listen *)buffer, result);
+		return listen_socket(ss, &req->u.listen, result);
 	case 'K':
-		return close_socket(ss,(struct request_close *)buffer, result);
+		return close_socket(ss, &req->u.close, result);
 	case 'O':
-		return open_socket(ss, (struct request_open *)buffer, result, false);
+		return open_socket(ss, &req->u.open, result);
 	case 'X':
 		result->opaque = 0;
 		result->id = 0;
@@ -537,56 +1908,306 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 		result->data = NULL;
 		return SOCKET_EXIT;
 	case 'D':
-		return send_socket(ss, (struct request_send *)buffer, result);
+		return send_socket(ss, &req->u.send, result);
+	case 'U':
+		return add_udp_socket(ss, &req->u.udp, result);
+	case 'A':
+		return send_udp_socket(ss, &req->u.send_udp, result);
+	case 'C':
+		return set_udp_address(ss, &req->u.set_udp, result);
+	case 'W':
+		return set_watermark(ss, &req->u.watermark, result);
+	case 'F':
+		return sendfile_socket(ss, &req->u.sendfile, result);
+	case 'T':
+		return set_option(ss, &req->u.setopt);
+	case 'P':
+		set_framing(ss, &req->u.framing);
+		return -1;
+	case 'Q':
+		set_deadline(ss, &req->u.deadline);
+		return -1;
 	default:
-		fprintf(stderr, "socket-server: Unknown ctrl %c.\n",type);
+		fprintf(stderr, "socket-server: Unknown ctrl %c.\n",req->type);
 		return -1;
 	};
+}
 
-	return -1;
+// return type
+static int
+ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
+	struct request_package * req = ss->ctrl_pending;
+	ss->ctrl_pending = req->next;
+	int type = dispatch_cmd(ss, req, result);
+	FREE(req);
+	return type;
 }
 
 // return -1 (ignore) when error
 static int
 forward_message(struct socket_server *ss, struct socket *s, struct socket_message * result) {
 	int sz = s->size;
-	char * buffer = MALLOC(sz);
+	char * buffer = socket_buffer_alloc(ss->pool, sz);
 	int n = (int)read(s->fd, buffer, sz);
+	stat_read(s, n);
+	if (n<=0) {
+		socket_buffer_shrink(ss->pool, buffer, sz, 0);
+		socket_buffer_free(buffer);
+	}
 	if (n<0) {
-		FREE(buffer);
 		switch(errno) {
 		case EINTR:
+			sp_again(ss->event_fd, s->fd, s);
 			break;
 		case EAGAIN:
-			fprintf(stderr, "socket-server: EAGAIN capture.\n");
+			// reported by sp_again , but drained already
 			break;
-		default:
+		default: {
 			// close when error
+			int err = errno;
 			force_close(ss, s, result);
+			result->data = strerror(err);
 			return SOCKET_ERROR;
 		}
+		}
 		return -1;
 	}
 	if (n==0) {
-		FREE(buffer);
 		force_close(ss, s, result);
 		return SOCKET_CLOSE;
 	}
 
+	ss->recv_bytes += n;
+	// maybe more to read , or the eof came with the data (an edge triggered poll , io_uring multishot , won't report it again)
+	sp_again(ss->event_fd, s->fd, s);
+
+	if (s->type == SOCKET_TYPE_HALFCLOSE) {
+		// discard recv data
+		socket_buffer_shrink(ss->pool, buffer, sz, 0);
+		socket_buffer_free(buffer);
+		return -1;
+	}
+	socket_buffer_shrink(ss->pool, buffer, sz, n);
+
+	if (n == sz) {
+		s->size *= 2;
+	} else if (sz > MIN_READ_BUFFER && n*2 < sz) {
+		s->size /= 2;
+	}
+
+	result->opaque = s->opaque;
+	result->id = s->id;
+	result->ud = n;
+	result->data = buffer;
+	return SOCKET_DATA;
+}
+
+// the data read by the poller (io_uring , see sp_recv) is in the ring buffer , copy it out
+static int
+forward_message_recv(struct socket_server *ss, struct socket *s, struct event *e, struct socket_message * result) {
+	int n = e->res;
+	stat_read(s, n);
+	if (n < 0) {
+		if (n == -EINTR || n == -EAGAIN) {
+			// the poller reads again
+			return -1;
+		}
+		force_close(ss, s, result);
+		result->data = strerror(-n);
+		return SOCKET_ERROR;
+	}
+	if (n == 0) {
+		force_close(ss, s, result);
+		return SOCKET_CLOSE;
+	}
+
+	ss->recv_bytes += n;
+	if (s->type == SOCKET_TYPE_HALFCLOSE) {
+		// discard recv data
+		return -1;
+	}
+	char * buffer = socket_buffer_alloc(ss->pool, n);
+	memcpy(buffer, e->data, n);
+
+	int sz = s->size;
+	if (n >= sz) {
+		s->size *= 2;
+	} else if (sz > MIN_READ_BUFFER && n*2 < sz) {
+		s->size /= 2;
+	}
+	if (s->size != sz) {
+		sp_recv(ss->event_fd, s->fd, s, s->size);
+	}
+
+	result->opaque = s->opaque;
+	result->id = s->id;
+	result->ud = n;
+	result->data = buffer;
+	return SOCKET_DATA;
+}
+
+// report the datagram of the last recvmmsg , the udp address is after the data
+static int
+report_udp(struct socket_server *ss, struct socket_message * result) {
+	struct udp_recv * u = ss->udp_recv;
+	struct socket * s = ss->udp_s;
+	int i = ss->udp_index++;
+	int n = u->sz[i];
+	uint8_t address[UDP_ADDRESS_SIZE];
+	int addrsz = gen_udp_address(s->protocol, &u->addr[i], address);
+	char * data = socket_buffer_alloc(ss->pool, n + addrsz);
+	memcpy(data, u->buffer[i], n);
+	memcpy(data + n, address, addrsz);
+	ss->recv_bytes += n;
+
+	result->opaque = s->opaque;
+	result->id = s->id;
+	result->ud = n;
+	result->data = data;
+	return SOCKET_UDP;
+}
+
+static int
+forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_message * result) {
+	if (ss->udp_recv == NULL) {
+		ss->udp_recv = MALLOC(sizeof(struct udp_recv));
+	}
+	struct udp_recv * u = ss->udp_recv;
+	int n;
+#ifdef __linux__
+	struct mmsghdr msg[MAX_UDP_BATCH];
+	struct iovec iov[MAX_UDP_BATCH];
+	int i;
+	for (i=0;i<MAX_UDP_BATCH;i++) {
+		iov[i].iov_base = u->buffer[i];
+		iov[i].iov_len = MAX_UDP_PACKAGE;
+		memset(&msg[i], 0, sizeof(msg[i]));
+		msg[i].msg_hdr.msg_name = &u->addr[i];
+		msg[i].msg_hdr.msg_namelen = sizeof(u->addr[i]);
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+	n = recvmmsg(s->fd, msg, MAX_UDP_BATCH, 0, NULL);
+	int bytes = 0;
+	for (i=0;i<n;i++) {
+		u->sz[i] = msg[i].msg_len;
+		bytes += u->sz[i];
+	}
+	stat_read(s, bytes);
+#else
+	socklen_t len = sizeof(u->addr[0]);
+	n = recvfrom(s->fd, u->buffer[0], MAX_UDP_PACKAGE, 0, &u->addr[0].s, &len);
+	stat_read(s, n);
+	if (n >= 0) {
+		u->sz[0] = n;
+		n = 1;
+	}
+#endif
+	if (n < 0) {
+		switch(errno) {
+		case EINTR:
+		case EAGAIN:
+			break;
+		default:
+			// udp socket is not closed by the error of the peer (icmp unreachable , etc.)
+			fprintf(stderr, "socket-server: udp (id=%d) recv error %s.\n", s->id, strerror(errno));
+			break;
+		}
+		return -1;
+	}
+	if (n == 0) {
+		return -1;
+	}
+	if (n == MAX_UDP_BATCH) {
+		sp_again(ss->event_fd, s->fd, s);
+	}
+	ss->udp_s = s;
+	ss->udp_n = n;
+	ss->udp_index = 0;
+	return report_udp(ss, result);
+}
+
+// edge triggered : read until EAGAIN or edge_budget, and report all the data in one SOCKET_DATA
+static int
+forward_message_edge(struct socket_server *ss, struct socket *s, struct socket_message * result) {
+	int cap = s->size;
+	int total = 0;
+	bool rearm = false;
+	char * buffer = socket_buffer_alloc(ss->pool, cap);
+	for (;;) {
+		int n = (int)read(s->fd, buffer + total, cap - total);
+		stat_read(s, n);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && total > 0) {
+				// report the data first, the error will be read again after rearm
+				rearm = true;
+			}
+			if (errno != EAGAIN && total == 0) {
+				int err = errno;
+				socket_buffer_shrink(ss->pool, buffer, cap, 0);
+				socket_buffer_free(buffer);
+				force_close(ss, s, result);
+				result->data = strerror(err);
+				return SOCKET_ERROR;
+			}
+			break;
+		}
+		if (n == 0) {
+			if (total == 0) {
+				socket_buffer_shrink(ss->pool, buffer, cap, 0);
+				socket_buffer_free(buffer);
+				force_close(ss, s, result);
+				return SOCKET_CLOSE;
+			}
+			rearm = true;
+			break;
+		}
+		total += n;
+		if (total < cap)
+			continue;
+		if (cap * 2 > ss->edge_budget) {
+			// budget is used up, the rest will be read after rearm
+			rearm = true;
+			break;
+		}
+		char * tmp = socket_buffer_alloc(ss->pool, cap * 2);
+		memcpy(tmp, buffer, total);
+		socket_buffer_free(buffer);
+		buffer = tmp;
+		cap *= 2;
+	}
+	if (rearm) {
+		sp_edge(ss->event_fd, s->fd, s, s->head != NULL);
+	}
+	if (total == 0) {
+		// EAGAIN
+		socket_buffer_shrink(ss->pool, buffer, cap, 0);
+		socket_buffer_free(buffer);
+		return -1;
+	}
+
+	ss->recv_bytes += total;
+
 	if (s->type == SOCKET_TYPE_HALFCLOSE) {
 		// discard recv data
+		socket_buffer_shrink(ss->pool, buffer, cap, 0);
+		socket_buffer_free(buffer);
 		return -1;
 	}
+	socket_buffer_shrink(ss->pool, buffer, cap, total);
 
-	if (n == sz) {
-		s->size *= 2;
-	} else if (sz > MIN_READ_BUFFER && n*2 < sz) {
+	// next drain starts with the size of this one
+	if (total > s->size) {
+		s->size = total < ss->edge_budget ? cap : ss->edge_budget;
+	} else if (s->size > MIN_READ_BUFFER && total*2 < s->size) {
 		s->size /= 2;
 	}
 
 	result->opaque = s->opaque;
 	result->id = s->id;
-	result->ud = n;
+	result->ud = total;
 	result->data = buffer;
 	return SOCKET_DATA;
 }
@@ -597,106 +2218,217 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_message
 	socklen_t len = sizeof(error);  
 	int code = getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &error, &len);  
 	if (code < 0 || error) {  
+		if (code < 0) {
+			error = errno;
+		}
 		force_close(ss,s, result);
+		result->data = strerror(error);
 		return SOCKET_ERROR;
 	} else {
 		s->type = SOCKET_TYPE_CONNECTED;
 		result->opaque = s->opaque;
 		result->id = s->id;
 		result->ud = 0;
-		sp_write(ss->event_fd, s->fd, s, false);
+		poll_write(ss, s, false);
+		poll_recv(ss, s);
 		union sockaddr_all u;
 		socklen_t slen = sizeof(u);
+		result->data = NULL;
 		if (getpeername(s->fd, &u.s, &slen) == 0) {
-			void * sin_addr = (u.s.sa_family == AF_INET) ? (void*)&u.v4.sin_addr : (void *)&u.v6.sin6_addr;
-			if (inet_ntop(u.s.sa_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
-				result->data = ss->buffer;
-				return SOCKET_OPEN;
-			}
+			result->data = address_name(ss, &u, slen);
 		}
-		result->data = NULL;
 		return SOCKET_OPEN;
 	}
 }
 
-// return 0 when failed
+// the client_fd accepted from listen socket s , return 0 when failed
 static int
-report_accept(struct socket_server *ss, struct socket *s, struct socket_message *result) {
-	union sockaddr_all u;
-	socklen_t len = sizeof(u);
-	int client_fd = accept(s->fd, &u.s, &len);
-	if (client_fd < 0) {
-		return 0;
-	}
+accept_socket(struct socket_server *ss, struct socket *s, int client_fd, union sockaddr_all *u, socklen_t len, struct socket_message *result) {
 	int id = reverve_id(ss);
 	if (id < 0) {
 		close(client_fd);
+		sp_again(ss->event_fd, s->fd, s);
 		return 0;
 	}
+#ifndef __linux__
 	sp_nonblocking(client_fd);
+#endif
 	struct socket *ns = new_fd(ss, id, client_fd, s->opaque, false);
 	if (ns == NULL) {
 		close(client_fd);
+		sp_again(ss->event_fd, s->fd, s);
 		return 0;
 	}
+	if (s->nodelay) {
+		int one = 1;
+		setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
 	ns->type = SOCKET_TYPE_PACCEPT;
 	result->opaque = s->opaque;
 	result->id = s->id;
 	result->ud = id;
-	result->data = NULL;
-
-	void * sin_addr = (u.s.sa_family == AF_INET) ? (void*)&u.v4.sin_addr : (void *)&u.v6.sin6_addr;
-	if (inet_ntop(u.s.sa_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
-		result->data = ss->buffer;
-	}
+	result->data = address_name(ss, u, len);
 
 	return 1;
 }
 
+// return 0 when failed
+static int
+report_accept(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+	union sockaddr_all u;
+	socklen_t len = sizeof(u);
+#ifdef __linux__
+	int client_fd = accept4(s->fd, &u.s, &len, SOCK_NONBLOCK);
+#else
+	int client_fd = accept(s->fd, &u.s, &len);
+#endif
+	if (client_fd < 0) {
+		return 0;
+	}
+	return accept_socket(ss, s, client_fd, &u, len, result);
+}
+
 // return type
 int 
 socket_server_poll(struct socket_server *ss, struct socket_message * result, int * more) {
+	result->offset = 0;
 	for (;;) {
+		if (ss->udp_index < ss->udp_n) {
+			// the rest of last recvmmsg
+			return report_udp(ss, result);
+		}
+		if (ss->frame_s) {
+			// the rest packets of last read
+			int type = frame_split(ss, result);
+			if (type != -1)
+				return type;
+		}
+		if (ss->checkctrl) {
+			// drain all pending commands before the next wait
+			if (has_cmd(ss)) {
+				int type = ctrl_cmd(ss, result);
+				if (type != -1)
+					return type;
+				else
+					continue;
+			} else {
+				ss->checkctrl = false;
+			}
+		}
+		if (ss->checktimer) {
+			int type = connect_timeout(ss, result);
+			if (type != -1)
+				return type;
+			ss->checktimer = false;
+		}
 		if (ss->event_index == ss->event_n) {
-			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT);
+			if (ss->idle_report && !ss->idle) {
+				ss->idle = true;
+				result->id = 0;
+				result->opaque = 0;
+				result->ud = 0;
+				result->data = NULL;
+				return SOCKET_IDLE;
+			}
+			ss->idle = false;
+			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT, timer_wait(ss));
 			if (more) {
 				*more = 0;
 			}
 			ss->event_index = 0;
+			ss->accept_n = 0;
+			ss->checktimer = ss->timer_n > 0;
 			if (ss->event_n <= 0) {
 				ss->event_n = 0;
+				if (ss->checktimer)
+					continue;
 				return -1;
 			}
 		}
 		struct event *e = &ss->ev[ss->event_index++];
 		struct socket *s = e->s;
 		if (s == NULL) {
-			int type = ctrl_cmd(ss, result);
-			if (type != -1)
-				return type;
-			else
-				continue;
+			ss->checkctrl = true;
+			continue;
 		}
 		switch (s->type) {
 		case SOCKET_TYPE_CONNECTING:// connecting
 			return report_connect(ss, s, result);
 		case SOCKET_TYPE_LISTEN:
+			if (e->done) {
+				// accepted by the poller , the next accept is submitted with the next wait
+				if (e->res >= 0 && accept_socket(ss, s, e->res, e->data, e->sz, result))
+					return SOCKET_ACCEPT;
+				break;
+			}
 			if (report_accept(ss, s, result)) {
+				if (++ss->accept_n < MAX_ACCEPT) {
+					// accept again with the same event until EAGAIN, the backlog is drained without another wait
+					--ss->event_index;
+				} else {
+					ss->accept_n = 0;
+					sp_again(ss->event_fd, s->fd, s);
+				}
 				return SOCKET_ACCEPT;
-			} 
+			}
+			ss->accept_n = 0;
 			break;
 		case SOCKET_TYPE_INVALID:
 			fprintf(stderr, "socket-server: invalid socket\n");
 			break;
 		default:
-			if (e->write) {// 可写事件 从应用层读取数据
-				int type = send_buffer(ss, s, result);
+			if (s->protocol != PROTOCOL_TCP) {
+				if (e->write) {
+					int type = send_udp_buffer(ss, s, result);
+					if (type != -1) {
+						if (e->read) {
+							sp_again(ss->event_fd, s->fd, s);
+						}
+						return type;
+					}
+				}
+				if (e->read) {
+					int type = forward_message_udp(ss, s, result);
+					if (type == -1)
+						break;
+					return type;
+				}
+				break;
+			}
+			if (e->done) {
+				// read by the poller , the write event (if any) is handled in the next call
+				e->done = false;
+				int type = forward_message_recv(ss, s, e, result);
+				if (e->write && s->type != SOCKET_TYPE_INVALID) {
+					--ss->event_index;
+				}
+				if (type == SOCKET_DATA && s->frame) {
+					type = frame_input(ss, s, result);
+				}
 				if (type == -1)
 					break;
 				return type;
 			}
+			if (e->write) {// 可写事件 从应用层读取数据
+				int type = send_buffer(ss, s, result);
+				if (type != -1) {
+					if (type == SOCKET_WRITABLE && e->read) {
+						// rearm, or the edge triggered read event is lost
+						if (s->edge) {
+							sp_edge(ss->event_fd, s->fd, s, s->head != NULL);
+						} else {
+							sp_again(ss->event_fd, s->fd, s);
+						}
+					}
+					return type;
+				}
+				// edge triggered read event would be lost if it is not handled now
+			}
 			if (e->read) {// 可读事件 读取消息
-				int type = forward_message(ss, s, result);
+				int type = s->edge ? forward_message_edge(ss, s, result) : forward_message(ss, s, result);
+				if (type == SOCKET_DATA && s->frame) {
+					type = frame_input(ss, s, result);
+				}
 				if (type == -1)
 					break;
 				return type;
@@ -706,159 +2438,578 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 	}
 }
 
+// push request into the ctrl queue of ss, it can be called from any thread
 static void
-send_request(struct socket_server *ss, struct request_package *request, char type, int len) {
-	request->header[6] = (uint8_t)type;
-	request->header[7] = (uint8_t)len;
-	for (;;) {
-		int n = (int)write(ss->sendctrl_fd, &request->header[6], len+2);
-		if (n<0) {
-			if (errno != EINTR) {
-				fprintf(stderr, "socket-server : send ctrl command error %s.\n", strerror(errno));
-			}
-			continue;
-		}
-		assert(n == len+2);
-		return;
+send_request(struct socket_server *ss, struct request_package *request, char type) {
+	request->type = type;
+	struct request_package * head;
+	do {
+		head = ss->ctrl_queue;
+		request->next = head;
+	} while (!__sync_bool_compare_and_swap(&ss->ctrl_queue, head, request));
+	if (head == NULL) {
+		// the queue was empty, or socket thread has taken it ; otherwise a wakeup is pending already
+		ctrl_wakeup(ss->sendctrl_fd);
 	}
 }
 
-static int
-open_request(struct socket_server *ss, struct request_package *req, uintptr_t opaque, const char *addr, int port) {
+static struct request_package *
+new_request(int extra) {
+	return MALLOC(sizeof(struct request_package) + extra);
+}
+
+static struct request_package *
+open_request(struct socket_server *ss, uintptr_t opaque, const char *addr, int port) {
 	int len = (int)strlen(addr);
-	if (len + sizeof(req->u.open) > 256) {
-		fprintf(stderr, "socket-server : Invalid addr %s.\n",addr);
-		return 0;
-	}
+	struct request_package * req = new_request(len);
 	int id = reverve_id(ss);
 	req->u.open.opaque = opaque;
 	req->u.open.id = id;
 	req->u.open.port = port;
+	req->u.open.deadline = 0;
+	req->u.open.addr.n = 0;
 	memcpy(req->u.open.host, addr, len);
 	req->u.open.host[len] = '\0';
-
-	return len;
+	const char * path = unix_path(addr);
+	if (path) {
+		// nothing to resolve
+		socklen_t sz = unix_address(path, (struct sockaddr_un *)&req->u.open.addr.a[0].addr);
+		if (sz > 0) {
+			req->u.open.addr.a[0].len = sz;
+			req->u.open.addr.n = 1;
+		}
+	}
+	return req;
 }
 
 int 
 socket_server_connect(struct socket_server *ss, uintptr_t opaque, const char * addr, int port) {
-	struct request_package request;
-	int len = open_request(ss, &request, opaque, addr, port);
-	send_request(ss, &request, 'O', sizeof(request.u.open) + len);
-	return request.u.open.id;
+	return socket_server_connect_timeout(ss, opaque, addr, port, 0);
 }
 
-int 
-socket_server_block_connect(struct socket_server *ss, uintptr_t opaque, const char * addr, int port) {
-	struct request_package request;
-	struct socket_message result;
-	open_request(ss, &request, opaque, addr, port);
-	int ret = open_socket(ss, &request.u.open, &result, true);
-	if (ret == SOCKET_OPEN) {
-		return result.id;
-	} else {
+int
+socket_server_connect_timeout(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int timeout) {
+	struct request_package * request = open_request(ss, opaque, addr, port);
+	int id = request->u.open.id;
+	if (id < 0) {
+		FREE(request);
 		return -1;
 	}
+	if (timeout > 0) {
+		// the time of resolving counts , the timer starts before the query
+		uint64_t deadline = clock_ms() + timeout;
+		request->u.open.deadline = deadline;
+		struct request_package * dreq = new_request(0);
+		dreq->u.deadline.id = id;
+		dreq->u.deadline.opaque = opaque;
+		dreq->u.deadline.deadline = deadline;
+		send_request(shard_of(ss, id), dreq, 'Q');
+	}
+	struct socket_resolver * r = ss->storage->resolver;
+	request->type = 'O';
+	if (r == NULL || unix_path(addr) || socket_resolver_query(r, request->u.open.host, port, &request->u.open.addr, request)) {
+		// unix path, numeric or cached, otherwise sent by request_resolved later
+		send_request(shard_of(ss, id), request, 'O');
+	}
+	return id;
 }
 
 // return -1 when error
 int 
 socket_server_send(struct socket_server *ss, int id, const void * buffer, int sz) {
-	struct socket * s = &ss->slot[id % MAX_SOCKET];
-	if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
+	struct socket * s = slot_of(ss, id);
+	if (s->id != id || s->type == SOCKET_TYPE_INVALID || s->type == SOCKET_TYPE_RESERVE) {
+		// not connected yet
 		return -1;
 	}
-	assert(s->type != SOCKET_TYPE_RESERVE);
+	ss = shard_of(ss, id);
+
+	int offset = 0;
+	// the lock keeps the direct write and the order of queued requests, socket thread takes it only to close
+	DW_LOCK(s)
+	if (s->id == id && s->type == SOCKET_TYPE_CONNECTED && s->protocol == PROTOCOL_TCP && s->sending == 0 && s->head == NULL) {
+		// nothing is queued, try to write directly in the worker thread
+		int n = write(s->fd, buffer, sz);
+		stat_write(s, n);
+		if (n == sz) {
+			DW_UNLOCK(s)
+			__sync_add_and_fetch(&ss->send_bytes, n);
+			FREE((void *)buffer);
+			return 0;
+		}
+		if (n > 0) {
+			__sync_add_and_fetch(&ss->send_bytes, n);
+			offset = n;
+		}
+		// queue the rest, or let socket thread report the error
+	}
 
-	struct request_package request;
-	request.u.send.id = id;
-	request.u.send.sz = sz;
-	request.u.send.buffer = (char *)buffer;
+	struct request_package * request = new_request(0);
+	request->u.send.id = id;
+	request->u.send.sz = sz;
+	request->u.send.offset = offset;
+	request->u.send.buffer = (char *)buffer;
+	__sync_add_and_fetch(&s->sending, 1);
+	send_request(ss, request, 'D');
+	DW_UNLOCK(s)
+	return 0;
+}
 
-	send_request(ss, &request, 'D', sizeof(request.u.send));
+// return -1 when error
+int
+socket_server_sendfile(struct socket_server *ss, int id, int fd, int64_t offset, int sz) {
+	struct socket * s = slot_of(ss, id);
+	if (s->id != id || s->type == SOCKET_TYPE_INVALID || s->type == SOCKET_TYPE_RESERVE || sz < 0 || offset < 0) {
+		return -1;
+	}
+	struct request_package * request = new_request(0);
+	request->u.sendfile.id = id;
+	request->u.sendfile.fd = fd;
+	request->u.sendfile.offset = (off_t)offset;
+	request->u.sendfile.sz = sz;
+	// keep the order with socket_server_send , the worker doesn't write directly until it is queued
+	DW_LOCK(s)
+	__sync_add_and_fetch(&s->sending, 1);
+	send_request(shard_of(ss, id), request, 'F');
+	DW_UNLOCK(s)
 	return 0;
 }
 
+// exit the poll of this shard only
 void
 socket_server_exit(struct socket_server *ss) {
-	struct request_package request;
-	send_request(ss, &request, 'X', 0);
+	send_request(ss, new_request(0), 'X');
 }
 
 void
 socket_server_close(struct socket_server *ss, uintptr_t opaque, int id) {
-	struct request_package request;
-	request.u.close.id = id;
-	request.u.close.opaque = opaque;
-	send_request(ss, &request, 'K', sizeof(request.u.close));
+	struct request_package * request = new_request(0);
+	request->u.close.id = id;
+	request->u.close.opaque = opaque;
+	send_request(shard_of(ss, id), request, 'K');
 }
 
+// return 1 when nobody listens on the socket file , probe it with a non-blocking connect
 static int
-do_listen(const char * host, int port, int backlog) {
-	// only support ipv4
-	// todo: support ipv6 by getaddrinfo
-	uint32_t addr = INADDR_ANY;
-	if (host[0]) {
-		addr=inet_addr(host);
+unix_stale(struct sockaddr_un *su, socklen_t len) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return 0;
 	}
-	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (listen_fd < 0) {
+	sp_nonblocking(fd);
+	int stale = connect(fd, (struct sockaddr *)su, len) == -1 && errno == ECONNREFUSED;
+	close(fd);
+	return stale;
+}
+
+static int
+do_listen_unix(const char * path, int backlog) {
+	struct sockaddr_un su;
+	socklen_t len = unix_address(path, &su);
+	if (len == 0) {
 		return -1;
 	}
-	int reuse = 1;
-	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(int))==-1) {
-		goto _failed;
+	struct stat st;
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		if (!unix_stale(&su, len)) {
+			// a live listener owns the path , don't take it over
+			errno = EADDRINUSE;
+			return -1;
+		}
+		// left by the last process
+		unlink(path);
 	}
-
-	struct sockaddr_in my_addr;
-	memset(&my_addr, 0, sizeof(struct sockaddr_in));
-	my_addr.sin_family = AF_INET;
-	my_addr.sin_port = htons(port);
-	my_addr.sin_addr.s_addr = addr;
-	if (bind(listen_fd, (struct sockaddr *)&my_addr, sizeof(struct sockaddr)) == -1) {
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		return -1;
+	}
+	if (bind(listen_fd, (struct sockaddr *)&su, len) == -1) {
 		goto _failed;
 	}
 	if (listen(listen_fd, backlog) == -1) {
 		goto _failed;
 	}
+	sp_nonblocking(listen_fd);
 	return listen_fd;
 _failed:
 	close(listen_fd);
 	return -1;
 }
 
+static int
+listen_option(int fd, int family, const struct socket_listen_opt *opt) {
+	int reuse = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(int))==-1) {
+		return -1;
+	}
+	if (opt->flags & SOCKET_LISTEN_REUSEPORT) {
+#ifdef SO_REUSEPORT
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(int))==-1) {
+			return -1;
+		}
+#else
+		return -1;
+#endif
+	}
+	if (family == AF_INET6) {
+		int v6only = (opt->flags & SOCKET_LISTEN_IPV6ONLY) ? 1 : 0;
+		if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&v6only, sizeof(int))==-1) {
+			return -1;
+		}
+	}
+	// buffer sizes are inherited by the accepted sockets, and the window scale is decided before listen
+	if (opt->rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void *)&opt->rcvbuf, sizeof(int))==-1) {
+		return -1;
+	}
+	if (opt->sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void *)&opt->sndbuf, sizeof(int))==-1) {
+		return -1;
+	}
+	return 0;
+}
+
+static int
+do_listen(const char * host, int port, int backlog, const struct socket_listen_opt *opt) {
+	const char * path = unix_path(host);
+	if (path) {
+		return do_listen_unix(path, backlog);
+	}
+	// "" is any address , dual stack "::" , or "0.0.0.0" when ipv6 is not available
+	const char * any[] = { "::", "0.0.0.0", NULL };
+	const char * single[] = { host, NULL };
+	const char ** hosts = host[0] ? single : any;
+	char portstr[16];
+	snprintf(portstr, sizeof(portstr), "%d", port);
+	struct addrinfo ai_hints;
+	memset(&ai_hints, 0, sizeof(ai_hints));
+	ai_hints.ai_family = AF_UNSPEC;
+	ai_hints.ai_socktype = SOCK_STREAM;
+	ai_hints.ai_protocol = IPPROTO_TCP;
+	ai_hints.ai_flags = AI_PASSIVE;
+	int i;
+	for (i=0;hosts[i];i++) {
+		struct addrinfo *ai_list = NULL;
+		struct addrinfo *ai_ptr;
+		if (getaddrinfo(hosts[i], portstr, &ai_hints, &ai_list) != 0) {
+			continue;
+		}
+		for (ai_ptr = ai_list; ai_ptr; ai_ptr = ai_ptr->ai_next) {
+			int listen_fd = socket(ai_ptr->ai_family, ai_ptr->ai_socktype, ai_ptr->ai_protocol);
+			if (listen_fd < 0) {
+				continue;
+			}
+			if (listen_option(listen_fd, ai_ptr->ai_family, opt)
+				|| bind(listen_fd, ai_ptr->ai_addr, ai_ptr->ai_addrlen) == -1
+				|| listen(listen_fd, backlog) == -1) {
+				close(listen_fd);
+				continue;
+			}
+#ifdef TCP_DEFER_ACCEPT
+			if (opt->defer_accept > 0) {
+				setsockopt(listen_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, (void *)&opt->defer_accept, sizeof(int));
+			}
+#endif
+			freeaddrinfo(ai_list);
+			// accept in a loop until EAGAIN
+			sp_nonblocking(listen_fd);
+			return listen_fd;
+		}
+		freeaddrinfo(ai_list);
+	}
+	return -1;
+}
+
 int 
 socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog) {
-	int fd = do_listen(addr, port, backlog);
+	return socket_server_listen_opt(ss, opaque, addr, port, backlog, NULL);
+}
+
+int
+socket_server_listen_opt(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog, const struct socket_listen_opt *opt) {
+	struct socket_listen_opt def;
+	if (opt == NULL) {
+		memset(&def, 0, sizeof(def));
+		opt = &def;
+	}
+	int fd = do_listen(addr, port, backlog, opt);
 	if (fd < 0) {
 		return -1;
 	}
-	struct request_package request;
 	int id = reverve_id(ss);
-	request.u.listen.opaque = opaque;
-	request.u.listen.id = id;
-	request.u.listen.fd = fd;
-	send_request(ss, &request, 'L', sizeof(request.u.listen));
+	if (id < 0) {
+		close(fd);
+		return -1;
+	}
+	struct request_package * request = new_request(0);
+	request->u.listen.opaque = opaque;
+	request->u.listen.id = id;
+	request->u.listen.fd = fd;
+	request->u.listen.flags = opt->flags;
+	send_request(shard_of(ss, id), request, 'L');
 	return id;
 }
 
 int
 socket_server_bind(struct socket_server *ss, uintptr_t opaque, int fd) {
-	struct request_package request;
 	int id = reverve_id(ss);
-	request.u.bind.opaque = opaque;
-	request.u.bind.id = id;
-	request.u.bind.fd = fd;
-	send_request(ss, &request, 'B', sizeof(request.u.bind));
+	if (id < 0) {
+		return -1;
+	}
+	struct request_package * request = new_request(0);
+	request->u.bind.opaque = opaque;
+	request->u.bind.id = id;
+	request->u.bind.fd = fd;
+	send_request(shard_of(ss, id), request, 'B');
 	return id;
 }
 
 void 
 socket_server_start(struct socket_server *ss, uintptr_t opaque, int id) {
-	struct request_package request;
-	request.u.start.id = id;
-	request.u.start.opaque = opaque;
-	send_request(ss, &request, 'S', sizeof(request.u.start));
+	struct request_package * request = new_request(0);
+	request->u.start.id = id;
+	request->u.start.opaque = opaque;
+	send_request(shard_of(ss, id), request, 'S');
+}
+
+void
+socket_server_readslice(struct socket_server *ss, int slice) {
+	socket_buffer_pool_delete(ss->pool);
+	ss->pool = socket_buffer_pool_new(slice);
+}
+
+// udp
+
+// send the request now when addr is numeric or cached , otherwise it is sent by request_resolved later
+static void
+resolve_request(struct socket_server *ss, int id, struct request_package *request, char type, const char *addr, int port, struct socket_addrlist *list) {
+	struct socket_resolver * r = ss->storage->resolver;
+	request->type = type;
+	if (r == NULL || socket_resolver_query(r, addr, port, list, request)) {
+		send_request(shard_of(ss, id), request, type);
+	}
+}
+
+int
+socket_server_udp(struct socket_server *ss, uintptr_t opaque, const char * addr, int port) {
+	int fd = -1;
+	int family = AF_INET;
+	struct request_package * request = new_request(0);
+	request->u.udp.addr.n = 0;
+	if (addr && addr[0]) {
+		// bind to the address after it is resolved , see add_udp_socket
+		int id = reverve_id(ss);
+		if (id < 0) {
+			FREE(request);
+			return -1;
+		}
+		request->u.udp.id = id;
+		request->u.udp.fd = -1;
+		request->u.udp.opaque = opaque;
+		resolve_request(ss, id, request, 'U', addr, port, &request->u.udp.addr);
+		return id;
+	}
+	if (port != 0) {
+		union sockaddr_all sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.v4.sin_family = AF_INET;
+		sa.v4.sin_port = htons(port);
+		sa.v4.sin_addr.s_addr = INADDR_ANY;
+		fd = bind_udp(&sa.s, sizeof(sa.v4));
+	} else {
+		fd = socket(family, SOCK_DGRAM, 0);
+		if (fd >= 0) {
+			sp_nonblocking(fd);
+		}
+	}
+	if (fd < 0) {
+		FREE(request);
+		return -1;
+	}
+	int id = reverve_id(ss);
+	if (id < 0) {
+		close(fd);
+		FREE(request);
+		return -1;
+	}
+	request->u.udp.id = id;
+	request->u.udp.fd = fd;
+	request->u.udp.family = family;
+	request->u.udp.opaque = opaque;
+	send_request(shard_of(ss, id), request, 'U');
+	return id;
+}
+
+int
+socket_server_udp_connect(struct socket_server *ss, int id, const char * addr, int port) {
+	struct request_package * request = new_request(0);
+	request->u.set_udp.id = id;
+	request->u.set_udp.addr.n = 0;
+	resolve_request(ss, id, request, 'C', addr, port, &request->u.set_udp.addr);
+	return 0;
+}
+
+int
+socket_server_udp_send(struct socket_server *ss, int id, const struct socket_udp_address *addr, const void *buffer, int sz) {
+	struct socket * s = slot_of(ss, id);
+	if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
+		return -1;
+	}
+	const uint8_t * udp_address = (const uint8_t *)addr;
+	int addrsz = udp_address_size(udp_address);
+	if (addrsz == 0) {
+		return -1;
+	}
+	struct request_package * request = new_request(0);
+	request->u.send_udp.send.id = id;
+	request->u.send_udp.send.sz = sz;
+	request->u.send_udp.send.offset = 0;
+	request->u.send_udp.send.buffer = (char *)buffer;
+	memcpy(request->u.send_udp.address, udp_address, addrsz);
+	send_request(shard_of(ss, id), request, 'A');
+	return 0;
+}
+
+const struct socket_udp_address *
+socket_server_udp_address(struct socket_message *msg, int *addrsz) {
+	uint8_t * address = (uint8_t *)(msg->data + msg->ud);
+	*addrsz = udp_address_size(address);
+	if (*addrsz == 0) {
+		return NULL;
+	}
+	return (const struct socket_udp_address *)address;
+}
+
+void
+socket_server_watermark(struct socket_server *ss, int id, int high, int low) {
+	if (high < 0) {
+		high = 0;
+	}
+	if (low < 0 || low > high) {
+		low = high / 2;
+	}
+	struct request_package * request = new_request(0);
+	request->u.watermark.id = id;
+	request->u.watermark.high = high;
+	request->u.watermark.low = low;
+	send_request(shard_of(ss, id), request, 'W');
+}
+
+void
+socket_server_setopt(struct socket_server *ss, int id, int what, int value) {
+	struct request_package * request = new_request(0);
+	request->u.setopt.id = id;
+	request->u.setopt.what = what;
+	request->u.setopt.value = value;
+	send_request(shard_of(ss, id), request, 'T');
+}
+
+void
+socket_server_framing(struct socket_server *ss, int id, int header, int max) {
+	struct request_package * request = new_request(0);
+	request->u.framing.id = id;
+	request->u.framing.header = header;
+	request->u.framing.max = max;
+	send_request(shard_of(ss, id), request, 'P');
+}
+
+void
+socket_server_resolver(struct socket_server *ss, int threads, int ttl) {
+	if (ss->storage->resolver) {
+		socket_resolver_config(ss->storage->resolver, threads, ttl);
+	}
+}
+
+void
+socket_server_edge(struct socket_server *ss, int budget) {
+	ss->edge_budget = budget > 0 ? budget : 0;
+}
+
+void
+socket_server_idle(struct socket_server *ss, int enable) {
+	ss->idle_report = enable;
+}
+
+void
+socket_server_free_buffer(void *buffer) {
+	socket_buffer_free(buffer);
 }
 
+int
+socket_server_info(struct socket_server *ss, struct socket_info *info, int max) {
+	int n = 0;
+	int i;
+	for (i=0;i<=(int)ss->mask;i++) {
+		struct socket * s = &ss->slot[i];
+		int id = s->id;
+		int type;
+		switch (s->type) {
+		case SOCKET_TYPE_INVALID:
+		case SOCKET_TYPE_RESERVE:
+			continue;
+		case SOCKET_TYPE_PLISTEN:
+		case SOCKET_TYPE_LISTEN:
+			type = SOCKET_INFO_LISTEN;
+			break;
+		case SOCKET_TYPE_CONNECTING:
+			type = SOCKET_INFO_CONNECTING;
+			break;
+		case SOCKET_TYPE_BIND:
+			type = SOCKET_INFO_BIND;
+			break;
+		case SOCKET_TYPE_CONNECTED:
+		case SOCKET_TYPE_HALFCLOSE:
+			type = s->protocol == PROTOCOL_TCP ? SOCKET_INFO_TCP : SOCKET_INFO_UDP;
+			break;
+		default:
+			type = SOCKET_INFO_UNKNOWN;
+			break;
+		}
+		if (n < max) {
+			struct socket_info * si = &info[n];
+			si->id = id;
+			si->type = type;
+			si->opaque = s->opaque;
+			si->read = s->rbytes;
+			si->write = s->wbytes;
+			si->rcall = s->rcall;
+			si->wcall = s->wcall;
+			si->wbuffer = s->wb_size;
+			si->rtime = s->rtime;
+			si->wtime = s->wtime;
+			if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
+				// closed (or reused) while reading
+				continue;
+			}
+		}
+		++n;
+	}
+	return n;
+}
 
+void
+socket_server_stat(struct socket_server *ss, struct socket_server_stat *stat) {
+	memset(stat, 0, sizeof(*stat));
+	stat->recv_bytes = ss->recv_bytes;
+	stat->send_bytes = ss->send_bytes;
+	struct socket_buffer_stat bs;
+	socket_buffer_stat(&bs);
+	stat->rbuffer = bs.bytes;
+	stat->rbuffer_count = bs.buffers;
+	int i;
+	for (i=0;i<=(int)ss->mask;i++) {
+		stat->wbuffer += ss->slot[i].wb_size;
+		switch (ss->slot[i].type) {
+		case SOCKET_TYPE_INVALID:
+			break;
+		case SOCKET_TYPE_CONNECTED:
+			++stat->connected;
+			break;
+		case SOCKET_TYPE_PLISTEN:
+		case SOCKET_TYPE_LISTEN:
+			++stat->listen;
+			break;
+		default:
+			++stat->other;
+			break;
+		}
+	}
+}
@@ -10,6 +10,10 @@
 #define SOCKET_ACCEPT 3  // 被动连接建立 (Accept返回了连接的fd 但是未加入epoll来管理)
 #define SOCKET_ERROR 4   // error
 #define SOCKET_EXIT 5    // exit
+#define SOCKET_UDP 6	// udp datagram , ud is the size, the udp address is after the data
+#define SOCKET_WARNING 7	// write queue reaches the high watermark , ud is the queued K bytes
+#define SOCKET_WRITABLE 8	// write queue is under the low watermark after a warning
+#define SOCKET_IDLE 9	// nothing more in this round, the socket thread is going to wait. Only when socket_server_idle is on
 
 struct socket_server;
 
@@ -17,10 +21,17 @@ struct socket_message {
 	int id;     //fd
 	uintptr_t opaque;   //handle
 	int ud;	// for accept, ud is listen id ; for data, ud is size of data 
-	char * data;    //data
+	char * data;    //data ; for error, the reason (or NULL)
+	int offset;	// for data of framing , the packet is at data + offset
 };
 
-struct socket_server * socket_server_create();
+// shard is NULL , or another socket_server to share the socket id space with.
+// every shard needs its own poll thread, and new sockets are spread across the shards round robin.
+// Create all the shards before opening any socket, the api below can be called with any shard.
+// capacity is the max sockets of the space (rounded up to power of 2 , 0 for 65536), ignored when shard is given.
+struct socket_server * socket_server_create(struct socket_server *shard, int capacity);
+// the slot of socket id is id & (capacity - 1)
+int socket_server_capacity(struct socket_server *);
 void socket_server_release(struct socket_server *);
 int socket_server_poll(struct socket_server *, struct socket_message *result, int *more);
 
@@ -30,12 +41,115 @@ void socket_server_start(struct socket_server *, uintptr_t opaque, int id);
 
 // return -1 when error
 int socket_server_send(struct socket_server *, int id, const void * buffer, int sz);
+// queue sz bytes of file fd from offset , in order with socket_server_send. The data goes from file to socket by sendfile.
+// fd is owned by socket server after it returns 0 , and is closed when the segment is sent or the socket is closed
+int socket_server_sendfile(struct socket_server *, int id, int fd, int64_t offset, int sz);
 
 // ctrl command below returns id
+// addr of listen and connect may be a unix domain socket , "unix:path" or an absolute path (port is ignored)
 int socket_server_listen(struct socket_server *, uintptr_t opaque, const char * addr, int port, int backlog);
+// addr "" listens both ipv4 and ipv6 (dual stack "::"), or "0.0.0.0" when ipv6 is not available
+// flags of socket_listen_opt
+// SO_REUSEPORT : listen the same address many times (one per gate or socket thread), the kernel spreads the connections
+#define SOCKET_LISTEN_REUSEPORT 1
+// TCP_NODELAY on the accepted sockets
+#define SOCKET_LISTEN_NODELAY 2
+// ipv6 address (and "") doesn't accept ipv4 connections
+#define SOCKET_LISTEN_IPV6ONLY 4
+struct socket_listen_opt {
+	int flags;	// SOCKET_LISTEN_*
+	int rcvbuf;	// SO_RCVBUF and SO_SNDBUF of listen socket , inherited by the accepted sockets. 0 for default
+	int sndbuf;
+	int defer_accept;	// TCP_DEFER_ACCEPT seconds (linux) , the connection is accepted when the first data arrives. 0 for off
+};
+// opt is NULL for default
+int socket_server_listen_opt(struct socket_server *, uintptr_t opaque, const char * addr, int port, int backlog, const struct socket_listen_opt *opt);
 int socket_server_connect(struct socket_server *, uintptr_t opaque, const char * addr, int port);
+// SOCKET_ERROR "connect timeout" when it is not connected in timeout ms (resolving counts) , 0 for no timeout
+int socket_server_connect_timeout(struct socket_server *, uintptr_t opaque, const char * addr, int port, int timeout);
 int socket_server_bind(struct socket_server *, uintptr_t opaque, int fd);
 
-int socket_server_block_connect(struct socket_server *, uintptr_t opaque, const char * addr, int port);
+// udp socket , bound to addr:port when addr or port is given. return id , -1 when error
+// addr is resolved out of the caller thread , SOCKET_ERROR when it can't be bound
+int socket_server_udp(struct socket_server *, uintptr_t opaque, const char * addr, int port);
+// set the default peer , socket_server_send sends to it. SOCKET_ERROR when addr is unknown or of other family
+int socket_server_udp_connect(struct socket_server *, int id, const char * addr, int port);
+// opaque udp address , from socket_server_udp_address. buffer is freed like socket_server_send , return -1 when error
+struct socket_udp_address;
+int socket_server_udp_send(struct socket_server *, int id, const struct socket_udp_address *, const void *buffer, int sz);
+// the peer address of SOCKET_UDP message, NULL when invalid
+const struct socket_udp_address * socket_server_udp_address(struct socket_message *, int *addrsz);
+
+// watermarks of the bytes queued for writing , high 0 for off. low < 0 (or > high) for high/2
+// SOCKET_WARNING is reported once when the queue reaches high , SOCKET_WRITABLE when it is under low again
+void socket_server_watermark(struct socket_server *, int id, int high, int low);
+
+// socket options , set by socket thread. The socket must be opened (connect is not resolving)
+#define SOCKET_OPT_NODELAY 1	// TCP_NODELAY
+#define SOCKET_OPT_KEEPALIVE 2	// SO_KEEPALIVE
+#define SOCKET_OPT_KEEPIDLE 3	// seconds before the first keepalive probe
+#define SOCKET_OPT_SNDBUF 4	// SO_SNDBUF
+#define SOCKET_OPT_RCVBUF 5	// SO_RCVBUF
+#define SOCKET_OPT_QUICKACK 6	// TCP_QUICKACK (linux) , the kernel may turn it off later
+void socket_server_setopt(struct socket_server *, int id, int what, int value);
+
+// split the stream of tcp socket id into packets of 2 or 4 bytes big-endian size header (header 0 for off).
+// Every SOCKET_DATA is one packet without the header then , at data + offset. A packet in one read is
+// a slice of the read buffer without copy , socket_server_free_buffer(data) frees it. A packet larger than max (0 for 16M) closes
+// the socket with SOCKET_ERROR "packet too large". Call it before socket_server_start of an accepted socket,
+// the data read before it comes is not split.
+void socket_server_framing(struct socket_server *, int id, int header, int max);
+
+// call before poll. Host names of connect are resolved by threads (default 2) and cached for ttl seconds (default 60).
+// threads <= 0 or ttl < 0 keeps the default
+void socket_server_resolver(struct socket_server *, int threads, int ttl);
+// call before poll. Small reads share a block of slice bytes , 0 for off
+void socket_server_readslice(struct socket_server *, int slice);
+// call before poll. Data sockets are edge triggered and read until EAGAIN or budget bytes per event ,
+// and the data is reported in one SOCKET_DATA. 0 for level triggered (one read per event)
+void socket_server_edge(struct socket_server *, int budget);
+// report SOCKET_IDLE once before each wait , so the caller can flush what it holds of the round. It takes effect at the next round
+void socket_server_idle(struct socket_server *, int enable);
+// data of SOCKET_DATA is pooled, free it by this function in any thread
+void socket_server_free_buffer(void *buffer);
+
+struct socket_server_stat {
+	uint64_t recv_bytes;
+	uint64_t send_bytes;
+	int connected;
+	int listen;
+	int other;	// reserved, connecting, half closed, etc.
+	int64_t wbuffer;	// bytes queued to write
+	int64_t rbuffer;	// bytes of read buffers taken from malloc , pooled ones included
+	int64_t rbuffer_count;	// read buffers not freed by the receivers
+};
+
+// read without lock from other thread, the numbers may be a little stale.
+// traffic is of this shard only, the others are of the whole shared space (read buffers of all the socket_servers)
+void socket_server_stat(struct socket_server *, struct socket_server_stat *stat);
+
+#define SOCKET_INFO_UNKNOWN 0	// accepted but not started, etc.
+#define SOCKET_INFO_LISTEN 1
+#define SOCKET_INFO_TCP 2
+#define SOCKET_INFO_UDP 3
+#define SOCKET_INFO_BIND 4
+#define SOCKET_INFO_CONNECTING 5
+
+struct socket_info {
+	int id;
+	int type;	// SOCKET_INFO_*
+	uintptr_t opaque;
+	uint64_t read;	// bytes
+	uint64_t write;
+	uint64_t rcall;	// read / write syscalls
+	uint64_t wcall;
+	int64_t wbuffer;	// bytes queued for writing
+	uint64_t rtime;	// unix time of the last read / write , the open time before any
+	uint64_t wtime;
+};
+
+// snapshot of all the live sockets of the shared space, read without lock like socket_server_stat.
+// fill at most max sockets, and return the number of live sockets (call again with a larger array when it is > max)
+int socket_server_info(struct socket_server *, struct socket_info *info, int max);
 
 #endif
@@ -0,0 +1,808 @@
+#ifndef poll_socket_uring_h
+#define poll_socket_uring_h
+
+/*
+	io_uring backend , build with -DSOCKET_URING (linux 5.1+).
+	Every registration change (add/del/write) is queued as a poll sqe and submitted
+	with the next wait in one io_uring_enter, so a poll round of many sockets costs one syscall.
+	Polls are multishot (linux 5.13+) , they stay armed and post a cqe each time the socket
+	gets ready , so the sockets fired are not rearmed. It is edge triggered , socket_server calls
+	sp_again (level) or sp_edge (edge) when a socket is still ready after it is handled, and it is
+	reported by the next wait without the kernel. Older kernels fall back to one shot polls,
+	rearmed before the next wait.
+	The timeout of wait uses IORING_FEAT_EXT_ARG (linux 5.11+) , or a timeout sqe on older kernels.
+	With sp_recv and sp_accept (linux 5.7+ , probed) the ring does the io itself : a recv sqe reads into
+	the buffers provided to the ring , and an accept sqe accepts the connection. The result comes with the
+	event , the buffer is given back to the ring in the next wait. They are one shot , and rearmed before
+	the next wait , so one recv at most is in flight for a socket and the data is in order.
+	The rings and struct uring have no lock : only the socket thread calls sp_* (other threads send
+	requests through the ctrl queue of socket_server) , except sp_create and sp_release out of the poll loop.
+ */
+
+#include <netdb.h>
+#include <assert.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+
+#ifndef IORING_POLL_ADD_MULTI
+#define IORING_POLL_ADD_MULTI (1U << 0)
+#endif
+#ifndef IORING_CQE_F_MORE
+#define IORING_CQE_F_MORE (1U << 1)
+#endif
+
+#define URING_ENTRIES 1024
+// user_data of poll remove , cancel and provide buffers , its cqe is ignored
+#define URING_IGNORE ((uint64_t)-1)
+// user_data of timeout is (URING_TIMEOUT | seq) , the fd of a poll is never negative
+#define URING_TIMEOUT ((uint64_t)1 << 63)
+
+// the buffers of recv , owned by the ring
+#define URING_BUFFER_GROUP 0
+#define URING_BUFFER_SIZE 16384
+#define URING_BUFFER_COUNT 128
+
+// the op of a slot , in the low 2 bits of user_data
+#define URING_POLL 0
+#define URING_RECV 1
+#define URING_ACCEPT 2
+#define URING_GEN_MASK 0x3fffffff
+// user_data is (fd << 32 | gen << 2 | op) , the cqe of an old registration is ignored
+#define URING_DATA(sock, gen, op) ((uint64_t)(sock) << 32 | ((gen) & URING_GEN_MASK) << 2 | (op))
+#define URING_GEN(data) ((uint32_t)(data) >> 2)
+#define URING_OP(data) ((int)((data) & 3))
+
+struct uring_slot {
+	void * ud;
+	unsigned events;
+	uint32_t gen;	// of the poll
+	bool used;
+	bool armed;
+	unsigned round;	// ev is the index of the event reported in this round
+	int ev;
+	// recv or accept done by the ring , see sp_recv and sp_accept
+	int op;	// URING_POLL for none
+	uint32_t op_gen;
+	bool pending;	// the sqe of op is in flight
+	int size;	// max bytes of recv
+	struct sockaddr_storage * addr;	// the peer address of accept
+	socklen_t addrlen;
+};
+
+struct uring_again {
+	int sock;
+	uint32_t gen;
+};
+
+struct uring {
+	int fd;
+	// submission queue
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned * sq_array;
+	struct io_uring_sqe * sqes;
+	unsigned sq_pending;
+	// completion queue
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe * cqes;
+	void * sq_ptr;
+	size_t sq_sz;
+	void * cq_ptr;
+	size_t cq_sz;
+	size_t sqes_sz;
+	// sockets indexed by fd
+	struct uring_slot * slot;
+	int slot_cap;
+	// fds not armed (one shot fired , multishot ended or no sqe) , poll them again before wait
+	int * rearm;
+	int rearm_n;
+	int rearm_cap;
+	// polls to remove when sqe was not available
+	uint64_t * cancel;
+	int cancel_n;
+	int cancel_cap;
+	// sockets still ready , reported by the next wait
+	struct uring_again * again;
+	int again_n;
+	int again_cap;
+	unsigned round;
+	// recv buffers , the ones reported in this round are given back in the next wait
+	char * buffer;
+	uint16_t * ret;
+	int ret_n;
+	bool io;	// recv and accept are supported
+	bool multishot;
+	bool ext_arg;	// IORING_FEAT_EXT_ARG , wait with timeout
+	// timeout sqe for the kernels without ext_arg
+	uint64_t timer;	// user_data of the timeout pending , 0 for none
+	uint64_t timer_seq;
+	struct __kernel_timespec ts;
+};
+
+static bool
+sp_invalid(struct uring *u) {
+	return u == NULL;
+}
+
+static int
+_uring_enter(struct uring *u, unsigned submit, unsigned wait) {
+	return (int)syscall(__NR_io_uring_enter, u->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static void
+_uring_submit(struct uring *u) {
+	while (u->sq_pending > 0) {
+		int n = _uring_enter(u, u->sq_pending, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			// EBUSY : completion queue is full , submitted with the next wait after reap
+			return;
+		}
+		u->sq_pending -= n;
+	}
+}
+
+static struct io_uring_sqe *
+_uring_sqe(struct uring *u) {
+	unsigned tail = *u->sq_tail;
+	__sync_synchronize();
+	if (tail - *u->sq_head >= u->sq_entries) {
+		_uring_submit(u);
+		__sync_synchronize();
+		if (tail - *u->sq_head >= u->sq_entries)
+			return NULL;
+	}
+	unsigned idx = tail & u->sq_mask;
+	struct io_uring_sqe * sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[idx] = idx;
+	return sqe;
+}
+
+static void
+_uring_commit(struct uring *u) {
+	__sync_synchronize();
+	*u->sq_tail = *u->sq_tail + 1;
+	++u->sq_pending;
+}
+
+static struct uring_slot *
+_uring_slot(struct uring *u, int sock) {
+	if (sock >= u->slot_cap) {
+		int cap = u->slot_cap;
+		while (cap <= sock) {
+			cap *= 2;
+		}
+		u->slot = realloc(u->slot, cap * sizeof(struct uring_slot));
+		memset(u->slot + u->slot_cap, 0, (cap - u->slot_cap) * sizeof(struct uring_slot));
+		u->slot_cap = cap;
+	}
+	return &u->slot[sock];
+}
+
+static void
+_uring_rearm(struct uring *u, int sock) {
+	if (u->rearm_n >= u->rearm_cap) {
+		u->rearm_cap *= 2;
+		u->rearm = realloc(u->rearm, u->rearm_cap * sizeof(int));
+	}
+	u->rearm[u->rearm_n++] = sock;
+}
+
+static void
+_uring_poll(struct uring *u, int sock, struct uring_slot *s) {
+	if (s->events == 0) {
+		// only the op of ring
+		s->armed = false;
+		return;
+	}
+	struct io_uring_sqe * sqe = _uring_sqe(u);
+	if (sqe == NULL) {
+		// retry after the next submit
+		s->armed = false;
+		_uring_rearm(u, sock);
+		return;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = sock;
+	sqe->poll32_events = s->events;
+	sqe->len = u->multishot ? IORING_POLL_ADD_MULTI : 0;
+	sqe->user_data = URING_DATA(sock, s->gen, URING_POLL);
+	_uring_commit(u);
+	s->armed = true;
+}
+
+static void
+_uring_op(struct uring *u, int sock, struct uring_slot *s) {
+	struct io_uring_sqe * sqe = _uring_sqe(u);
+	if (sqe == NULL) {
+		_uring_rearm(u, sock);
+		return;
+	}
+	sqe->fd = sock;
+	if (s->op == URING_RECV) {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->len = s->size;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BUFFER_GROUP;
+	} else {
+		s->addrlen = sizeof(*s->addr);
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->addr = (uint64_t)(uintptr_t)s->addr;
+		sqe->addr2 = (uint64_t)(uintptr_t)&s->addrlen;
+		sqe->accept_flags = SOCK_NONBLOCK;
+	}
+	sqe->user_data = URING_DATA(sock, s->op_gen, s->op);
+	_uring_commit(u);
+	s->pending = true;
+}
+
+// give a recv buffer back to the ring , return false when no sqe
+static bool
+_uring_provide(struct uring *u, int bid, int n) {
+	struct io_uring_sqe * sqe = _uring_sqe(u);
+	if (sqe == NULL)
+		return false;
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = n;
+	sqe->addr = (uint64_t)(uintptr_t)(u->buffer + (size_t)bid * URING_BUFFER_SIZE);
+	sqe->len = URING_BUFFER_SIZE;
+	sqe->off = bid;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = URING_IGNORE;
+	_uring_commit(u);
+	return true;
+}
+
+static void
+_uring_return(struct uring *u, int bid) {
+	if (u->ret_n < URING_BUFFER_COUNT) {
+		u->ret[u->ret_n++] = (uint16_t)bid;
+	}
+}
+
+// return false when no sqe
+static bool
+_uring_remove(struct uring *u, int opcode, uint64_t target) {
+	struct io_uring_sqe * sqe = _uring_sqe(u);
+	if (sqe == NULL)
+		return false;
+	sqe->opcode = opcode;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = URING_IGNORE;
+	_uring_commit(u);
+	return true;
+}
+
+// return false when no sqe
+static bool
+_uring_target(struct uring *u, uint64_t target) {
+	int opcode = URING_OP(target) == URING_POLL ? IORING_OP_POLL_REMOVE : IORING_OP_ASYNC_CANCEL;
+	return _uring_remove(u, opcode, target);
+}
+
+static void
+_uring_kill(struct uring *u, uint64_t target) {
+	if (!_uring_target(u, target)) {
+		// the multishot poll (or the op in flight) holds the file , it must be removed
+		if (u->cancel_n >= u->cancel_cap) {
+			u->cancel_cap = u->cancel_cap ? u->cancel_cap * 2 : 16;
+			u->cancel = realloc(u->cancel, u->cancel_cap * sizeof(uint64_t));
+		}
+		u->cancel[u->cancel_n++] = target;
+	}
+}
+
+static void
+_uring_cancel(struct uring *u, int sock, struct uring_slot *s) {
+	if (s->armed) {
+		_uring_kill(u, URING_DATA(sock, s->gen, URING_POLL));
+		s->armed = false;
+	}
+	++s->gen;
+}
+
+// stop the op of ring , the socket is deleted or added again
+static void
+_uring_cancel_op(struct uring *u, int sock, struct uring_slot *s) {
+	if (s->pending) {
+		_uring_kill(u, URING_DATA(sock, s->op_gen, s->op));
+		s->pending = false;
+	}
+	++s->op_gen;
+	s->op = URING_POLL;
+}
+
+static void
+sp_release(struct uring *u) {
+	close(u->fd);
+	if (u->sq_ptr)
+		munmap(u->sq_ptr, u->sq_sz);
+	if (u->cq_ptr && u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_sz);
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_sz);
+	int i;
+	for (i=0;i<u->slot_cap;i++) {
+		free(u->slot[i].addr);
+	}
+	free(u->slot);
+	free(u->buffer);
+	free(u->ret);
+	free(u->rearm);
+	free(u->cancel);
+	free(u->again);
+	free(u);
+}
+
+static bool
+_uring_probe(struct uring *u) {
+	static const int opcode[] = { IORING_OP_RECV, IORING_OP_ACCEPT, IORING_OP_PROVIDE_BUFFERS, IORING_OP_ASYNC_CANCEL };
+	size_t sz = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe * p = malloc(sz);
+	memset(p, 0, sz);
+	// IORING_REGISTER_PROBE is linux 5.6+
+	bool ok = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, p, 256) == 0;
+	int i;
+	for (i=0;ok && i<(int)(sizeof(opcode)/sizeof(opcode[0]));i++) {
+		if (opcode[i] > p->last_op || !(p->ops[opcode[i]].flags & IO_URING_OP_SUPPORTED))
+			ok = false;
+	}
+	free(p);
+	return ok;
+}
+
+// provide all the recv buffers , and wait for the result
+static bool
+_uring_buffer(struct uring *u) {
+	u->buffer = malloc((size_t)URING_BUFFER_SIZE * URING_BUFFER_COUNT);
+	u->ret = malloc(URING_BUFFER_COUNT * sizeof(uint16_t));
+	if (!_uring_provide(u, 0, URING_BUFFER_COUNT))
+		return false;
+	for (;;) {
+		int n = _uring_enter(u, u->sq_pending, 1);
+		if (n >= 0) {
+			u->sq_pending -= n;
+			break;
+		}
+		if (errno != EINTR)
+			return false;
+	}
+	unsigned head = *u->cq_head;
+	__sync_synchronize();
+	if (head == *u->cq_tail)
+		return false;
+	int res = u->cqes[head & u->cq_mask].res;
+	__sync_synchronize();
+	*u->cq_head = head + 1;
+	return res >= 0;
+}
+
+static struct uring *
+sp_create() {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct uring * u = malloc(sizeof(*u));
+	memset(u, 0, sizeof(*u));
+	u->fd = fd;
+	u->ext_arg = (p.features & IORING_FEAT_EXT_ARG) != 0;
+	// turned off by the first -EINVAL of poll add
+	u->multishot = true;
+	u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_sz > u->sq_sz)
+			u->sq_sz = u->cq_sz;
+		u->cq_sz = u->sq_sz;
+	}
+	void * sq = mmap(NULL, u->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto _failed;
+	u->sq_ptr = sq;
+	void * cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, u->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto _failed;
+	}
+	u->cq_ptr = cq;
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	void * sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto _failed;
+	u->sqes = sqes;
+
+	u->sq_head = (unsigned *)((char *)sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)((char *)sq + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)((char *)sq + p.sq_off.ring_mask);
+	u->sq_entries = *(unsigned *)((char *)sq + p.sq_off.ring_entries);
+	u->sq_array = (unsigned *)((char *)sq + p.sq_off.array);
+	u->cq_head = (unsigned *)((char *)cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)cq + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)((char *)cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+
+	u->slot_cap = 64;
+	u->slot = malloc(u->slot_cap * sizeof(struct uring_slot));
+	memset(u->slot, 0, u->slot_cap * sizeof(struct uring_slot));
+	u->rearm_cap = 64;
+	u->rearm = malloc(u->rearm_cap * sizeof(int));
+	u->again_cap = 64;
+	u->again = malloc(u->again_cap * sizeof(struct uring_again));
+	u->io = _uring_probe(u) && _uring_buffer(u);
+	return u;
+_failed:
+	sp_release(u);
+	return NULL;
+}
+
+static int
+sp_add(struct uring *u, int sock, void *ud) {
+	struct uring_slot * s = _uring_slot(u, sock);
+	_uring_cancel(u, sock, s);
+	_uring_cancel_op(u, sock, s);
+	s->ud = ud;
+	s->events = POLLIN;
+	s->used = true;
+	// queued to rearm when there is no sqe now
+	_uring_poll(u, sock, s);
+	return 0;
+}
+
+static void
+sp_del(struct uring *u, int sock) {
+	if (sock >= u->slot_cap)
+		return;
+	struct uring_slot * s = &u->slot[sock];
+	_uring_cancel(u, sock, s);
+	_uring_cancel_op(u, sock, s);
+	s->used = false;
+	s->ud = NULL;
+}
+
+static void
+sp_write(struct uring *u, int sock, void *ud, bool enable) {
+	struct uring_slot * s = _uring_slot(u, sock);
+	// the socket is read by the op of ring , poll for write only
+	unsigned events = (s->op == URING_POLL ? POLLIN : 0) | (enable ? POLLOUT : 0);
+	if (s->used && s->ud == ud && s->events == events) {
+		return;
+	}
+	bool armed = s->armed;
+	bool idle = s->used && s->events == 0;
+	_uring_cancel(u, sock, s);
+	s->ud = ud;
+	s->events = events;
+	s->used = true;
+	if (armed || idle) {
+		// a new poll reports the socket at once if it is ready
+		_uring_poll(u, sock, s);
+	}
+	// not armed : in the rearm list, polled with new events before next wait
+}
+
+// switch an added sock to the op of ring , the poll of read is removed
+static bool
+_uring_switch(struct uring *u, int sock, int op) {
+	if (!u->io || sock >= u->slot_cap || !u->slot[sock].used)
+		return false;
+	struct uring_slot * s = &u->slot[sock];
+	if (s->op == op)
+		return true;
+	assert(s->op == URING_POLL);
+	s->op = op;
+	sp_write(u, sock, s->ud, (s->events & POLLOUT) != 0);
+	return true;
+}
+
+static bool
+sp_recv(struct uring *u, int sock, void *ud, int size) {
+	if (!_uring_switch(u, sock, URING_RECV))
+		return false;
+	struct uring_slot * s = &u->slot[sock];
+	s->size = size < URING_BUFFER_SIZE ? size : URING_BUFFER_SIZE;
+	if (!s->pending) {
+		_uring_op(u, sock, s);
+	}
+	return true;
+}
+
+static bool
+sp_accept(struct uring *u, int sock, void *ud) {
+	if (!_uring_switch(u, sock, URING_ACCEPT))
+		return false;
+	struct uring_slot * s = &u->slot[sock];
+	if (s->addr == NULL) {
+		s->addr = malloc(sizeof(*s->addr));
+	}
+	if (!s->pending) {
+		_uring_op(u, sock, s);
+	}
+	return true;
+}
+
+static void
+sp_again(struct uring *u, int sock, void *ud) {
+	if (sock >= u->slot_cap || !u->slot[sock].used)
+		return;
+	if (u->slot[sock].op == URING_RECV) {
+		// the next recv is in flight already , a read now may be out of order
+		return;
+	}
+	if (u->again_n >= u->again_cap) {
+		u->again_cap *= 2;
+		u->again = realloc(u->again, u->again_cap * sizeof(struct uring_again));
+	}
+	struct uring_again * a = &u->again[u->again_n++];
+	a->sock = sock;
+	a->gen = u->slot[sock].gen;
+}
+
+static void
+sp_edge(struct uring *u, int sock, void *ud, bool write) {
+	// polls are edge triggered already , rearm is to report it again
+	sp_write(u, sock, ud, write);
+	sp_again(u, sock, ud);
+}
+
+// wait for one completion in timeout ms , submit before it. return -1 and ETIME when timeout
+static int
+_uring_wait(struct uring *u, int timeout) {
+	struct __kernel_timespec ts;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000LL;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+	return (int)syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+// queue a timeout sqe for the kernels without ext_arg , return false when no sqe
+static bool
+_uring_timer(struct uring *u, int timeout) {
+	struct io_uring_sqe * sqe = _uring_sqe(u);
+	if (sqe == NULL)
+		return false;
+	u->ts.tv_sec = timeout / 1000;
+	u->ts.tv_nsec = (timeout % 1000) * 1000000LL;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)&u->ts;
+	sqe->len = 1;
+	// off 0 : pure timer , not counting completions
+	sqe->off = 0;
+	u->timer = URING_TIMEOUT | ++u->timer_seq;
+	sqe->user_data = u->timer;
+	_uring_commit(u);
+	return true;
+}
+
+static struct event *
+_uring_event(struct uring *u, struct event *e, int *n, struct uring_slot *s, unsigned flag) {
+	bool write = (flag & POLLOUT) != 0;
+	// the error of the socket read by recv is reported by recv
+	bool read = (flag & (POLLIN | POLLHUP | POLLERR)) != 0 && (s->op != URING_RECV || (flag & POLLIN));
+	if (s->round == u->round) {
+		// reported in this round already
+		e[s->ev].write |= write;
+		e[s->ev].read |= read;
+		return &e[s->ev];
+	}
+	s->round = u->round;
+	s->ev = *n;
+	e[*n].s = s->ud;
+	e[*n].write = write;
+	e[*n].read = read;
+	e[*n].done = false;
+	++*n;
+	return &e[s->ev];
+}
+
+// the cqe of recv or accept
+static void
+_uring_done(struct uring *u, struct event *e, int *n, int sock, struct io_uring_cqe *cqe) {
+	struct uring_slot * s = &u->slot[sock];
+	bool buffer = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+	int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	if (!s->used || (s->op_gen & URING_GEN_MASK) != URING_GEN(cqe->user_data)) {
+		if (buffer) {
+			_uring_return(u, bid);
+		}
+		if (URING_OP(cqe->user_data) == URING_ACCEPT && cqe->res >= 0) {
+			close(cqe->res);
+		}
+		return;
+	}
+	s->pending = false;
+	_uring_rearm(u, sock);
+	if (cqe->res == -ECANCELED)
+		return;
+	if (cqe->res == -ENOBUFS) {
+		// all the buffers are in use , read it as a read event in this round
+		_uring_event(u, e, n, s, POLLIN);
+		return;
+	}
+	struct event * ev = _uring_event(u, e, n, s, 0);
+	ev->done = true;
+	ev->res = cqe->res;
+	if (s->op == URING_RECV) {
+		ev->data = NULL;
+		if (buffer) {
+			ev->data = u->buffer + (size_t)bid * URING_BUFFER_SIZE;
+			_uring_return(u, bid);
+		}
+	} else {
+		ev->data = s->addr;
+		ev->sz = s->addrlen;
+	}
+}
+
+static int
+sp_wait(struct uring *u, struct event *e, int max, int timeout) {
+	int i;
+	int n = u->cancel_n;
+	u->cancel_n = 0;
+	for (i=0;i<n;i++) {
+		if (!_uring_target(u, u->cancel[i])) {
+			memmove(u->cancel, u->cancel + i, (n - i) * sizeof(uint64_t));
+			u->cancel_n = n - i;
+			break;
+		}
+	}
+	if (u->timer) {
+		// the timeout of last wait didn't fire
+		if (_uring_remove(u, IORING_OP_TIMEOUT_REMOVE, u->timer)) {
+			u->timer = 0;
+		}
+	}
+	// the buffers reported in last round are used up
+	n = u->ret_n;
+	u->ret_n = 0;
+	for (i=0;i<n;i++) {
+		if (!_uring_provide(u, u->ret[i], 1)) {
+			memmove(u->ret, u->ret + i, (n - i) * sizeof(uint16_t));
+			u->ret_n = n - i;
+			break;
+		}
+	}
+	// _uring_poll and _uring_op append the failed ones , never beyond i
+	n = u->rearm_n;
+	u->rearm_n = 0;
+	for (i=0;i<n;i++) {
+		int sock = u->rearm[i];
+		struct uring_slot * s = &u->slot[sock];
+		if (s->used && !s->armed) {
+			_uring_poll(u, sock, s);
+		}
+		if (s->used && s->op != URING_POLL && !s->pending) {
+			_uring_op(u, sock, s);
+		}
+	}
+	++u->round;
+	n = 0;
+	// the sockets still ready , without the kernel
+	int again = 0;
+	for (i=0;i<u->again_n;i++) {
+		struct uring_again * a = &u->again[i];
+		struct uring_slot * s = &u->slot[a->sock];
+		if (!s->used || s->gen != a->gen)
+			continue;
+		if (n >= max) {
+			u->again[again++] = *a;
+			continue;
+		}
+		_uring_event(u, e, &n, s, POLLIN);
+	}
+	u->again_n = again;
+	for (;;) {
+		unsigned head = *u->cq_head;
+		__sync_synchronize();
+		unsigned tail = *u->cq_tail;
+		bool timeout_fired = false;
+		while (head != tail && n < max) {
+			struct io_uring_cqe * cqe = &u->cqes[head & u->cq_mask];
+			++head;
+			if (cqe->user_data == URING_IGNORE)
+				continue;
+			if (cqe->user_data & URING_TIMEOUT) {
+				if (cqe->user_data == u->timer) {
+					u->timer = 0;
+					timeout_fired = true;
+				}
+				continue;
+			}
+			int sock = (int)(cqe->user_data >> 32);
+			if (URING_OP(cqe->user_data) != URING_POLL) {
+				_uring_done(u, e, &n, sock, cqe);
+				continue;
+			}
+			struct uring_slot * s = &u->slot[sock];
+			if (!s->used || (s->gen & URING_GEN_MASK) != URING_GEN(cqe->user_data))
+				continue;
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				// one shot fired , or multishot ended (error , overflow)
+				s->armed = false;
+				_uring_rearm(u, sock);
+			}
+			if (cqe->res == -ECANCELED)
+				continue;
+			if (cqe->res == -EINVAL && u->multishot) {
+				// kernel before 5.13
+				u->multishot = false;
+				continue;
+			}
+			_uring_event(u, e, &n, s, cqe->res < 0 ? POLLERR : (unsigned)cqe->res);
+		}
+		__sync_synchronize();
+		*u->cq_head = head;
+		if (n > 0) {
+			// changes queued by the handlers since last wait , don't let them wait for an idle round
+			_uring_submit(u);
+			return n;
+		}
+		if (timeout_fired || timeout == 0) {
+			_uring_submit(u);
+			return 0;
+		}
+		if (timeout > 0 && u->ext_arg) {
+			_uring_submit(u);
+			if (_uring_wait(u, timeout) < 0) {
+				if (errno == ETIME) {
+					// reap the completions of the last moment, or timeout
+					timeout = 0;
+					continue;
+				}
+				if (errno == EBUSY || errno == EINTR)
+					continue;
+				return -1;
+			}
+			continue;
+		}
+		if (timeout > 0 && u->timer == 0 && !_uring_timer(u, timeout)) {
+			// no sqe for the timer , don't sleep over the deadline
+			_uring_submit(u);
+			return 0;
+		}
+		int r = _uring_enter(u, u->sq_pending, 1);
+		if (r < 0) {
+			if (errno == EBUSY || errno == EINTR)
+				continue;
+			return -1;
+		}
+		u->sq_pending -= r;
+	}
+}
+
+static void
+sp_nonblocking(int fd) {
+	int flag = fcntl(fd, F_GETFL, 0);
+	if ( -1 == flag ) {
+		return;
+	}
+
+	fcntl(fd, F_SETFL, flag | O_NONBLOCK);
+}
+
+#endif